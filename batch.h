@@ -0,0 +1,240 @@
+//
+// Overview: batch runner for many independent scenarios.
+//
+// Every input file is one task on a work-stealing pool. A worker keeps one
+// world for its whole life and clears it between scenarios, so the pools and
+// tables warmed up by one file are reused by the next instead of being
+// rebuilt per process. Each input gets its own output file (compressed when
+// --output-dir keeps a .gz or .zst name, see compress.h).
+//
+
+#ifndef FANTASY_BATCH_H
+#define FANTASY_BATCH_H
+
+#include "algorithm"
+#include "chrono"
+#include "exception"
+#include "filesystem"
+#include "fstream"
+#include "memory"
+#include "mutex"
+#include "ostream"
+#include "set"
+#include "string"
+#include "utility"
+#include "vector"
+
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "input.h"
+#include "output.h"
+#include "scenario.h"
+#include "thread_pool.h"
+
+
+// Settings of a batch run
+struct BatchOptions {
+    unsigned jobs = 0;          // Worker threads, 0 for one per core
+    std::string outputDir;      // Outputs go here under the input's file name; empty: next to the input
+    std::string sink = "file";  // file, memory or null
+    SinkOptions sinkOptions;    // Output buffering of every scenario
+};
+
+// Totals of a batch run
+struct BatchReport {
+    unsigned long long files = 0;       // Scenarios run to the end
+    unsigned long long failed = 0;      // Scenarios that could not be opened or were cut short
+    unsigned long long commands = 0;    // Commands executed over all scenarios
+    unsigned long long inputBytes = 0;  // Scenario bytes read
+    unsigned long long outputBytes = 0; // Narration bytes written
+    double seconds = 0;                 // Wall time of the whole batch
+    unsigned jobs = 0;                  // Worker threads used
+};
+
+// Suffix of the output written next to an input
+const char* const BATCH_OUTPUT_SUFFIX = ".out";
+
+// Inputs named by a batch argument: the regular files of a directory in name
+// order (skipping earlier outputs), or the lines of a list file.
+// Returns false if the argument can be neither.
+inline bool collectBatchInputs(const std::string& source, std::vector<std::string>& inputs) {
+    namespace fs = std::filesystem;
+    std::error_code error;
+    if (fs::is_directory(source, error)) {
+        for (const fs::directory_entry& entry : fs::directory_iterator(source, error)) {
+            const fs::path& path = entry.path();
+            if (entry.is_regular_file(error) && path.extension() != BATCH_OUTPUT_SUFFIX) {
+                inputs.push_back(path.string());
+            }
+        }
+        std::sort(inputs.begin(), inputs.end());
+        return !error;
+    }
+    std::ifstream list(source);
+    if (!list.is_open()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            inputs.push_back(line);
+        }
+    }
+    return true;
+}
+
+// Files of a batch's inputs, by device and inode
+using BatchFiles = std::set<std::pair<dev_t, ino_t>>;
+
+inline BatchFiles batchFilesOf(const std::vector<std::string>& inputs) {
+    BatchFiles files;
+    for (const std::string& input : inputs) {
+        struct stat info {};
+        if (::stat(input.c_str(), &info) == 0) {
+            files.emplace(info.st_dev, info.st_ino);
+        }
+    }
+    return files;
+}
+
+inline bool isBatchFile(const std::string& path, const BatchFiles& files) {
+    struct stat info {};
+    return ::stat(path.c_str(), &info) == 0 && files.count({info.st_dev, info.st_ino}) != 0;
+}
+
+// Where the narration of an input goes. A name that is one of the inputs
+// (e.g. --output-dir is the input directory) gets BATCH_OUTPUT_SUFFIX, so no
+// input is written over; empty if that one is an input too.
+inline std::string batchOutputPath(const std::string& input, const BatchOptions& options, const BatchFiles& inputs) {
+    std::string path = options.outputDir.empty()
+            ? input + BATCH_OUTPUT_SUFFIX
+            : (std::filesystem::path(options.outputDir) / std::filesystem::path(input).filename()).string();
+    if (!isBatchFile(path, inputs)) {
+        return path;
+    }
+    path += BATCH_OUTPUT_SUFFIX;
+    return isBatchFile(path, inputs) ? std::string() : path;
+}
+
+// Run every input in its own world of type W, in parallel.
+// Problems with single files are reported to errors and counted as failed.
+template<typename W>
+BatchReport runBatch(const std::vector<std::string>& inputs, const BatchOptions& options, std::ostream& errors) {
+    // Counters of one worker, on their own cache line so workers never share one
+    struct alignas(64) WorkerTotals {
+        unsigned long long files = 0;
+        unsigned long long failed = 0;
+        unsigned long long commands = 0;
+        unsigned long long inputBytes = 0;
+        unsigned long long outputBytes = 0;
+    };
+
+    if (!options.outputDir.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(options.outputDir, error);
+    }
+
+    const BatchFiles inputFiles = batchFilesOf(inputs);
+    auto start = std::chrono::steady_clock::now();
+    std::mutex errorLock;   // Keeps the messages of different workers apart
+    std::vector<WorkerTotals> totals;
+    std::vector<std::unique_ptr<W>> worlds;
+    {
+        WorkStealingPool pool(options.jobs);
+        totals.resize(pool.size());
+        for (unsigned i = 0; i < pool.size(); i++) {
+            worlds.push_back(std::make_unique<W>());
+        }
+
+        for (const std::string& input : inputs) {
+            pool.submit([&, input](unsigned worker) {
+                WorkerTotals& mine = totals[worker];
+                auto fail = [&](const char* what) {
+                    std::lock_guard<std::mutex> guard(errorLock);
+                    errors << "batch: " << input << ": " << what << "\n";
+                    mine.failed++;
+                };
+
+                InputReader inputFile(input);
+                if (!inputFile.is_open()) {
+                    fail("cannot read input");
+                    return;
+                }
+                std::unique_ptr<OutputTarget> target;
+                if (options.sink == "null") {
+                    target = std::make_unique<NullTarget>();
+                }
+                else if (options.sink == "memory") {
+                    target = std::make_unique<MemoryTarget>();
+                }
+                else {
+                    std::string output = batchOutputPath(input, options, inputFiles);
+                    if (output.empty()) {
+                        fail("every output name for it is one of the inputs");
+                        return;
+                    }
+                    target = openOutputFile(output);
+                    if (target == nullptr) {
+                        fail("cannot write output");
+                        return;
+                    }
+                }
+
+                W& world = *worlds[worker];
+                world.clear();
+                OutputSink outputFile(*target, options.sinkOptions);
+                bool ran = false;
+                try {
+                    mine.commands += runScenario(inputFile, world, outputFile);
+                    ran = true;
+                }
+                catch (const std::exception& error) {
+                    fail(error.what());
+                }
+                outputFile.flush();
+                if (ran && inputFile.isDamaged()) {
+                    fail(inputFile.problem().c_str());
+                }
+                else if (ran && !target->close()) {
+                    fail("cannot write output");
+                }
+                else if (ran) {
+                    mine.files++;
+                }
+                mine.inputBytes += inputFile.offset();
+                mine.outputBytes += outputFile.bytesWritten();
+            });
+        }
+        pool.wait();
+    }   // Workers are joined here
+
+    BatchReport report;
+    report.jobs = static_cast<unsigned>(totals.size());
+    for (const WorkerTotals& worker : totals) {
+        report.files += worker.files;
+        report.failed += worker.failed;
+        report.commands += worker.commands;
+        report.inputBytes += worker.inputBytes;
+        report.outputBytes += worker.outputBytes;
+    }
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return report;
+}
+
+// One line summary of a batch: totals and rates
+inline void printBatchReport(const BatchReport& report, std::ostream& out) {
+    double seconds = report.seconds > 0 ? report.seconds : 1e-9;
+    double megabytes = static_cast<double>(report.inputBytes) / (1024.0 * 1024.0);
+    out << "batch: " << report.files << " files (" << report.failed << " failed) on "
+        << report.jobs << " threads, " << report.commands << " commands, "
+        << report.inputBytes << " bytes in, " << report.outputBytes << " bytes out, "
+        << seconds << " s: " << static_cast<double>(report.files) / seconds << " files/s, "
+        << static_cast<double>(report.commands) / seconds << " commands/s, "
+        << megabytes / seconds << " MiB/s\n";
+}
+
+#endif //FANTASY_BATCH_H
@@ -0,0 +1,330 @@
+//
+// Overview: benchmark of a scenario, phase by phase.
+//
+//   parse:       reading and parsing every line, names interned, nothing executed
+//   simulate:    executing commands parsed in advance, narration thrown away
+//   end-to-end:  the serial run, narration written to /dev/null
+//
+// Each phase runs in a child process of its own, so the peak RSS reported for
+// it (from wait4) is that of the phase alone. The simulate phase also runs
+// the scenario a second time on a fresh world timing every command, for the
+// cost per command type; the cost of reading the clock is measured first and
+// taken off (so commands cheaper than the clock itself show as 0).
+//
+
+#ifndef FANTASY_BENCH_H
+#define FANTASY_BENCH_H
+
+#include "algorithm"
+#include "chrono"
+#include "cstddef"
+#include "cstdio"
+#include "iostream"
+#include "memory"
+#include "sstream"
+#include "string"
+#include "string_view"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "output.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "scan.h"
+#include "scenario.h"
+
+
+// What a phase sends back to the parent, through a pipe
+struct BenchResult {
+    bool ok;
+    double seconds;
+    unsigned long long commands;
+    unsigned long long typeCount[COMMAND_TYPES];
+    double typeSeconds[COMMAND_TYPES];
+    long peakKib;               // Filled in by the parent
+};
+
+inline double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Read a whole scenario into a batch: text, parsed commands and their names
+// resolved against names
+inline bool loadScenario(const std::string& path, CommandBatch& batch, SymbolTable& names) {
+    InputReader inputFile(path);
+    if (!inputFile.is_open()) {
+        return false;
+    }
+    std::string_view line;
+    inputFile.nextLine(line);   // The first line is the number of commands
+    while (inputFile.nextBlock(line, CommandBatch::MAX_BYTES)) {
+        batch.append(line);
+    }
+    CommandParser parser;
+    batch.parse(parser);
+    for (Command& command : batch.commands) {
+        resolveNames(command, names);
+    }
+    return true;
+}
+
+inline BenchResult benchParse(const std::string& path) {
+    BenchResult result = {};
+    InputReader inputFile(path);
+    if (!inputFile.is_open()) {
+        return result;
+    }
+    SymbolTable names;
+    CommandParser parser(&names);
+    std::string_view line;
+    auto start = std::chrono::steady_clock::now();
+    inputFile.nextLine(line);   // The first line is the number of commands
+    while (inputFile.nextLine(line)) {
+        Command command = parser.parse(line);
+        result.typeCount[commandTypeOf(command)]++;
+        result.commands++;
+    }
+    result.seconds = secondsSince(start);
+    result.ok = true;
+    return result;
+}
+
+template<typename W>
+BenchResult benchSimulate(const std::string& path) {
+    BenchResult result = {};
+    CommandBatch batch;
+    auto world = std::make_unique<W>();
+    if (!loadScenario(path, batch, world->names)) {
+        return result;
+    }
+    NullTarget target;
+    {
+        OutputSink outputFile(target);
+        auto start = std::chrono::steady_clock::now();
+        for (const Command& command : batch.commands) {
+            execute(command, *world, outputFile);
+        }
+        outputFile.flush();
+        result.seconds = secondsSince(start);
+        result.commands = batch.commands.size();
+    }
+
+    // Cost of reading the clock twice, taken off every timed command
+    const int CALIBRATION = 100000;
+    auto calibrationStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < CALIBRATION; i++) {
+        auto before = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::now();
+        (void) before;
+    }
+    double overhead = secondsSince(calibrationStart) / CALIBRATION;
+
+    world = std::make_unique<W>();
+    for (Command& command : batch.commands) {
+        resolveNames(command, world->names);    // Same ids again, for the fresh table
+    }
+    OutputSink outputFile(target);
+    for (const Command& command : batch.commands) {
+        int type = commandTypeOf(command);
+        auto before = std::chrono::steady_clock::now();
+        execute(command, *world, outputFile);
+        auto after = std::chrono::steady_clock::now();
+        result.typeCount[type]++;
+        result.typeSeconds[type] += std::chrono::duration<double>(after - before).count() - overhead;
+    }
+    outputFile.flush();
+    result.ok = true;
+    return result;
+}
+
+template<typename W>
+BenchResult benchEndToEnd(const std::string& path) {
+    BenchResult result = {};
+    auto start = std::chrono::steady_clock::now();
+    InputReader inputFile(path);
+    FdTarget target("/dev/null");
+    if (!inputFile.is_open() || !target.is_open()) {
+        return result;
+    }
+    auto world = std::make_unique<W>();
+    OutputSink outputFile(target);
+    result.commands = runScenario(inputFile, *world, outputFile);
+    outputFile.flush();
+    result.seconds = secondsSince(start);
+    result.ok = true;
+    return result;
+}
+
+// Run phase in a child process and collect its result and peak RSS
+template<typename Phase>
+BenchResult runBenchPhase(Phase phase) {
+    BenchResult result = {};
+    int channel[2];
+    if (::pipe(channel) != 0) {
+        return result;
+    }
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t child = ::fork();
+    if (child == 0) {
+        ::close(channel[0]);
+        BenchResult measured = phase();
+        ssize_t sent = ::write(channel[1], &measured, sizeof(measured));
+        ::_exit(sent == static_cast<ssize_t>(sizeof(measured)) ? 0 : 1);
+    }
+    ::close(channel[1]);
+    if (child < 0) {
+        ::close(channel[0]);
+        return result;
+    }
+    ssize_t got = ::read(channel[0], &result, sizeof(result));
+    ::close(channel[0]);
+    int status = 0;
+    struct rusage usage {};
+    ::wait4(child, &status, 0, &usage);
+    if (got != static_cast<ssize_t>(sizeof(result)) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        result.ok = false;
+    }
+    result.peakKib = usage.ru_maxrss;
+    return result;
+}
+
+// Benchmark the scenario at path on world type W and print the report to out.
+// Returns false if a phase fails.
+template<typename W>
+bool runBenchmark(const std::string& path, std::ostream& out) {
+    const char* phaseNames[3] = {"parse", "simulate", "end-to-end"};
+    BenchResult results[3] = {
+            runBenchPhase([&] { return benchParse(path); }),
+            runBenchPhase([&] { return benchSimulate<W>(path); }),
+            runBenchPhase([&] { return benchEndToEnd<W>(path); })};
+
+    char row[128];
+    out << "benchmark: " << path << "\n";
+    std::snprintf(row, sizeof(row), "%-12s %12s %12s %14s %12s\n",
+                  "phase", "commands", "seconds", "commands/s", "peak KiB");
+    out << row;
+    for (int i = 0; i < 3; i++) {
+        if (!results[i].ok) {
+            out << phaseNames[i] << ": failed\n";
+            return false;
+        }
+        double seconds = results[i].seconds > 0 ? results[i].seconds : 1e-9;
+        std::snprintf(row, sizeof(row), "%-12s %12llu %12.4f %14.0f %12ld\n", phaseNames[i],
+                      results[i].commands, results[i].seconds, static_cast<double>(results[i].commands) / seconds,
+                      results[i].peakKib);
+        out << row;
+    }
+
+    const BenchResult& simulated = results[1];
+    std::snprintf(row, sizeof(row), "\n%-18s %12s %14s\n", "command type", "count", "ns/command");
+    out << row;
+    for (int type = 0; type < COMMAND_TYPES; type++) {
+        if (simulated.typeCount[type] == 0) {
+            continue;
+        }
+        std::snprintf(row, sizeof(row), "%-18s %12llu %14.1f\n", COMMAND_TYPE_NAMES[type], simulated.typeCount[type],
+                      std::max(0.0, simulated.typeSeconds[type] * 1e9 / static_cast<double>(simulated.typeCount[type])));
+        out << row;
+    }
+    return true;
+}
+
+// Speed of splitting a whole scenario into lines and tokens, in GB/s, for:
+//   getline+stringstream  the original reading loop, std::string per line and token
+//   memchr+find           InputReader-style lines, splitTokens() per line
+//   scan-<kernel>         scanDelimiters() over the block, splitTokensAt() per line
+// Each is the best of a few runs over the file held in memory.
+inline bool runScanBenchmark(const std::string& path, std::ostream& out) {
+    std::string text;
+    {
+        InputReader inputFile(path);
+        if (!inputFile.is_open()) {
+            return false;
+        }
+        std::string_view block;
+        while (inputFile.nextBlock(block, 64 << 20)) {
+            text.append(block);
+        }
+    }
+    const int RUNS = 5;
+    char row[128];
+    out << "scan benchmark: " << path << ", " << text.size() << " bytes\n";
+    std::snprintf(row, sizeof(row), "%-24s %12s %10s\n", "method", "tokens", "GB/s");
+    out << row;
+    auto report = [&](const char* name, auto method) {
+        double best = 1e30;
+        unsigned long long tokens = 0;
+        for (int run = 0; run < RUNS; run++) {
+            auto start = std::chrono::steady_clock::now();
+            tokens = method();
+            best = std::min(best, secondsSince(start));
+        }
+        std::snprintf(row, sizeof(row), "%-24s %12llu %10.3f\n", name, tokens,
+                      static_cast<double>(text.size()) / std::max(best, 1e-9) / 1e9);
+        out << row;
+    };
+
+    report("getline+stringstream", [&] {
+        unsigned long long tokens = 0;
+        std::istringstream input(text);
+        std::string line, token;
+        while (std::getline(input, line)) {
+            std::istringstream words(line);
+            while (std::getline(words, token, ' ')) {
+                tokens++;
+            }
+        }
+        return tokens;
+    });
+    report("memchr+find", [&] {
+        unsigned long long tokens = 0;
+        std::vector<std::string_view> words;
+        std::string_view rest = text;
+        while (!rest.empty()) {
+            std::size_t end = rest.find('\n');
+            std::string_view line = rest.substr(0, end);
+            splitTokens(line, words);
+            tokens += words.size();
+            rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+        }
+        return tokens;
+    });
+    for (ScanKernel kernel : availableScanKernels()) {
+        std::string name = std::string("scan-") + scanKernelName(kernel);
+        report(name.c_str(), [&] {
+            unsigned long long tokens = 0;
+            std::vector<std::string_view> words;
+            ScanOffsets scan;
+            std::size_t done = 0;
+            while (done < text.size()) {    // In batch-sized blocks, as the pipeline does
+                std::size_t size = std::min(text.size() - done, CommandBatch::MAX_BYTES);
+                const char* block = text.data() + done;
+                kernel(block, size, scan);
+                std::size_t start = 0;
+                std::size_t space = 0;
+                for (std::uint32_t end : scan.newlines) {
+                    std::size_t first = space;
+                    while (space < scan.spaces.size() && scan.spaces[space] < end) {
+                        space++;
+                    }
+                    splitTokensAt(std::string_view(block + start, end - start), scan.spaces.data() + first,
+                                  space - first, start, words);
+                    tokens += words.size();
+                    start = end + 1;
+                }
+                done += start;  // A line cut by the block boundary starts the next block
+                if (start == 0) {
+                    break;      // A line longer than a block: not in the benchmark's inputs
+                }
+            }
+            return tokens;
+        });
+    }
+    return true;
+}
+
+#endif //FANTASY_BENCH_H
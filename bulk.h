@@ -0,0 +1,111 @@
+//
+// Overview: batched hit point updates for the area-of-effect commands.
+//
+// Volley, Unleash and Share act on a whole group of characters. The handlers
+// first resolve the group, then change the hit points of all of it in one
+// pass and remove the dead in one sweep, and only then narrate, target by
+// target, the same lines the single commands would.
+//
+// addHitPoints() is that pass for hit points kept in one contiguous array
+// (the structure-of-arrays engine): the AVX2 kernel gathers 8 of them at a
+// time, adds and tests for death in registers, and stores them back one by
+// one (AVX2 has no scatter). It is picked once, like the scan kernels.
+//
+
+#ifndef FANTASY_BULK_H
+#define FANTASY_BULK_H
+
+#include "algorithm"
+#include "cstddef"
+#include "cstdint"
+#include "vector"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FANTASY_BULK_X86 1
+#endif
+
+#include "parser.h"
+
+
+// Buffers of the area-of-effect handlers, kept by the world so that a
+// command allocates nothing once they have grown. One set per world is
+// enough: these commands never run alongside others (see isBarrier).
+template<typename Target>
+struct BulkScratch {
+    std::vector<Target> named;          // Per name on the line, the character or the "none" value
+    std::vector<Target> found;          // The characters in town, in order
+    std::vector<Target> keys;           // Sorted copy of found, to look for repeats
+    std::vector<Target> dead;           // Characters to remove once the narration is written
+    std::vector<std::uint8_t> died;     // Per entry of found, whether it died
+};
+
+// Number of targets of a Volley or Share: between 1 and the names on the line.
+// False if it is out of range.
+inline bool bulkCount(const Command& command, std::size_t& count) {
+    int value = numberOf(command);
+    if (!(1 <= value && command.rest.size() >= static_cast<std::size_t>(value))) {
+        return false;
+    }
+    count = static_cast<std::size_t>(value);
+    return true;
+}
+
+// Whether no value occurs twice in values; keys is overwritten with them, sorted
+template<typename T>
+bool allDistinct(const std::vector<T>& values, std::vector<T>& keys) {
+    keys.assign(values.begin(), values.end());
+    std::sort(keys.begin(), keys.end());
+    return std::adjacent_find(keys.begin(), keys.end()) == keys.end();
+}
+
+// Add delta to hp[slots[i]] for every i, and set died[i] to whether that
+// left it at 0 or below. The slots must be distinct.
+using HitPointKernel = void (*)(int* hp, const std::uint32_t* slots, std::size_t count, int delta, std::uint8_t* died);
+
+inline void addHitPointsScalar(int* hp, const std::uint32_t* slots, std::size_t count, int delta, std::uint8_t* died) {
+    for (std::size_t i = 0; i < count; i++) {
+        int value = hp[slots[i]] + delta;
+        hp[slots[i]] = value;
+        died[i] = value <= 0;
+    }
+}
+
+#ifdef FANTASY_BULK_X86
+
+__attribute__((target("avx2")))
+inline void addHitPointsAvx2(int* hp, const std::uint32_t* slots, std::size_t count, int delta, std::uint8_t* died) {
+    const __m256i add = _mm256_set1_epi32(delta);
+    const __m256i one = _mm256_set1_epi32(1);
+    alignas(32) int values[8];
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(slots + i));
+        __m256i sum = _mm256_add_epi32(_mm256_i32gather_epi32(hp, index, 4), add);
+        auto dead = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(one, sum))));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(values), sum);
+        for (int lane = 0; lane < 8; lane++) {
+            hp[slots[i + lane]] = values[lane];
+            died[i + lane] = static_cast<std::uint8_t>(dead >> lane & 1);
+        }
+    }
+    addHitPointsScalar(hp, slots + i, count - i, delta, died + i);
+}
+
+#endif
+
+// The kernel used by addHitPoints()
+inline HitPointKernel bestHitPointKernel() {
+#ifdef FANTASY_BULK_X86
+    static const HitPointKernel best = __builtin_cpu_supports("avx2") ? addHitPointsAvx2 : addHitPointsScalar;
+    return best;
+#else
+    return addHitPointsScalar;
+#endif
+}
+
+inline void addHitPoints(int* hp, const std::uint32_t* slots, std::size_t count, int delta, std::uint8_t* died) {
+    bestHitPointKernel()(hp, slots, count, delta, died);
+}
+
+#endif //FANTASY_BULK_H
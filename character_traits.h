@@ -0,0 +1,79 @@
+//
+// Overview: character classes as compile-time traits.
+//
+// A character class is nothing but a name and three capacities.
+// Each class is a traits struct, and CharacterClasses lists all of them:
+// both storage engines build their characters from this list, so adding
+// a class (say, a paladin) means adding a struct and a list entry here.
+//
+
+#ifndef FANTASY_CHARACTER_TRAITS_H
+#define FANTASY_CHARACTER_TRAITS_H
+
+#include "algorithm"
+#include "string_view"
+
+
+struct FighterTraits {
+    static constexpr std::string_view NAME = "fighter";
+    static constexpr int MAX_ALLOWED_GUNS = 3;
+    static constexpr int MAX_ALLOWED_POTIONS = 5;
+    static constexpr int MAX_ALLOWED_SPELLS = 0;
+};
+
+struct ArcherTraits {
+    static constexpr std::string_view NAME = "archer";
+    static constexpr int MAX_ALLOWED_GUNS = 2;
+    static constexpr int MAX_ALLOWED_POTIONS = 3;
+    static constexpr int MAX_ALLOWED_SPELLS = 2;
+};
+
+struct WizardTraits {
+    static constexpr std::string_view NAME = "wizard";
+    static constexpr int MAX_ALLOWED_GUNS = 0;
+    static constexpr int MAX_ALLOWED_POTIONS = 10;
+    static constexpr int MAX_ALLOWED_SPELLS = 10;
+};
+
+// Traits of a class as plain data, for code that only knows the class at run time
+struct ClassInfo {
+    std::string_view name;
+    int capacity[3];    // Weapons, potions, spells
+};
+
+// A list of character classes; the position in the list is the class id
+template<typename... Traits>
+struct ClassList {
+    static constexpr int COUNT = sizeof...(Traits);
+
+    static constexpr ClassInfo INFO[COUNT] = {
+            {Traits::NAME, {Traits::MAX_ALLOWED_GUNS, Traits::MAX_ALLOWED_POTIONS, Traits::MAX_ALLOWED_SPELLS}}...
+    };
+
+    // Largest capacities over all classes
+    static constexpr int MAX_GUNS = std::max({Traits::MAX_ALLOWED_GUNS...});
+    static constexpr int MAX_POTIONS = std::max({Traits::MAX_ALLOWED_POTIONS...});
+    static constexpr int MAX_SPELLS = std::max({Traits::MAX_ALLOWED_SPELLS...});
+
+    // Class id of a class name, -1 if there is no such class
+    static int indexOf(std::string_view name) {
+        for (int i = 0; i < COUNT; i++) {
+            if (INFO[i].name == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Call f(Traits{}) with the traits of the class with this name,
+    // false if there is no such class
+    template<typename F>
+    static bool withName(std::string_view name, F&& f) {
+        return ((name == Traits::NAME ? (f(Traits{}), true) : false) || ...);
+    }
+};
+
+// Every character class of the story
+using CharacterClasses = ClassList<FighterTraits, ArcherTraits, WizardTraits>;
+
+#endif //FANTASY_CHARACTER_TRAITS_H
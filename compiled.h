@@ -0,0 +1,368 @@
+//
+// Overview: compiled binary scenarios.
+//
+// compileScenario() turns a text scenario into an image that can be replayed
+// without splitting lines, comparing keywords or hashing names:
+//
+//   header                  CompiledHeader
+//   code                    instructions, 32-bit words
+//   pool                    strings other than names (kinds, dialogue words, bad numbers)
+//   name lengths, name text the name table; a name's position is its id
+//
+// An instruction is one word holding the opcode and a flags byte, one with
+// the number of rest tokens, then the fields of that opcode (see encodeCommand).
+// Names are ids, strings are (offset, length) pairs into the pool, and numbers
+// are converted in advance; one that does not convert is stored as BAD_NUMBER,
+// which the replay rejects exactly where the text run would. A line that is
+// missing tokens is flagged INCOMPLETE, and replays as "Error caught" like the
+// text run. Images of another version are refused.
+// Words are in host byte order.
+//
+
+#ifndef FANTASY_COMPILED_H
+#define FANTASY_COMPILED_H
+
+#include "algorithm"
+#include "cstddef"
+#include "cstdint"
+#include "cstring"
+#include "string"
+#include "string_view"
+#include "unordered_map"
+#include "vector"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "output.h"
+#include "parser.h"
+#include "symbols.h"
+
+
+const std::uint32_t COMPILED_MAGIC = 0x424e5446;    // "FTNB" on a little-endian host
+const std::uint32_t COMPILED_VERSION = 3;     // 2: INCOMPLETE lines, 3: rest count in its own word
+
+struct CompiledHeader {
+    std::uint32_t magic;        // COMPILED_MAGIC
+    std::uint32_t version;      // COMPILED_VERSION
+    std::uint32_t nameCount;    // Entries of the name table
+    std::uint32_t nameBytes;    // Text of the name table
+    std::uint64_t poolBytes;    // Size of the string pool, without padding
+    std::uint64_t codeWords;    // Size of the code
+    std::uint64_t commands;     // Number of instructions
+};
+
+// Flags of an instruction
+const std::uint32_t HAS_VALUE = 1;  // The number was converted in advance
+const std::uint32_t INCOMPLETE = 2; // The line was missing tokens (see arityOf)
+
+// Length of the padding after a section of this many bytes
+inline std::size_t paddingOf(std::size_t bytes) {
+    return (4 - bytes % 4) % 4;
+}
+
+// Builds the sections of an image, one command at a time
+class ScenarioCompiler {
+private:
+    SymbolTable names;                                  // Every name of the scenario
+    std::string pool;                                   // String pool
+    std::unordered_map<std::string, std::uint32_t> pooled;  // Offset of every pooled string
+    std::vector<std::uint32_t> code;                    // Code of the current command
+
+    void putString(std::string_view text) {
+        auto found = pooled.find(std::string(text));
+        std::uint32_t offset;
+        if (found != pooled.end()) {
+            offset = found->second;
+        }
+        else {
+            offset = static_cast<std::uint32_t>(pool.size());
+            pool.append(text);
+            pooled.emplace(std::string(text), offset);
+        }
+        code.push_back(offset);
+        code.push_back(static_cast<std::uint32_t>(text.size()));
+    }
+    void putName(std::string_view text) {
+        code.push_back(names.intern(text));
+    }
+    // Converted number (BAD_NUMBER if it does not convert)
+    void putNumber(const Command& command) {
+        code.push_back(static_cast<std::uint32_t>(numberOf(command)));
+        code.push_back(0);
+        code[0] |= HAS_VALUE << 8;
+    }
+
+public:
+    // Code of one command; valid until the next call
+    const std::vector<std::uint32_t>& encodeCommand(const Command& command) {
+        code.clear();
+        std::size_t restCount = command.rest.size();
+        code.push_back(static_cast<std::uint32_t>(command.op) | (command.complete ? 0 : INCOMPLETE << 8));
+        code.push_back(static_cast<std::uint32_t>(restCount));
+        switch (command.op) {
+            case Opcode::CreateCharacter:
+                putString(command.kind);
+                putName(command.actor);
+                putNumber(command);
+                break;
+            case Opcode::CreateItem:
+                putString(command.kind);
+                putName(command.actor);
+                putName(command.object);
+                putNumber(command);
+                break;
+            case Opcode::Attack:
+            case Opcode::Cast:
+            case Opcode::Drink:
+                putName(command.actor);
+                putName(command.target);
+                putName(command.object);
+                break;
+            case Opcode::Dialogue:
+                putName(command.actor);
+                putNumber(command);
+                break;
+            case Opcode::Show:
+                putString(command.kind);
+                putName(command.actor);
+                break;
+            case Opcode::Volley:
+            case Opcode::Share:
+                putName(command.actor);
+                putName(command.object);
+                putNumber(command);
+                break;
+            case Opcode::Unleash:
+                putName(command.actor);
+                putName(command.object);
+                break;
+            default:
+                break;
+        }
+        for (std::size_t i = 0; i < restCount; i++) {
+            putString(command.rest[i]);
+        }
+        return code;
+    }
+
+    const std::string& getPool() const {
+        return pool;
+    }
+    const SymbolTable& getNames() const {
+        return names;
+    }
+};
+
+// Compile a text scenario into an image file. Returns false if the image
+// cannot be written.
+inline bool compileScenario(InputReader &inputFile, const std::string& path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    FdTarget target(fd, true);
+    OutputSink image(target);
+    ScenarioCompiler compiler;
+    CommandParser parser;
+    CompiledHeader header = {COMPILED_MAGIC, COMPILED_VERSION, 0, 0, 0, 0, 0};
+    image.write(reinterpret_cast<const char*>(&header), sizeof(header));  // Filled in at the end
+
+    std::string_view line;
+    inputFile.nextLine(line);   // The first line is the number of commands
+    while (inputFile.nextLine(line)) {
+        const std::vector<std::uint32_t>& code = compiler.encodeCommand(parser.parse(line));
+        image.write(reinterpret_cast<const char*>(code.data()), code.size() * sizeof(std::uint32_t));
+        header.codeWords += code.size();
+        header.commands++;
+    }
+
+    const char zeros[4] = {0, 0, 0, 0};
+    const std::string& pool = compiler.getPool();
+    image.write(pool.data(), pool.size());
+    image.write(zeros, paddingOf(pool.size()));
+    header.poolBytes = pool.size();
+
+    const SymbolTable& names = compiler.getNames();
+    header.nameCount = static_cast<std::uint32_t>(names.size());
+    for (NameId id = 0; id < names.size(); id++) {
+        auto length = static_cast<std::uint32_t>(names.name(id).size());
+        image.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        header.nameBytes += length;
+    }
+    for (NameId id = 0; id < names.size(); id++) {
+        image << names.name(id);
+    }
+    image.flush();
+    bool headerWritten = ::pwrite(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+    return target.close() && headerWritten;
+}
+
+// A compiled scenario mapped into memory
+class CompiledScenario {
+private:
+    const char* mapped = nullptr;   // The whole image
+    std::size_t mappedSize = 0;
+    CompiledHeader header = {};
+    const std::uint32_t* code = nullptr;
+    const char* pool = nullptr;
+    const std::uint32_t* nameLengths = nullptr;
+    const char* nameText = nullptr;
+
+public:
+    // Map an image; is_open() tells whether it is a valid one
+    explicit CompiledScenario(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info {};
+        if (fstat(fd, &info) == 0 && static_cast<std::size_t>(info.st_size) >= sizeof(CompiledHeader)) {
+            void* map = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, static_cast<std::size_t>(info.st_size), MADV_SEQUENTIAL);
+                mapped = static_cast<const char*>(map);
+                mappedSize = static_cast<std::size_t>(info.st_size);
+            }
+        }
+        ::close(fd);
+        if (mapped == nullptr) {
+            return;
+        }
+        std::memcpy(&header, mapped, sizeof(header));
+        std::uint64_t codeBytes = header.codeWords * sizeof(std::uint32_t);
+        std::uint64_t poolEnd = sizeof(header) + codeBytes + header.poolBytes + paddingOf(header.poolBytes);
+        std::uint64_t end = poolEnd + std::uint64_t(header.nameCount) * sizeof(std::uint32_t) + header.nameBytes;
+        if (header.magic != COMPILED_MAGIC || header.version != COMPILED_VERSION || end != mappedSize) {
+            munmap(const_cast<char*>(mapped), mappedSize);
+            mapped = nullptr;
+            return;
+        }
+        code = reinterpret_cast<const std::uint32_t*>(mapped + sizeof(header));
+        pool = mapped + sizeof(header) + codeBytes;
+        nameLengths = reinterpret_cast<const std::uint32_t*>(mapped + poolEnd);
+        nameText = mapped + poolEnd + std::size_t(header.nameCount) * sizeof(std::uint32_t);
+    }
+    CompiledScenario(const CompiledScenario&) = delete;
+    CompiledScenario& operator=(const CompiledScenario&) = delete;
+    ~CompiledScenario() {
+        if (mapped != nullptr) {
+            munmap(const_cast<char*>(mapped), mappedSize);
+        }
+    }
+
+    bool is_open() const {
+        return mapped != nullptr;
+    }
+    const CompiledHeader& getHeader() const {
+        return header;
+    }
+    const std::uint32_t* getCode() const {
+        return code;
+    }
+
+    // Intern the name table, in order, so name ids match the code
+    void loadNames(SymbolTable& names) const {
+        const char* text = nameText;
+        for (std::uint32_t i = 0; i < header.nameCount; i++) {
+            names.intern(std::string_view(text, nameLengths[i]));
+            text += nameLengths[i];
+        }
+    }
+
+    // Decode the instruction at pc into command and move pc past it.
+    // The rest tokens go to tokens; names are viewed in the table.
+    void decode(const std::uint32_t*& pc, Command& command, std::vector<std::string_view>& tokens,
+                const SymbolTable& names) const {
+        auto string = [&]() {
+            std::string_view text(pool + pc[0], pc[1]);
+            pc += 2;
+            return text;
+        };
+        auto name = [&](NameId& id) {
+            id = *pc++;
+            return names.name(id);
+        };
+        auto number = [&]() {
+            command.value = static_cast<int>(pc[0]);
+            command.hasValue = true;
+            pc += 2;
+        };
+
+        std::uint32_t head = *pc++;
+        std::uint32_t flags = (head >> 8) & 0xFF;
+        std::size_t restCount = *pc++;
+        command = Command();
+        command.op = static_cast<Opcode>(head & 0xFF);
+        command.complete = (flags & INCOMPLETE) == 0;
+        switch (command.op) {
+            case Opcode::CreateCharacter:
+                command.kind = string();
+                command.actor = name(command.actorId);
+                number();
+                break;
+            case Opcode::CreateItem:
+                command.kind = string();
+                command.actor = name(command.actorId);
+                command.object = name(command.objectId);
+                number();
+                break;
+            case Opcode::Attack:
+            case Opcode::Cast:
+            case Opcode::Drink:
+                command.actor = name(command.actorId);
+                command.target = name(command.targetId);
+                command.object = name(command.objectId);
+                break;
+            case Opcode::Dialogue:
+                command.actor = name(command.actorId);
+                number();
+                break;
+            case Opcode::Show:
+                command.kind = string();
+                command.actor = name(command.actorId);
+                break;
+            case Opcode::Volley:
+            case Opcode::Share:
+                command.actor = name(command.actorId);
+                command.object = name(command.objectId);
+                number();
+                break;
+            case Opcode::Unleash:
+                command.actor = name(command.actorId);
+                command.object = name(command.objectId);
+                break;
+            default:
+                break;
+        }
+        tokens.clear();
+        for (std::size_t i = 0; i < restCount; i++) {
+            tokens.push_back(string());
+        }
+        if (restCount > 0) {
+            command.rest = TokenSpan(tokens.data(), tokens.size());
+        }
+    }
+};
+
+// Replay a compiled scenario; the world is cleared first so its name ids
+// match the image. Returns the number of commands executed.
+template<typename W>
+unsigned long long runCompiled(const CompiledScenario &scenario, W &world, OutputSink &outputFile) {
+    world.clear();
+    scenario.loadNames(world.names);
+    std::vector<std::string_view> tokens;
+    tokens.reserve(64);
+    const std::uint32_t* pc = scenario.getCode();
+    Command command;
+    for (std::uint64_t i = 0; i < scenario.getHeader().commands; i++) {
+        scenario.decode(pc, command, tokens, world.names);
+        execute(command, world, outputFile);
+    }
+    return scenario.getHeader().commands;
+}
+
+#endif //FANTASY_COMPILED_H
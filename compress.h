@@ -0,0 +1,500 @@
+//
+// Overview: compressed scenarios and narration, decoded and encoded on threads of their own.
+//
+// A scenario file that starts with the gzip or zstd magic is handed to a
+// Decompressor: its thread reads and inflates the file into chunks, and
+// InputReader copies lines out of those chunks where it would otherwise read()
+// the file. Narration written to a path ending in .gz or .zst goes through a
+// CompressingTarget, whose thread compresses the chunks the OutputSink
+// flushes. Either way the codec runs alongside the simulation; the chunks
+// travel on SPSC queues and come back empty, as in the pipeline.
+//
+// gzip needs a build with -DFANTASY_ZLIB (and -lz), zstd one with
+// -DFANTASY_ZSTD (and -lzstd). Without them such files are refused with a
+// message saying so.
+//
+
+#ifndef FANTASY_COMPRESS_H
+#define FANTASY_COMPRESS_H
+
+#include "algorithm"
+#include "atomic"
+#include "cerrno"
+#include "cstddef"
+#include "cstring"
+#include "memory"
+#include "string"
+#include "string_view"
+#include "thread"
+#include "vector"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef FANTASY_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FANTASY_ZSTD
+#include <zstd.h>
+#endif
+
+#include "output.h"
+#include "spsc_queue.h"
+
+
+enum class Codec { None, Gzip, Zstd };
+
+inline const char* codecName(Codec codec) {
+    return codec == Codec::Gzip ? "gzip" : codec == Codec::Zstd ? "zstd" : "none";
+}
+
+// Whether this build can read and write the codec
+inline bool codecSupported(Codec codec) {
+    switch (codec) {
+        case Codec::None:
+            return true;
+#ifdef FANTASY_ZLIB
+        case Codec::Gzip:
+            return true;
+#endif
+#ifdef FANTASY_ZSTD
+        case Codec::Zstd:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+// Codec of a file, from its first bytes; None for anything else, and for
+// descriptors that cannot be read at an offset (pipes)
+inline Codec codecOfFile(int fd) {
+    unsigned char magic[4] = {};
+    if (::pread(fd, magic, sizeof(magic), 0) != static_cast<ssize_t>(sizeof(magic))) {
+        return Codec::None;
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        return Codec::Gzip;
+    }
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return Codec::Zstd;
+    }
+    return Codec::None;
+}
+
+// Codec of an output file, from its extension
+inline Codec codecOfPath(std::string_view path) {
+    auto endsWith = [&](std::string_view suffix) {
+        return path.size() > suffix.size() && path.substr(path.size() - suffix.size()) == suffix;
+    };
+    return endsWith(".gz") ? Codec::Gzip : endsWith(".zst") ? Codec::Zstd : Codec::None;
+}
+
+// Chunks in flight between the codec thread and its user
+struct ChunkQueues {
+    static constexpr std::size_t CHUNK_SIZE = 1 << 20;
+    static constexpr std::size_t IN_FLIGHT = 4;
+
+    std::vector<std::unique_ptr<std::vector<char>>> chunks;
+    SpscQueue<std::vector<char>*> full{IN_FLIGHT};      // Filled chunks; nullptr ends the stream
+    SpscQueue<std::vector<char>*> spare{IN_FLIGHT + 2}; // Empty ones coming back
+
+    ChunkQueues() {
+        for (std::size_t i = 0; i < IN_FLIGHT + 2; i++) {
+            chunks.push_back(std::make_unique<std::vector<char>>());
+            chunks.back()->reserve(CHUNK_SIZE);
+            spare.push(chunks.back().get());
+        }
+    }
+};
+
+inline bool writeAll(int fd, const char* bytes, std::size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        length -= static_cast<std::size_t>(written);
+    }
+    return true;
+}
+
+inline ssize_t readSome(int fd, char* into, std::size_t room) {
+    ssize_t got;
+    do {
+        got = ::read(fd, into, room);
+    } while (got < 0 && errno == EINTR);
+    return got;
+}
+
+// Decompresses a file on its own thread; read() hands out the result in order
+class Decompressor {
+private:
+    int fd;                                 // The compressed file, left open
+    Codec codec;
+    ChunkQueues queues;
+    std::thread worker;
+    std::atomic<bool> stop{false};          // The reader has gone: finish early
+    std::atomic<bool> damaged{false};       // The stream is corrupt or cut short
+    std::string problem;                    // Why, set before the end of the stream is queued
+    std::vector<char>* current = nullptr;   // Chunk being read from...
+    std::size_t taken = 0;                  // ...and how much of it has been
+    bool ended = false;                     // The end of the stream was taken
+
+    // Hand out the chunk at *out (if it has anything) and get an empty one
+    void pass(std::vector<char>*& out) {
+        if (!out->empty()) {
+            queues.full.push(out);
+            out = queues.spare.pop();
+        }
+        out->clear();
+    }
+
+    void fail(const char* why) {
+        problem = why;
+        damaged = true;
+    }
+
+#ifdef FANTASY_ZLIB
+    void inflateAll(std::vector<char>& in, std::vector<char>*& out) {
+        z_stream stream {};
+        if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+            fail("cannot start zlib");
+            return;
+        }
+        bool inMember = false;      // Inside a gzip member (files may hold several back to back)
+        bool filled = false;        // The last call filled the chunk, and may have more to give
+        while (!stop) {
+            if (stream.avail_in == 0 && !filled) {
+                ssize_t got = readSome(fd, in.data(), in.size());
+                if (got <= 0) {
+                    if (got < 0 || inMember) {
+                        fail("the gzip data is cut short");
+                    }
+                    break;
+                }
+                stream.next_in = reinterpret_cast<Bytef*>(in.data());
+                stream.avail_in = static_cast<uInt>(got);
+            }
+            inMember = inMember || stream.avail_in > 0;
+            std::size_t used = out->size();
+            out->resize(ChunkQueues::CHUNK_SIZE);
+            stream.next_out = reinterpret_cast<Bytef*>(out->data() + used);
+            stream.avail_out = static_cast<uInt>(out->size() - used);
+            int result = inflate(&stream, Z_NO_FLUSH);
+            filled = stream.avail_out == 0;
+            out->resize(out->size() - stream.avail_out);
+            if (result == Z_STREAM_END) {
+                inflateReset(&stream);
+                inMember = false;
+            }
+            else if (result != Z_OK && result != Z_BUF_ERROR) {
+                fail("the gzip data is corrupt");
+                break;
+            }
+            if (out->size() == ChunkQueues::CHUNK_SIZE) {
+                pass(out);
+            }
+        }
+        inflateEnd(&stream);
+    }
+#endif
+
+#ifdef FANTASY_ZSTD
+    void decompressAll(std::vector<char>& in, std::vector<char>*& out) {
+        ZSTD_DStream* stream = ZSTD_createDStream();
+        ZSTD_inBuffer input = {in.data(), 0, 0};
+        std::size_t hint = 0;       // 0 once a frame is complete
+        bool filled = false;        // The last call filled the chunk, and may have more to give
+        while (!stop) {
+            if (input.pos == input.size && !filled) {
+                ssize_t got = readSome(fd, in.data(), in.size());
+                if (got <= 0) {
+                    if (got < 0 || hint != 0) {
+                        fail("the zstd data is cut short");
+                    }
+                    break;
+                }
+                input = {in.data(), static_cast<std::size_t>(got), 0};
+            }
+            std::size_t used = out->size();
+            out->resize(ChunkQueues::CHUNK_SIZE);
+            ZSTD_outBuffer output = {out->data(), out->size(), used};
+            hint = ZSTD_decompressStream(stream, &output, &input);
+            filled = output.pos == output.size;
+            out->resize(output.pos);
+            if (ZSTD_isError(hint)) {
+                fail("the zstd data is corrupt");
+                break;
+            }
+            if (out->size() == ChunkQueues::CHUNK_SIZE) {
+                pass(out);
+            }
+        }
+        ZSTD_freeDStream(stream);
+    }
+#endif
+
+    void run() {
+        std::vector<char> in(ChunkQueues::CHUNK_SIZE);
+        std::vector<char>* out = queues.spare.pop();
+        out->clear();
+        if (codec == Codec::Gzip) {
+#ifdef FANTASY_ZLIB
+            inflateAll(in, out);
+#endif
+        }
+        else {
+#ifdef FANTASY_ZSTD
+            decompressAll(in, out);
+#endif
+        }
+        pass(out);
+        queues.full.push(nullptr);
+    }
+
+public:
+    // Decompress an open file from where it is positioned
+    Decompressor(int fd, Codec codec) : fd(fd), codec(codec) {
+        if (!codecSupported(codec)) {
+            problem = std::string("it is compressed with ") + codecName(codec) + ", which this build cannot read";
+            damaged = true;
+            ended = true;
+            return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        worker = std::thread([this] { run(); });
+    }
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+    ~Decompressor() {
+        stop = true;
+        if (current != nullptr) {
+            queues.spare.push(current);
+        }
+        while (!ended) {    // Let the worker finish: take what it still hands out
+            std::vector<char>* chunk = queues.full.pop();
+            if (chunk == nullptr) {
+                ended = true;
+            }
+            else {
+                queues.spare.push(chunk);
+            }
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // Copy up to room decompressed bytes into into, waiting for them if need be.
+    // 0 at the end of the stream.
+    std::size_t read(char* into, std::size_t room) {
+        while (!ended) {
+            if (current == nullptr) {
+                current = queues.full.pop();
+                taken = 0;
+                if (current == nullptr) {
+                    ended = true;
+                    break;
+                }
+            }
+            std::size_t count = std::min(room, current->size() - taken);
+            std::memcpy(into, current->data() + taken, count);
+            taken += count;
+            if (taken == current->size()) {
+                queues.spare.push(current);
+                current = nullptr;
+            }
+            if (count > 0) {
+                return count;
+            }
+        }
+        return 0;
+    }
+
+    // Whether the stream turned out corrupt or unreadable; valid once read() returned 0
+    bool isDamaged() const {
+        return damaged;
+    }
+    const std::string& getProblem() const {
+        return problem;
+    }
+};
+
+// Writes a compressed file; the compression runs on a thread of its own
+class CompressingTarget : public OutputTarget {
+private:
+    int fd;
+    Codec codec;
+    ChunkQueues queues;
+    std::thread worker;
+    std::vector<char>* current = nullptr;   // Chunk being filled
+    bool failed = false;                    // A write to the file failed
+
+#ifdef FANTASY_ZLIB
+    void deflateAll(std::vector<char>& out) {
+        z_stream stream {};
+        if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            failed = true;
+        }
+        int flush = Z_NO_FLUSH;
+        while (flush != Z_FINISH) {
+            std::vector<char>* chunk = queues.full.pop();
+            if (chunk == nullptr) {
+                flush = Z_FINISH;
+            }
+            else {
+                stream.next_in = reinterpret_cast<Bytef*>(chunk->data());
+                stream.avail_in = static_cast<uInt>(chunk->size());
+            }
+            int result;
+            do {
+                stream.next_out = reinterpret_cast<Bytef*>(out.data());
+                stream.avail_out = static_cast<uInt>(out.size());
+                result = failed ? Z_STREAM_END : deflate(&stream, flush);
+                std::size_t length = out.size() - stream.avail_out;
+                if (!failed && length > 0 && !writeAll(fd, out.data(), length)) {
+                    failed = true;
+                }
+            } while (!failed && (stream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END)));
+            if (chunk != nullptr) {
+                queues.spare.push(chunk);
+            }
+        }
+        deflateEnd(&stream);
+    }
+#endif
+
+#ifdef FANTASY_ZSTD
+    void compressAll(std::vector<char>& out) {
+        ZSTD_CCtx* stream = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(stream, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+        ZSTD_EndDirective mode = ZSTD_e_continue;
+        while (mode != ZSTD_e_end) {
+            std::vector<char>* chunk = queues.full.pop();
+            ZSTD_inBuffer input = {nullptr, 0, 0};
+            if (chunk == nullptr) {
+                mode = ZSTD_e_end;
+            }
+            else {
+                input = {chunk->data(), chunk->size(), 0};
+            }
+            std::size_t left;
+            do {
+                ZSTD_outBuffer output = {out.data(), out.size(), 0};
+                left = ZSTD_compressStream2(stream, &output, &input, mode);
+                if (ZSTD_isError(left) || (output.pos > 0 && !writeAll(fd, out.data(), output.pos))) {
+                    failed = true;
+                }
+            } while (!failed && (mode == ZSTD_e_end ? left != 0 : input.pos < input.size));
+            if (chunk != nullptr) {
+                queues.spare.push(chunk);
+            }
+        }
+        ZSTD_freeCCtx(stream);
+    }
+#endif
+
+    void run() {
+        std::vector<char> out(ChunkQueues::CHUNK_SIZE);
+        if (codec == Codec::Gzip) {
+#ifdef FANTASY_ZLIB
+            deflateAll(out);
+#endif
+        }
+        else {
+#ifdef FANTASY_ZSTD
+            compressAll(out);
+#endif
+        }
+    }
+
+    void handOver() {
+        if (!current->empty()) {
+            queues.full.push(current);
+            current = queues.spare.pop();
+            current->clear();
+        }
+    }
+
+public:
+    static constexpr int GZIP_LEVEL = 1;    // Fast levels keep up with the simulation and still
+    static constexpr int ZSTD_LEVEL = 3;    // shrink narration by an order of magnitude
+
+    // Create (or truncate) a file; the codec must be supported
+    CompressingTarget(const std::string& path, Codec codec)
+            : fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)), codec(codec) {
+        if (fd < 0) {
+            return;
+        }
+        current = queues.spare.pop();
+        current->clear();
+        worker = std::thread([this] { run(); });
+    }
+    CompressingTarget(const CompressingTarget&) = delete;
+    CompressingTarget& operator=(const CompressingTarget&) = delete;
+    ~CompressingTarget() override {
+        close();
+    }
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    void write(const struct iovec* parts, int count) override {
+        if (fd < 0) {
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            const char* bytes = static_cast<const char*>(parts[i].iov_base);
+            std::size_t length = parts[i].iov_len;
+            while (length > 0) {
+                std::size_t room = ChunkQueues::CHUNK_SIZE - current->size();
+                std::size_t chunk = std::min(room, length);
+                current->insert(current->end(), bytes, bytes + chunk);
+                bytes += chunk;
+                length -= chunk;
+                if (current->size() == ChunkQueues::CHUNK_SIZE) {
+                    handOver();
+                }
+            }
+        }
+    }
+
+    // Compress what is left, end the stream and close the file. False if
+    // anything could not be written.
+    bool close() override {
+        if (fd >= 0) {
+            handOver();
+            queues.full.push(nullptr);
+            worker.join();
+            if (::close(fd) != 0) {
+                failed = true;
+            }
+            fd = -1;
+        }
+        return !failed;
+    }
+};
+
+// Target for a narration file: compressed when its extension asks for it.
+// nullptr if the file cannot be created or this build lacks its codec.
+inline std::unique_ptr<OutputTarget> openOutputFile(const std::string& path) {
+    Codec codec = codecOfPath(path);
+    if (codec == Codec::None) {
+        auto file = std::make_unique<FdTarget>(path);
+        return file->is_open() ? std::move(file) : nullptr;
+    }
+    if (!codecSupported(codec)) {
+        return nullptr;
+    }
+    auto file = std::make_unique<CompressingTarget>(path, codec);
+    return file->is_open() ? std::move(file) : nullptr;
+}
+
+#endif //FANTASY_COMPRESS_H
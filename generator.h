@@ -0,0 +1,476 @@
+//
+// Overview: deterministic scenario generator for benchmarks.
+//
+// Writes a scenario of N commands drawn from a configurable mix. The generator
+// keeps its own model of the town (who lives, their class, HP and items) and
+// only emits commands that are valid under the rules of the handlers, except
+// for a configured share of deliberate errors, which never change the state.
+// The same options and seed always give the same file, on every platform:
+// the random numbers come from a fixed splitmix64 sequence.
+//
+
+#ifndef FANTASY_GENERATOR_H
+#define FANTASY_GENERATOR_H
+
+#include "algorithm"
+#include "cstdint"
+#include "string"
+#include "string_view"
+#include "vector"
+
+#include "character_traits.h"
+#include "output.h"
+
+
+// What to generate
+struct GeneratorOptions {
+    std::uint64_t seed = 1;
+    unsigned long long commands = 100000;   // Lines after the header line
+    unsigned town = 100;            // Living characters the generator aims for
+    double fill = 0.5;              // Share of each inventory the generator keeps filled
+    double errors = 0.05;           // Share of commands that are deliberately invalid
+    // Relative weights of the kinds of commands (the area-of-effect ones and the
+    // analytical Show queries are off unless asked for)
+    double create = 5, item = 15, attack = 30, cast = 5, drink = 10, dialogue = 15, show = 20;
+    double volley = 0, unleash = 0, share = 0, rank = 0;
+
+    // Set a weight from "name=value", false if there is no such kind
+    bool setWeight(std::string_view name, double value) {
+        double* weights[] = {&create, &item, &attack, &cast, &drink, &dialogue, &volley, &unleash, &share, &rank, &show};
+        const char* names[] = {"create", "item", "attack", "cast", "drink", "dialogue", "volley", "unleash", "share", "rank",
+                               "show"};
+        for (int i = 0; i < 11; i++) {
+            if (name == names[i]) {
+                *weights[i] = value;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+class ScenarioGenerator {
+private:
+    enum Kind { CREATE, ITEM, ATTACK, CAST, DRINK, DIALOGUE, VOLLEY, UNLEASH, SHARE, RANK, SHOW, KINDS };
+
+    struct Item {
+        unsigned name;                  // Number of the item name
+        int value;                      // Damage or heal
+        std::vector<unsigned> victims;  // Characters a spell works on
+    };
+    struct Person {
+        int cls;                        // Index in CharacterClasses
+        int hp;
+        std::vector<Item> items[3];     // Weapons, potions, spells
+        unsigned place;                 // Position in living
+        bool alive;
+    };
+
+    const GeneratorOptions options;
+    std::uint64_t state;                // splitmix64 state
+    std::vector<Person> people;         // Everyone ever created; the index is the name
+    std::vector<unsigned> living;       // Indices of the living, in no order
+    unsigned nextItem = 0;              // Number of the next item name
+    unsigned nextGhost = 0;             // Number of the next name nobody has
+    double weights[KINDS];
+
+    std::uint64_t next() {
+        std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    // Uniform in [0, n)
+    unsigned below(unsigned n) {
+        return static_cast<unsigned>(next() % n);
+    }
+    // Uniform in [low, high]
+    int between(int low, int high) {
+        return low + static_cast<int>(below(static_cast<unsigned>(high - low + 1)));
+    }
+    double unit() {
+        return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    static std::string nameOf(unsigned person) {
+        return "c" + std::to_string(person);
+    }
+    static std::string itemName(int kind, unsigned number) {
+        static const char prefix[3] = {'w', 'p', 's'};
+        return prefix[kind] + std::to_string(number);
+    }
+    int capacity(unsigned person, int kind) const {
+        return CharacterClasses::INFO[people[person].cls].capacity[kind];
+    }
+    unsigned anyone() {
+        return living[below(static_cast<unsigned>(living.size()))];
+    }
+
+    void die(unsigned person) {
+        Person& dead = people[person];
+        dead.alive = false;
+        unsigned last = living.back();
+        living[dead.place] = last;
+        people[last].place = dead.place;
+        living.pop_back();
+        for (std::vector<Item>& items : dead.items) {
+            items.clear();
+        }
+    }
+
+    // A living character with an item of this kind, or -1 after a few misses
+    long holderOf(int kind) {
+        for (int tries = 0; tries < 8 && !living.empty(); tries++) {
+            unsigned person = anyone();
+            if (!people[person].items[kind].empty()) {
+                return person;
+            }
+        }
+        return -1;
+    }
+
+    void createCharacter(OutputSink& out) {
+        auto person = static_cast<unsigned>(people.size());
+        Person born;
+        born.cls = static_cast<int>(below(CharacterClasses::COUNT));
+        born.hp = between(1, 200);
+        born.place = static_cast<unsigned>(living.size());
+        born.alive = true;
+        people.push_back(born);
+        living.push_back(person);
+        out << "Create character " << CharacterClasses::INFO[born.cls].name << ' ' << nameOf(person) << ' '
+            << born.hp << '\n';
+    }
+
+    bool createItem(OutputSink& out) {
+        int kind = static_cast<int>(below(3));
+        for (int tries = 0; tries < 8; tries++) {
+            unsigned owner = anyone();
+            int room = capacity(owner, kind);
+            auto held = static_cast<int>(people[owner].items[kind].size());
+            if (held >= room || held >= std::max(1, static_cast<int>(room * options.fill + 0.5))) {
+                continue;
+            }
+            Item item;
+            item.name = nextItem++;
+            static const char* kinds[3] = {"weapon", "potion", "spell"};
+            out << "Create item " << kinds[kind] << ' ' << nameOf(owner) << ' ' << itemName(kind, item.name) << ' ';
+            if (kind == 2) {
+                int count = std::min(between(0, 4), static_cast<int>(living.size()));
+                for (int i = 0; i < count; i++) {
+                    item.victims.push_back(anyone());
+                }
+                std::sort(item.victims.begin(), item.victims.end());
+                item.victims.erase(std::unique(item.victims.begin(), item.victims.end()), item.victims.end());
+                out << static_cast<int>(item.victims.size());
+                for (unsigned victim : item.victims) {
+                    out << ' ' << nameOf(victim);
+                }
+            }
+            else {
+                item.value = between(1, 50);
+                out << item.value;
+            }
+            out << '\n';
+            people[owner].items[kind].push_back(item);
+            return true;
+        }
+        return false;
+    }
+
+    bool attack(OutputSink& out) {
+        long attacker = holderOf(0);
+        if (attacker < 0) {
+            return false;
+        }
+        std::vector<Item>& weapons = people[attacker].items[0];
+        const Item& weapon = weapons[below(static_cast<unsigned>(weapons.size()))];
+        unsigned target = anyone();
+        out << "Attack " << nameOf(attacker) << ' ' << nameOf(target) << ' ' << itemName(0, weapon.name) << '\n';
+        people[target].hp -= weapon.value;
+        if (people[target].hp <= 0) {
+            die(target);
+        }
+        return true;
+    }
+
+    bool cast(OutputSink& out) {
+        long caster = holderOf(2);
+        if (caster < 0) {
+            return false;
+        }
+        std::vector<Item>& spells = people[caster].items[2];
+        for (std::size_t i = 0; i < spells.size(); i++) {
+            for (unsigned victim : spells[i].victims) {
+                if (people[victim].alive) {
+                    out << "Cast " << nameOf(caster) << ' ' << nameOf(victim) << ' ' << itemName(2, spells[i].name) << '\n';
+                    spells.erase(spells.begin() + static_cast<long>(i));
+                    die(victim);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool drink(OutputSink& out) {
+        long supplier = holderOf(1);
+        if (supplier < 0) {
+            return false;
+        }
+        std::vector<Item>& potions = people[supplier].items[1];
+        unsigned which = below(static_cast<unsigned>(potions.size()));
+        unsigned drinker = anyone();
+        out << "Drink " << nameOf(supplier) << ' ' << nameOf(drinker) << ' ' << itemName(1, potions[which].name) << '\n';
+        people[drinker].hp += potions[which].value;
+        potions.erase(potions.begin() + which);
+        return true;
+    }
+
+    // Up to count distinct living characters other than but
+    std::vector<unsigned> group(unsigned count, long but) {
+        std::vector<unsigned> chosen;
+        for (unsigned tries = 0; tries < count * 4 && chosen.size() < count; tries++) {
+            unsigned person = anyone();
+            if (person != but && std::find(chosen.begin(), chosen.end(), person) == chosen.end()) {
+                chosen.push_back(person);
+            }
+        }
+        return chosen;
+    }
+
+    bool volley(OutputSink& out) {
+        long attacker = holderOf(0);
+        if (attacker < 0) {
+            return false;
+        }
+        std::vector<Item>& weapons = people[attacker].items[0];
+        const Item weapon = weapons[below(static_cast<unsigned>(weapons.size()))];
+        std::vector<unsigned> targets = group(static_cast<unsigned>(between(2, 8)), attacker);
+        if (targets.empty()) {
+            return false;
+        }
+        out << "Volley " << nameOf(attacker) << ' ' << itemName(0, weapon.name) << ' '
+            << static_cast<int>(targets.size());
+        for (unsigned target : targets) {
+            out << ' ' << nameOf(target);
+        }
+        out << '\n';
+        for (unsigned target : targets) {
+            people[target].hp -= weapon.value;
+            if (people[target].hp <= 0) {
+                die(target);
+            }
+        }
+        return true;
+    }
+
+    bool unleash(OutputSink& out) {
+        long caster = holderOf(2);
+        if (caster < 0) {
+            return false;
+        }
+        std::vector<Item>& spells = people[caster].items[2];
+        for (std::size_t i = 0; i < spells.size(); i++) {
+            const Item spell = spells[i];
+            if (std::none_of(spell.victims.begin(), spell.victims.end(), [&](unsigned v) { return people[v].alive; })) {
+                continue;
+            }
+            out << "Unleash " << nameOf(caster) << ' ' << itemName(2, spell.name) << '\n';
+            spells.erase(spells.begin() + static_cast<long>(i));
+            for (unsigned victim : spell.victims) {
+                if (people[victim].alive) {
+                    die(victim);
+                }
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool share(OutputSink& out) {
+        long supplier = holderOf(1);
+        if (supplier < 0) {
+            return false;
+        }
+        std::vector<Item>& potions = people[supplier].items[1];
+        unsigned which = below(static_cast<unsigned>(potions.size()));
+        int count = between(2, 6);
+        out << "Share " << nameOf(supplier) << ' ' << itemName(1, potions[which].name) << ' ' << count;
+        for (int i = 0; i < count; i++) {   // Anyone, the supplier too, and maybe twice
+            unsigned drinker = anyone();
+            out << ' ' << nameOf(drinker);
+            people[drinker].hp += potions[which].value;
+        }
+        out << '\n';
+        potions.erase(potions.begin() + which);
+        return true;
+    }
+
+    void dialogue(OutputSink& out) {
+        static const char* words[] = {"the", "dragon", "is", "near", "run", "hold", "the", "line", "for", "glory"};
+        int count = between(1, 10);
+        if (below(10) == 0) {
+            out << "Dialogue Narrator " << count;
+        }
+        else {
+            out << "Dialogue " << nameOf(anyone()) << ' ' << count;
+        }
+        for (int i = 0; i < count; i++) {
+            out << ' ' << words[below(10)];
+        }
+        out << '\n';
+    }
+
+    // An analytical Show: top, bottom, an HP range or a count, half of them for one class
+    void rank(OutputSink& out) {
+        int low = between(1, 150);
+        switch (below(4)) {
+            case 0:
+                out << "Show top " << between(1, 10);
+                break;
+            case 1:
+                out << "Show bottom " << between(1, 10);
+                break;
+            case 2:
+                out << "Show hp " << low << ' ' << low + between(0, 30);
+                break;
+            default:
+                out << "Show number";
+                if (below(2) == 0) {
+                    out << ' ' << low << ' ' << low + between(0, 60);
+                }
+                break;
+        }
+        if (below(2) == 0) {
+            out << ' ' << CharacterClasses::INFO[below(CharacterClasses::COUNT)].name;
+        }
+        out << '\n';
+    }
+
+    void show(OutputSink& out) {
+        int kind = static_cast<int>(below(4)) - 1;     // -1 for characters
+        if (kind >= 0) {
+            unsigned person = anyone();
+            if (capacity(person, kind) > 0) {
+                static const char* kinds[3] = {"weapons", "potions", "spells"};
+                out << "Show " << kinds[kind] << ' ' << nameOf(person) << '\n';
+                return;
+            }
+        }
+        out << "Show characters\n";
+    }
+
+    // A command that is rejected without changing anything
+    void mistake(OutputSink& out) {
+        std::string ghost = "ghost" + std::to_string(nextGhost++);
+        switch (below(8)) {
+            case 0:
+                out << "Attack " << ghost << ' ' << (living.empty() ? ghost : nameOf(anyone())) << " w0\n";
+                break;
+            case 1:
+                out << "Create character fighter " << ghost << ' ' << (below(2) == 0 ? 0 : 201) << '\n';
+                break;
+            case 2:
+                out << "Create item potion " << ghost << " p0 10\n";
+                break;
+            case 3:
+                out << "Dialogue Narrator 11 too many words to say\n";
+                break;
+            case 4:
+                out << "Show weapons " << ghost << '\n';
+                break;
+            case 5:
+                out << "Create character archer " << ghost << " many\n";
+                break;
+            case 6:
+                out << "Attack " << ghost << '\n';
+                break;
+            default:
+                out << "Dance " << ghost << '\n';
+                break;
+        }
+    }
+
+public:
+    explicit ScenarioGenerator(const GeneratorOptions& options) : options(options), state(options.seed) {
+        double given[KINDS] = {options.create, options.item, options.attack, options.cast, options.drink,
+                               options.dialogue, options.volley, options.unleash, options.share, options.rank,
+                               options.show};
+        std::copy(given, given + KINDS, weights);
+    }
+
+    // Write the whole scenario, header line included
+    void generate(OutputSink& out) {
+        out << static_cast<unsigned long>(options.commands) << '\n';
+        for (unsigned long long i = 0; i < options.commands; i++) {
+            if (unit() < options.errors) {
+                mistake(out);
+                continue;
+            }
+            if (living.empty()) {
+                createCharacter(out);
+                continue;
+            }
+            // Creations only while the town is below its size
+            double total = 0;
+            for (int kind = 0; kind < KINDS; kind++) {
+                total += kind == CREATE && living.size() >= options.town ? 0 : weights[kind];
+            }
+            double pick = unit() * total;
+            int kind = 0;
+            for (; kind < KINDS - 1; kind++) {
+                pick -= kind == CREATE && living.size() >= options.town ? 0 : weights[kind];
+                if (pick < 0) {
+                    break;
+                }
+            }
+            bool done = true;
+            switch (kind) {
+                case CREATE:
+                    createCharacter(out);
+                    break;
+                case ITEM:
+                    done = createItem(out);
+                    break;
+                case ATTACK:
+                    done = attack(out);
+                    break;
+                case CAST:
+                    done = cast(out);
+                    break;
+                case DRINK:
+                    done = drink(out);
+                    break;
+                case DIALOGUE:
+                    dialogue(out);
+                    break;
+                case VOLLEY:
+                    done = volley(out);
+                    break;
+                case UNLEASH:
+                    done = unleash(out);
+                    break;
+                case SHARE:
+                    done = share(out);
+                    break;
+                case RANK:
+                    rank(out);
+                    break;
+                default:
+                    show(out);
+                    break;
+            }
+            if (!done) {    // Nobody could do it: grow the town or talk instead
+                if (living.size() < options.town) {
+                    createCharacter(out);
+                }
+                else {
+                    dialogue(out);
+                }
+            }
+        }
+    }
+};
+
+#endif //FANTASY_GENERATOR_H
@@ -0,0 +1,212 @@
+//
+// Overview: the hit point index behind the analytical Show queries.
+//
+//     Show top <k> [class]            the k characters with the most HP, most first
+//     Show bottom <k> [class]         the k with the least HP, least first
+//     Show hp <low> <high> [class]    everyone with low <= HP <= high, least first
+//     Show number [<low> <high>] [class]  how many there are, optionally in an HP range
+//
+// The listings have the form of Show characters ("name:type:hp " each, then a
+// newline); characters with the same HP are in name order (reversed for top).
+// A bad number or an unknown class is "Error caught".
+//
+// The index keeps the living characters ordered by HP and name, once for the
+// whole town and once per class, in order-statistics trees: a listing costs
+// O(log n + k) and a count O(log n). The trees come from libstdc++; with
+// another standard library a std::set stands in, and counts take O(log n + k)
+// like listings. It is built on the first such query and
+// from then on updated by the world whenever a character arrives, dies or
+// has its HP changed, so scenarios that never ask pay nothing for it.
+//
+
+#ifndef FANTASY_HP_INDEX_H
+#define FANTASY_HP_INDEX_H
+
+#include "climits"
+#include "cstdint"
+#include "string_view"
+#include "vector"
+
+#include "iterator"
+#include "set"
+
+#ifdef __GLIBCXX__
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+#endif
+
+#include "character_traits.h"
+#include "narration.h"
+#include "output.h"
+#include "parser.h"
+#include "symbols.h"
+
+
+// Whether a Show subject is one of the analytical queries
+inline bool isRankingShow(std::string_view subject) {
+    return subject == "top" || subject == "bottom" || subject == "hp" || subject == "number";
+}
+
+class HitPointIndex {
+private:
+    struct Entry {
+        int hp;
+        NameId id;      // NO_NAME comes before every name of the same HP
+    };
+    // Orders entries by HP, then by the text of the name
+    struct ByHitPoints {
+        const SymbolTable* names;
+        bool operator()(const Entry& a, const Entry& b) const {
+            if (a.hp != b.hp) {
+                return a.hp < b.hp;
+            }
+            if (a.id == b.id || b.id == NO_NAME) {
+                return false;
+            }
+            return a.id == NO_NAME || names->name(a.id) < names->name(b.id);
+        }
+    };
+#ifdef __GLIBCXX__
+    using Tree = __gnu_pbds::tree<Entry, __gnu_pbds::null_type, ByHitPoints, __gnu_pbds::rb_tree_tag,
+                                  __gnu_pbds::tree_order_statistics_node_update>;
+#else
+    using Tree = std::set<Entry, ByHitPoints>;
+#endif
+    using Position = Tree::const_iterator;
+
+    const SymbolTable* names;
+    bool built = false;
+    std::vector<Tree> trees;            // The whole town, then each class
+    std::vector<int> hpOf;              // By name id: HP the character is filed under
+    std::vector<std::int8_t> classOf;   // By name id: its class, -1 if it is not in the index
+
+    // Entries with low <= HP <= high: [first, last) in tree order
+    static void range(const Tree& tree, int low, int high, Position& first, Position& last) {
+        if (low > high) {
+            first = last = tree.end();
+            return;
+        }
+        first = tree.lower_bound(Entry{low, NO_NAME});
+        last = high == INT_MAX ? tree.end() : tree.lower_bound(Entry{high + 1, NO_NAME});
+    }
+    static std::size_t count(const Tree& tree, Position first, Position last) {
+#ifdef __GLIBCXX__
+        auto rank = [&](Position at) {
+            return at == tree.end() ? tree.size() : tree.order_of_key(*at);
+        };
+        return rank(last) - rank(first);
+#else
+        (void) tree;
+        return static_cast<std::size_t>(std::distance(first, last));
+#endif
+    }
+
+    void put(const Entry& entry, int type) {
+        trees[0].insert(entry);
+        trees[1 + type].insert(entry);
+    }
+    void take(const Entry& entry, int type) {
+        trees[0].erase(entry);
+        trees[1 + type].erase(entry);
+    }
+
+    void narrate(OutputSink& out, const Entry& entry) const {
+        out.print(names->name(entry.id), ':', CharacterClasses::INFO[classOf[entry.id]].name, ':', entry.hp, ' ');
+    }
+
+public:
+    explicit HitPointIndex(const SymbolTable& table) : names(&table) {}
+
+    bool isBuilt() const {
+        return built;
+    }
+
+    // Start indexing; living(f) must call f(id, class, hp) for every living character
+    template<typename Living>
+    void build(Living&& living) {
+        trees.assign(1 + CharacterClasses::COUNT, Tree(ByHitPoints{names}));
+        built = true;
+        living([this](NameId id, int type, int hp) {
+            add(id, type, hp);
+        });
+    }
+
+    // Forget everything and stop indexing
+    void clear() {
+        trees.clear();
+        hpOf.clear();
+        classOf.clear();
+        built = false;
+    }
+
+    void add(NameId id, int type, int hp) {
+        if (id >= classOf.size()) {
+            hpOf.resize(id + 1);
+            classOf.resize(id + 1, -1);
+        }
+        hpOf[id] = hp;
+        classOf[id] = static_cast<std::int8_t>(type);
+        put(Entry{hp, id}, type);
+    }
+    void remove(NameId id) {
+        take(Entry{hpOf[id], id}, classOf[id]);
+        classOf[id] = -1;
+    }
+    void update(NameId id, int hp) {
+        if (hpOf[id] != hp) {
+            take(Entry{hpOf[id], id}, classOf[id]);
+            hpOf[id] = hp;
+            put(Entry{hp, id}, classOf[id]);
+        }
+    }
+
+    // Answer an analytical Show (see isRankingShow); its arguments are in command.rest
+    void show(const Command& command, OutputSink& out) const {
+        std::string_view subject = command.kind;
+        const TokenSpan& args = command.rest;
+        std::size_t numbers = subject == "top" || subject == "bottom" ? 1 : subject == "hp" ? 2
+                : args.size() >= 2 && args.size() <= 3 ? 2 : 0;
+        int value[2] = {INT_MIN, INT_MAX};
+        int type = -1;
+        bool ok = args.size() >= numbers && args.size() <= numbers + 1;
+        for (std::size_t i = 0; ok && i < numbers; i++) {
+            ok = parseInt(args[i], value[i]);
+        }
+        if (ok && args.size() > numbers) {
+            type = CharacterClasses::indexOf(args[numbers]);
+            ok = type >= 0;
+        }
+        if (!ok || (numbers == 1 && value[0] < 0)) {
+            out << "Error caught\n";
+            return;
+        }
+        const Tree& tree = trees[1 + type];
+        if (subject == "top" || subject == "bottom") {
+            std::size_t left = std::min<std::size_t>(tree.size(), static_cast<std::size_t>(value[0]));
+            if (subject == "top") {
+                for (auto it = tree.end(); left > 0; left--) {
+                    narrate(out, *--it);
+                }
+            }
+            else {
+                for (auto it = tree.begin(); left > 0; left--, ++it) {
+                    narrate(out, *it);
+                }
+            }
+            out << "\n";
+            return;
+        }
+        Position first, last;
+        range(tree, value[0], value[1], first, last);
+        if (subject == "number") {
+            out.print(static_cast<unsigned long>(count(tree, first, last)), '\n');
+            return;
+        }
+        for (; first != last; ++first) {
+            narrate(out, *first);
+        }
+        out << "\n";
+    }
+};
+
+#endif //FANTASY_HP_INDEX_H
@@ -0,0 +1,244 @@
+//
+// Overview: line reader for scenario files.
+//
+// Regular files are memory-mapped and lines are handed out as views straight
+// into the mapping, so nothing is copied and files larger than RAM are paged
+// in and out by the kernel. Pages that have been read are let go in steps of
+// RELEASE_WINDOW, so a long file does not stay resident. Anything that cannot
+// be mapped (pipes, empty files) is streamed through one large reusable buffer
+// instead, and so are gzip and zstd files, which are decompressed on a thread
+// of their own on the way in (see compress.h).
+//
+
+#ifndef FANTASY_INPUT_H
+#define FANTASY_INPUT_H
+
+#include "algorithm"
+#include "cerrno"
+#include "cstddef"
+#include "cstring"
+#include "memory"
+#include "string"
+#include "string_view"
+#include "vector"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+
+class InputReader {
+private:
+    int fd = -1;                        // Source file descriptor
+    bool ownsFd = false;                // Whether the descriptor is closed by the reader
+    const char* mapped = nullptr;       // Whole file when memory-mapped
+    std::size_t mappedSize = 0;         // Size of the mapping
+    std::size_t released = 0;           // Start of the part of the mapping still resident
+
+    std::unique_ptr<Decompressor> decompressor;     // For compressed files, the source of streamed input
+    std::vector<char> buffer;           // Chunk buffer for streamed input
+    std::size_t chunkSize;              // Bytes requested per read()
+    bool eof = false;                   // No more data can be read into the buffer
+
+    const char* data = nullptr;         // Start of the bytes currently available
+    std::size_t size = 0;               // Number of bytes currently available
+    std::size_t pos = 0;                // Start of the next line inside data
+    unsigned long long consumed = 0;    // Bytes of the stream before data
+
+    // Let go of the pages of a mapped file that have been read. The mapping is
+    // private and never written, so the pages are simply read again from the
+    // file if a view into them is used later; they just stop counting towards
+    // the resident size of the process.
+    void releaseBehind() {
+        std::size_t end = pos & ~(RELEASE_WINDOW - 1);
+        if (end > released) {
+            madvise(const_cast<char*>(mapped) + released, end - released, MADV_DONTNEED);
+            released = end;
+        }
+    }
+
+    // Pull the next chunk of a streamed input, keeping the unfinished line
+    bool refill() {
+        if (eof) {
+            return false;
+        }
+        std::size_t left = size - pos;
+        if (left > 0 && pos > 0) {
+            std::memmove(buffer.data(), buffer.data() + pos, left);  // Keep the partial line
+        }
+        consumed += pos;
+        pos = 0;
+        if (buffer.size() - left < chunkSize) {
+            buffer.resize(left + chunkSize);    // A single line is longer than a chunk
+        }
+        ssize_t got;
+        if (decompressor != nullptr) {
+            got = static_cast<ssize_t>(decompressor->read(buffer.data() + left, buffer.size() - left));
+        }
+        else {
+            do {
+                got = ::read(fd, buffer.data() + left, buffer.size() - left);
+            } while (got < 0 && errno == EINTR);
+        }
+        if (got <= 0) {
+            eof = true;
+            got = 0;
+        }
+        data = buffer.data();
+        size = left + static_cast<std::size_t>(got);
+        return got > 0;
+    }
+
+    void open(int descriptor, bool owns) {
+        fd = descriptor;
+        ownsFd = owns;
+        if (fd < 0) {
+            return;
+        }
+        Codec codec = codecOfFile(fd);
+        if (codec != Codec::None) {
+            decompressor = std::make_unique<Decompressor>(fd, codec);
+            buffer.resize(chunkSize);
+            return;
+        }
+        struct stat info {};
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* map = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, static_cast<std::size_t>(info.st_size), MADV_SEQUENTIAL);  // Read-ahead, drop behind
+                mapped = static_cast<const char*>(map);
+                mappedSize = static_cast<std::size_t>(info.st_size);
+                data = mapped;
+                size = mappedSize;
+                eof = true;
+                return;
+            }
+        }
+        buffer.resize(chunkSize);   // Not mappable: stream it
+    }
+
+public:
+    static constexpr std::size_t DEFAULT_CHUNK_SIZE = 4 << 20;
+    static constexpr std::size_t RELEASE_WINDOW = 8 << 20;      // Read pages of a mapped file are dropped in steps of this
+
+    // Open a file by path
+    explicit InputReader(const std::string& path, std::size_t chunk = DEFAULT_CHUNK_SIZE) : chunkSize(chunk) {
+        open(::open(path.c_str(), O_RDONLY | O_CLOEXEC), true);
+    }
+    // Read from an already open descriptor (e.g. stdin), which stays open afterwards
+    explicit InputReader(int descriptor, std::size_t chunk = DEFAULT_CHUNK_SIZE) : chunkSize(chunk) {
+        open(descriptor, false);
+    }
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+
+    ~InputReader() {
+        decompressor.reset();   // Stops its thread before the file goes
+        if (mapped != nullptr) {
+            munmap(const_cast<char*>(mapped), mappedSize);
+        }
+        if (ownsFd && fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+    bool isMapped() const {
+        return mapped != nullptr;
+    }
+
+    // Whether the input is compressed and could not be decompressed to the
+    // end; known once the last line has been read
+    bool isDamaged() const {
+        return decompressor != nullptr && decompressor->isDamaged();
+    }
+    std::string problem() const {
+        return decompressor != nullptr ? decompressor->getProblem() : std::string();
+    }
+
+    // Byte offset of the next unread line in the input
+    unsigned long long offset() const {
+        return consumed + pos;
+    }
+
+    // Move to a byte offset, e.g. one recorded in a snapshot; false if the input is shorter
+    bool skipTo(unsigned long long target) {
+        if (target < offset()) {
+            return false;   // Only forwards: streamed input cannot go back
+        }
+        while (consumed + size < target) {
+            pos = size;
+            if (!refill()) {
+                return false;
+            }
+        }
+        pos = static_cast<std::size_t>(target - consumed);
+        return true;
+    }
+
+    // Get the next whole lines, with their '\n's, as one block of about maxBytes:
+    // as many lines as fit, or the next line alone if it is longer. At the end
+    // of the input the last line may lack its '\n'. Lines are broken exactly as
+    // by nextLine(). The view is valid until the next call.
+    bool nextBlock(std::string_view& block, std::size_t maxBytes) {
+        while (true) {
+            if (pos < size) {
+                const char* start = data + pos;
+                std::size_t limit = std::min(size - pos, maxBytes);
+                const void* last = memrchr(start, '\n', limit);
+                if (last == nullptr && limit < size - pos) {
+                    last = std::memchr(start + limit, '\n', size - pos - limit);
+                }
+                if (last != nullptr) {
+                    block = std::string_view(start, static_cast<std::size_t>(static_cast<const char*>(last) - start) + 1);
+                    pos += block.size();
+                    if (mapped != nullptr && pos - released >= 2 * RELEASE_WINDOW) {
+                        releaseBehind();
+                    }
+                    return true;
+                }
+            }
+            if (!refill()) {
+                if (pos < size) {   // Last line without a trailing '\n'
+                    block = std::string_view(data + pos, size - pos);
+                    pos = size;
+                    return true;
+                }
+                return false;
+            }
+        }
+    }
+
+    // Get the next line without its '\n', with the same line breaking as std::getline:
+    // a final line without '\n' is returned, an empty one after the last '\n' is not.
+    // The view is valid until the next call (for a mapped file, until the reader dies).
+    bool nextLine(std::string_view& line) {
+        while (true) {
+            const char* start = data + pos;
+            const char* newline = pos < size
+                    ? static_cast<const char*>(std::memchr(start, '\n', size - pos)) : nullptr;
+            if (newline != nullptr) {
+                line = std::string_view(start, static_cast<std::size_t>(newline - start));
+                pos += line.size() + 1;
+                if (mapped != nullptr && pos - released >= 2 * RELEASE_WINDOW) {
+                    releaseBehind();
+                }
+                return true;
+            }
+            if (!refill()) {
+                if (pos < size) {   // Last line without a trailing '\n'
+                    line = std::string_view(data + pos, size - pos);
+                    pos = size;
+                    return true;
+                }
+                return false;
+            }
+        }
+    }
+};
+
+#endif //FANTASY_INPUT_H
@@ -0,0 +1,329 @@
+//
+// Overview: hot-path instrumentation, compiled in with -DFANTASY_INSTRUMENT.
+//
+// Per command type it counts the commands, their total time, a latency
+// histogram and the heap allocations they made. Per phase it adds up where
+// the time went:
+//
+//   parse   splitting a line into a Command (names interned)
+//   lookup  finding characters and items
+//   mutate  changing the world (and whatever else a command does)
+//   format  building the narration
+//   write   handing the narration to the output target
+//
+// Phases are exclusive: entering one stops the clock of the one it interrupts.
+// Each thread counts on its own; a report adds all threads up and prints one
+// JSON line, at exit and, if asked, every N commands.
+//
+// Without FANTASY_INSTRUMENT the macros expand to nothing and the hooks cost
+// nothing.
+//
+
+#ifndef FANTASY_INSTRUMENT_H
+#define FANTASY_INSTRUMENT_H
+
+#include "string"
+
+#ifdef FANTASY_INSTRUMENT
+#include "atomic"
+#include "chrono"
+#include "cstddef"
+#include "cstdlib"
+#include "fstream"
+#include "iostream"
+#include "memory"
+#include "mutex"
+#include "new"
+#include "vector"
+#endif
+
+
+// Command types told apart by the instrumentation and the benchmark: the
+// opcodes, with Show characters (which lists everybody) apart from the other
+// Show commands. commandTypeOf() in parser.h maps a command to its type.
+const int COMMAND_TYPES = 14;
+const char* const COMMAND_TYPE_NAMES[COMMAND_TYPES] = {
+        "empty", "Create character", "Create item", "Create other", "Attack", "Cast", "Drink",
+        "Dialogue", "Show items", "unknown", "Volley", "Unleash", "Share", "Show characters"};
+
+enum class Phase { None, Parse, Lookup, Mutate, Format, Write, Count };
+
+#ifdef FANTASY_INSTRUMENT
+
+const bool INSTRUMENTED = true;
+
+const int PHASES = static_cast<int>(Phase::Count);
+const char* const PHASE_NAMES[PHASES] = {"none", "parse", "lookup", "mutate", "format", "write"};
+const int HISTOGRAM_BUCKETS = 32;   // Bucket i: latencies of i significant bits of nanoseconds
+
+// Counters of one thread. Only that thread writes them; they are atomics so
+// that a report can read them meanwhile.
+struct InstrumentCounters {
+    std::atomic<unsigned long long> commands[COMMAND_TYPES];
+    std::atomic<unsigned long long> nanoseconds[COMMAND_TYPES];
+    std::atomic<unsigned long long> allocations[COMMAND_TYPES];
+    std::atomic<unsigned long long> histogram[COMMAND_TYPES][HISTOGRAM_BUCKETS];
+    std::atomic<unsigned long long> phaseNanoseconds[PHASES];
+
+    static void add(std::atomic<unsigned long long>& counter, unsigned long long amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
+
+// Counters of every thread, and where reports go
+struct InstrumentRegistry {
+    std::mutex lock;                                        // Guards threads and the report output
+    std::vector<std::unique_ptr<InstrumentCounters>> threads;
+    std::atomic<unsigned long long> commands{0};            // Commands of all threads
+    std::string path;                                       // Reports are appended here; empty for stderr
+    unsigned long long every = 0;                           // Commands between reports, 0 for only at exit
+};
+
+inline InstrumentRegistry& instrumentRegistry() {
+    static InstrumentRegistry registry;
+    return registry;
+}
+
+// State of the calling thread
+struct InstrumentThread {
+    Phase phase = Phase::None;                      // Phase the clock runs for
+    std::chrono::steady_clock::time_point since;    // When it started
+    unsigned long long allocations = 0;             // Heap allocations so far
+    InstrumentCounters* counters = nullptr;
+};
+inline thread_local InstrumentThread instrumentThread;
+
+inline InstrumentCounters& threadCounters() {
+    InstrumentThread& self = instrumentThread;
+    if (self.counters == nullptr) {
+        InstrumentRegistry& registry = instrumentRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.threads.push_back(std::make_unique<InstrumentCounters>());
+        self.counters = registry.threads.back().get();
+    }
+    return *self.counters;
+}
+
+inline unsigned long long nanosecondsBetween(std::chrono::steady_clock::time_point from,
+                                             std::chrono::steady_clock::time_point to) {
+    return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+}
+
+// Stop the clock of the current phase and start that of next; returns the phase left
+inline Phase switchPhase(Phase next) {
+    InstrumentThread& self = instrumentThread;
+    auto now = std::chrono::steady_clock::now();
+    if (self.phase != Phase::None) {
+        InstrumentCounters::add(threadCounters().phaseNanoseconds[static_cast<int>(self.phase)],
+                                nanosecondsBetween(self.since, now));
+    }
+    Phase previous = self.phase;
+    self.phase = next;
+    self.since = now;
+    return previous;
+}
+
+// Append a report of all threads, as one line of JSON
+inline void writeInstrumentReport() {
+    InstrumentRegistry& registry = instrumentRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    auto sum = [&](auto counterOf) {
+        unsigned long long total = 0;
+        for (const std::unique_ptr<InstrumentCounters>& counters : registry.threads) {
+            total += counterOf(*counters).load(std::memory_order_relaxed);
+        }
+        return total;
+    };
+
+    std::string report = "{\"commands\":" + std::to_string(registry.commands.load()) + ",\"types\":{";
+    bool first = true;
+    for (int type = 0; type < COMMAND_TYPES; type++) {
+        unsigned long long count = sum([&](InstrumentCounters& c) -> auto& { return c.commands[type]; });
+        if (count == 0) {
+            continue;
+        }
+        report += first ? "\"" : ",\"";
+        first = false;
+        report += std::string(COMMAND_TYPE_NAMES[type]) + "\":{\"count\":" + std::to_string(count)
+                + ",\"ns\":" + std::to_string(sum([&](InstrumentCounters& c) -> auto& { return c.nanoseconds[type]; }))
+                + ",\"allocations\":" + std::to_string(sum([&](InstrumentCounters& c) -> auto& { return c.allocations[type]; }))
+                + ",\"histogram\":[";
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            report += (bucket == 0 ? "" : ",")
+                    + std::to_string(sum([&](InstrumentCounters& c) -> auto& { return c.histogram[type][bucket]; }));
+        }
+        report += "]}";
+    }
+    report += "},\"phases_ns\":{";
+    for (int phase = 1; phase < PHASES; phase++) {
+        report += (phase == 1 ? "\"" : ",\"") + std::string(PHASE_NAMES[phase]) + "\":"
+                + std::to_string(sum([&](InstrumentCounters& c) -> auto& { return c.phaseNanoseconds[phase]; }));
+    }
+    report += "}}\n";
+
+    if (registry.path.empty()) {
+        std::cerr << report;
+    }
+    else {
+        std::ofstream(registry.path, std::ios::app) << report;
+    }
+}
+
+// Report at exit, and every `every` commands if that is not 0
+inline void startInstrumentReports(const std::string& path, unsigned long long every) {
+    InstrumentRegistry& registry = instrumentRegistry();   // Built before the handler is registered, so it outlives it
+    registry.path = path;
+    registry.every = every;
+    std::atexit(writeInstrumentReport);
+}
+
+// Times one phase until the end of the enclosing scope
+class PhaseScope {
+private:
+    Phase previous;
+
+public:
+    explicit PhaseScope(Phase phase) : previous(switchPhase(phase)) {}
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+    ~PhaseScope() {
+        switchPhase(previous);
+    }
+};
+
+// Times one command, from construction to the end of the enclosing scope.
+// Its time counts as mutate until a handler switches phase.
+class CommandScope {
+private:
+    int type;
+    std::chrono::steady_clock::time_point start;
+    unsigned long long allocations;
+    Phase previous;
+
+public:
+    explicit CommandScope(int type) : type(type), start(std::chrono::steady_clock::now()),
+                                      allocations(instrumentThread.allocations), previous(switchPhase(Phase::Mutate)) {}
+    CommandScope(const CommandScope&) = delete;
+    CommandScope& operator=(const CommandScope&) = delete;
+    ~CommandScope() {
+        switchPhase(previous);
+        unsigned long long elapsed = nanosecondsBetween(start, std::chrono::steady_clock::now());
+        int bucket = 0;
+        while (bucket < HISTOGRAM_BUCKETS - 1 && (elapsed >> bucket) != 0) {
+            bucket++;
+        }
+        InstrumentCounters& counters = threadCounters();
+        InstrumentCounters::add(counters.commands[type], 1);
+        InstrumentCounters::add(counters.nanoseconds[type], elapsed);
+        InstrumentCounters::add(counters.allocations[type], instrumentThread.allocations - allocations);
+        InstrumentCounters::add(counters.histogram[type][bucket], 1);
+
+        InstrumentRegistry& registry = instrumentRegistry();
+        unsigned long long done = registry.commands.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (registry.every != 0 && done % registry.every == 0) {
+            writeInstrumentReport();
+        }
+    }
+};
+
+// Count heap allocations per thread. The replacements are defined here, once:
+// the whole program is one translation unit. Every form of new and delete is
+// replaced, on malloc and free, so none of them reaches the default allocator.
+inline void* instrumentAllocate(std::size_t size, std::size_t alignment) noexcept {
+    instrumentThread.allocations++;
+    size = size == 0 ? 1 : size;
+    if (alignment <= alignof(std::max_align_t)) {
+        return std::malloc(size);
+    }
+    void* memory = nullptr;
+    return posix_memalign(&memory, alignment, size) == 0 ? memory : nullptr;
+}
+inline void* instrumentAllocateOrThrow(std::size_t size, std::size_t alignment) {
+    if (void* memory = instrumentAllocate(size, alignment)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) {
+    return instrumentAllocateOrThrow(size, 0);
+}
+void* operator new[](std::size_t size) {
+    return instrumentAllocateOrThrow(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return instrumentAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return instrumentAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return instrumentAllocate(size, 0);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return instrumentAllocate(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return instrumentAllocate(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return instrumentAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, std::align_val_t, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, std::align_val_t, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+
+// Time a command of this type until the end of the scope
+#define INSTRUMENT_COMMAND(type) CommandScope instrumentCommand(type)
+// Time a phase until the end of the scope
+#define INSTRUMENT_SCOPE(phase) PhaseScope instrumentPhase(phase)
+// Count the time from here on as this phase (inside a command)
+#define INSTRUMENT_STAGE(phase) switchPhase(phase)
+
+#else
+
+const bool INSTRUMENTED = false;
+
+inline void startInstrumentReports(const std::string&, unsigned long long) {}
+
+#define INSTRUMENT_COMMAND(type) ((void) 0)
+#define INSTRUMENT_SCOPE(phase) ((void) 0)
+#define INSTRUMENT_STAGE(phase) ((void) 0)
+
+#endif
+
+#endif //FANTASY_INSTRUMENT_H
@@ -0,0 +1,597 @@
+//
+// Overview: the state-delta journal and time-travel queries on it.
+//
+// With --journal a run records, next to the narration, every change to the
+// town: characters arriving and dying, hit points changing and items entering
+// and leaving an inventory. Every so many commands it also records a
+// checkpoint, the whole town at that point. --query answers
+//     Show characters at N
+//     Show <weapons|potions|spells> <name> at N
+// with what Show would have printed right after command N, by starting from
+// the last checkpoint before N and applying the deltas up to it, instead of
+// running the scenario again.
+//
+// Layout: a JournalHeader, then the records, then the name table (in id
+// order), the checkpoint index and a JournalFooter. A record is a tag byte
+// and LEB128 numbers (zigzag for hit points). The deltas of a command follow
+// a Step record that brings the count of finished commands up to the one
+// before it; commands that change nothing cost nothing.
+//
+
+#ifndef FANTASY_JOURNAL_H
+#define FANTASY_JOURNAL_H
+
+#include "algorithm"
+#include "charconv"
+#include "cstddef"
+#include "cstdint"
+#include "cstring"
+#include "string"
+#include "string_view"
+#include "utility"
+#include "vector"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "character_traits.h"
+#include "narration.h"
+#include "output.h"
+#include "symbols.h"
+
+
+const std::uint32_t JOURNAL_MAGIC = 0x4c4e4a46;     // "FJNL" on a little-endian host
+const std::uint32_t JOURNAL_VERSION = 1;
+
+struct JournalHeader {
+    std::uint32_t magic;            // JOURNAL_MAGIC
+    std::uint32_t version;          // JOURNAL_VERSION
+    std::uint64_t every;            // Commands between checkpoints
+};
+
+struct JournalFooter {
+    std::uint64_t commands;         // Commands recorded
+    std::uint64_t namesOffset;      // Start of the name table
+    std::uint64_t indexOffset;      // Start of the checkpoint index
+    std::uint32_t magic;            // JOURNAL_MAGIC again: the journal was finished
+    std::uint32_t version;
+};
+
+// Record tags
+enum class JournalRecord : char {
+    Step = 's',         // count: that many more commands have finished
+    Arrive = 'a',       // id, class, hp
+    Depart = 'd',       // id
+    HitPoints = 'h',    // id, hp
+    AddItem = 'i',      // owner, kind, item, value (replaces an item of the same name)
+    RemoveItem = 'r',   // owner, kind, item
+    Checkpoint = 'k'    // commands, resident count, then per resident: id, class, hp and the items of each kind
+};
+
+// The town as the journal sees it: only what Show prints. Item kinds are
+// 0 to 2 (weapons, potions, spells), as in the inventories of both engines;
+// the value of an item is its damage, heal or victim count.
+class JournalTown {
+public:
+    struct Item {
+        NameId name;
+        int value;
+    };
+    struct Resident {
+        bool alive = false;
+        std::uint8_t type = 0;
+        int hp = 0;
+        std::uint32_t place = 0;        // Index in living
+        std::vector<Item> items[3];     // In the order they came, sorted when shown
+    };
+
+private:
+    std::vector<Resident> residents;    // By name id
+    std::vector<NameId> living;         // Ids of the living residents, in no particular order
+
+    Resident& at(NameId id) {
+        if (id >= residents.size()) {
+            residents.resize(id + 1);
+        }
+        return residents[id];
+    }
+
+public:
+    void clear() {
+        residents.clear();
+        living.clear();
+    }
+    void arrive(NameId id, int type, int hp) {
+        Resident& resident = at(id);
+        if (!resident.alive) {
+            resident.place = static_cast<std::uint32_t>(living.size());
+            living.push_back(id);
+        }
+        resident.alive = true;
+        resident.type = static_cast<std::uint8_t>(type);
+        resident.hp = hp;
+        for (std::vector<Item>& items : resident.items) {
+            items.clear();
+        }
+    }
+    void depart(NameId id) {
+        Resident& resident = at(id);
+        if (resident.alive) {
+            residents[living.back()].place = resident.place;
+            living[resident.place] = living.back();
+            living.pop_back();
+        }
+        resident.alive = false;
+        for (std::vector<Item>& items : resident.items) {
+            items.clear();
+        }
+    }
+    void setHP(NameId id, int hp) {
+        at(id).hp = hp;
+    }
+    void addItem(NameId owner, int kind, NameId item, int value) {
+        std::vector<Item>& items = at(owner).items[kind];
+        for (Item& held : items) {
+            if (held.name == item) {
+                held.value = value;
+                return;
+            }
+        }
+        items.push_back({item, value});
+    }
+    void removeItem(NameId owner, int kind, NameId item) {
+        std::vector<Item>& items = at(owner).items[kind];
+        for (std::size_t i = 0; i < items.size(); i++) {
+            if (items[i].name == item) {
+                items.erase(items.begin() + static_cast<std::ptrdiff_t>(i));
+                return;
+            }
+        }
+    }
+
+    const std::vector<Resident>& getResidents() const {
+        return residents;
+    }
+    const std::vector<NameId>& getLiving() const {
+        return living;
+    }
+    const Resident* find(NameId id) const {
+        return id < residents.size() && residents[id].alive ? &residents[id] : nullptr;
+    }
+};
+
+// Records the journal of a run. The world calls the delta functions from
+// its mutations and beginCommand() from execute().
+class JournalWriter {
+private:
+    FdTarget target;
+    OutputSink out;
+    unsigned long long every;               // Commands between checkpoints, 0 for none
+    unsigned long long commands = 0;        // Commands begun
+    unsigned long long recorded = 0;        // Finished commands the records account for
+    std::vector<std::pair<unsigned long long, unsigned long long>> checkpoints;    // Command and offset
+    JournalTown town;                       // Kept up to date for the checkpoints
+    const SymbolTable* names = nullptr;
+
+    void putNumber(std::uint64_t value) {
+        while (value >= 0x80) {
+            out.put(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.put(static_cast<char>(value));
+    }
+    void putSigned(int value) {
+        auto wide = static_cast<std::int64_t>(value);
+        putNumber(static_cast<std::uint64_t>(wide) << 1 ^ static_cast<std::uint64_t>(wide >> 63));
+    }
+    void putTag(JournalRecord tag) {
+        out.put(static_cast<char>(tag));
+    }
+
+    // Account for the finished commands up to finished
+    void advanceTo(unsigned long long finished) {
+        if (recorded < finished) {
+            putTag(JournalRecord::Step);
+            putNumber(finished - recorded);
+            recorded = finished;
+        }
+    }
+    // Before a delta of the current command
+    void startDelta(JournalRecord tag) {
+        advanceTo(commands - 1);
+        putTag(tag);
+    }
+
+    void checkpoint() {
+        advanceTo(commands);
+        checkpoints.emplace_back(commands, out.bytesWritten());
+        putTag(JournalRecord::Checkpoint);
+        putNumber(commands);
+        putNumber(town.getLiving().size());
+        for (NameId id : town.getLiving()) {
+            const JournalTown::Resident& resident = town.getResidents()[id];
+            putNumber(id);
+            putNumber(resident.type);
+            putSigned(resident.hp);
+            for (const std::vector<JournalTown::Item>& items : resident.items) {
+                putNumber(items.size());
+                for (const JournalTown::Item& item : items) {
+                    putNumber(item.name);
+                    putSigned(item.value);
+                }
+            }
+        }
+    }
+
+public:
+    JournalWriter(const std::string& path, unsigned long long every)
+            : target(path), out(target), every(every) {
+        JournalHeader header = {JOURNAL_MAGIC, JOURNAL_VERSION, every};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    bool is_open() const {
+        return target.is_open();
+    }
+    // The name table of the world being recorded, written out by finish()
+    void useNames(const SymbolTable& table) {
+        names = &table;
+    }
+
+    void beginCommand() {
+        if (every != 0 && commands != 0 && commands % every == 0) {
+            checkpoint();
+        }
+        commands++;
+    }
+
+    void arrive(NameId id, int type, int hp) {
+        town.arrive(id, type, hp);
+        startDelta(JournalRecord::Arrive);
+        putNumber(id);
+        putNumber(static_cast<std::uint64_t>(type));
+        putSigned(hp);
+    }
+    void depart(NameId id) {
+        town.depart(id);
+        startDelta(JournalRecord::Depart);
+        putNumber(id);
+    }
+    void setHP(NameId id, int hp) {
+        town.setHP(id, hp);
+        startDelta(JournalRecord::HitPoints);
+        putNumber(id);
+        putSigned(hp);
+    }
+    void addItem(NameId owner, int kind, NameId item, int value) {
+        town.addItem(owner, kind, item, value);
+        startDelta(JournalRecord::AddItem);
+        putNumber(owner);
+        putNumber(static_cast<std::uint64_t>(kind));
+        putNumber(item);
+        putSigned(value);
+    }
+    void removeItem(NameId owner, int kind, NameId item) {
+        town.removeItem(owner, kind, item);
+        startDelta(JournalRecord::RemoveItem);
+        putNumber(owner);
+        putNumber(static_cast<std::uint64_t>(kind));
+        putNumber(item);
+    }
+
+    // Write the name table, the checkpoint index and the footer, once the run is over
+    void finish() {
+        advanceTo(commands);
+        JournalFooter footer = {commands, out.bytesWritten(), 0, JOURNAL_MAGIC, JOURNAL_VERSION};
+        std::size_t count = names == nullptr ? 0 : names->size();
+        putNumber(count);
+        for (NameId id = 0; id < count; id++) {
+            putNumber(names->name(id).size());
+            out << names->name(id);
+        }
+        footer.indexOffset = out.bytesWritten();
+        putNumber(checkpoints.size());
+        for (const auto& [command, offset] : checkpoints) {
+            putNumber(command);
+            putNumber(offset);
+        }
+        out.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        out.flush();
+    }
+};
+
+// A finished journal mapped into memory, answering queries about it
+class JournalReader {
+private:
+    const char* mapped = nullptr;   // The whole journal
+    std::size_t mappedSize = 0;
+    const char* records = nullptr;  // First record
+    const char* recordsEnd = nullptr;
+    JournalFooter footer = {};
+    SymbolTable names;
+    std::vector<std::pair<unsigned long long, const char*>> checkpoints;    // Command and record
+    bool damaged = false;           // A record could not be read
+
+    JournalTown town;               // The town after `finished` commands...
+    unsigned long long finished = 0;
+    const char* next = nullptr;     // ...and the first record not applied to it
+
+    // Read a number at *at, moving past it; 0 and damaged at the end of the data
+    std::uint64_t number(const char*& at, const char* end) {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (at == end) {
+                damaged = true;
+                return 0;
+            }
+            auto byte = static_cast<unsigned char>(*at++);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+        damaged = true;
+        return 0;
+    }
+    int signedNumber(const char*& at, const char* end) {
+        std::uint64_t value = number(at, end);
+        return static_cast<int>(static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1));
+    }
+    NameId nameNumber(const char*& at) {
+        std::uint64_t id = number(at, recordsEnd);
+        if (id >= names.size()) {
+            damaged = true;
+            return 0;
+        }
+        return static_cast<NameId>(id);
+    }
+    int kindNumber(const char*& at) {
+        std::uint64_t kind = number(at, recordsEnd);
+        if (kind > 2) {
+            damaged = true;
+            return 0;
+        }
+        return static_cast<int>(kind);
+    }
+    int classNumber(const char*& at) {
+        std::uint64_t type = number(at, recordsEnd);
+        if (type >= static_cast<std::uint64_t>(CharacterClasses::COUNT)) {
+            damaged = true;
+            return 0;
+        }
+        return static_cast<int>(type);
+    }
+
+    // Replace the town with the checkpoint at *at (past its tag)
+    void loadCheckpoint(const char*& at) {
+        town.clear();
+        finished = number(at, recordsEnd);
+        std::uint64_t count = number(at, recordsEnd);
+        for (std::uint64_t i = 0; i < count && !damaged; i++) {
+            NameId id = nameNumber(at);
+            int type = classNumber(at);
+            town.arrive(id, type, signedNumber(at, recordsEnd));
+            for (int kind = 0; kind < 3; kind++) {
+                std::uint64_t items = number(at, recordsEnd);
+                for (std::uint64_t k = 0; k < items && !damaged; k++) {
+                    NameId item = nameNumber(at);
+                    town.addItem(id, kind, item, signedNumber(at, recordsEnd));
+                }
+            }
+        }
+    }
+
+    // Bring the town to the state after command, from the best starting point
+    bool seek(unsigned long long command) {
+        auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(), command,
+                                      [](unsigned long long c, const auto& point) { return c < point.first; });
+        unsigned long long start = after == checkpoints.begin() ? 0 : std::prev(after)->first;
+        if (next == nullptr || finished > command || finished < start) {
+            town.clear();
+            finished = 0;
+            next = records;
+            if (start != 0) {
+                next = std::prev(after)->second + 1;
+                loadCheckpoint(next);
+            }
+        }
+        while (next < recordsEnd && !damaged) {
+            const char* at = next;
+            auto tag = static_cast<JournalRecord>(*at++);
+            if (tag == JournalRecord::Step) {
+                std::uint64_t steps = number(at, recordsEnd);
+                if (finished + steps > command) {
+                    break;
+                }
+                finished += steps;
+            }
+            else if (finished >= command) {
+                break;      // The deltas of a later command
+            }
+            else if (tag == JournalRecord::Arrive) {
+                NameId id = nameNumber(at);
+                int type = classNumber(at);
+                town.arrive(id, type, signedNumber(at, recordsEnd));
+            }
+            else if (tag == JournalRecord::Depart) {
+                town.depart(nameNumber(at));
+            }
+            else if (tag == JournalRecord::HitPoints) {
+                NameId id = nameNumber(at);
+                town.setHP(id, signedNumber(at, recordsEnd));
+            }
+            else if (tag == JournalRecord::AddItem) {
+                NameId owner = nameNumber(at);
+                int kind = kindNumber(at);
+                NameId item = nameNumber(at);
+                town.addItem(owner, kind, item, signedNumber(at, recordsEnd));
+            }
+            else if (tag == JournalRecord::RemoveItem) {
+                NameId owner = nameNumber(at);
+                int kind = kindNumber(at);
+                town.removeItem(owner, kind, nameNumber(at));
+            }
+            else if (tag == JournalRecord::Checkpoint) {
+                loadCheckpoint(at);
+            }
+            else {
+                damaged = true;
+            }
+            next = at;
+        }
+        return !damaged;
+    }
+
+    void sortByName(std::vector<NameId>& ids) const {
+        std::sort(ids.begin(), ids.end(), [this](NameId a, NameId b) {
+            return names.name(a) < names.name(b);
+        });
+    }
+
+public:
+    // Map a journal; is_open() tells whether it is a finished one
+    explicit JournalReader(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info {};
+        if (fstat(fd, &info) == 0
+                && static_cast<std::size_t>(info.st_size) >= sizeof(JournalHeader) + sizeof(JournalFooter)) {
+            void* map = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                mapped = static_cast<const char*>(map);
+                mappedSize = static_cast<std::size_t>(info.st_size);
+            }
+        }
+        ::close(fd);
+        if (mapped == nullptr) {
+            return;
+        }
+        JournalHeader header = {};
+        std::memcpy(&header, mapped, sizeof(header));
+        std::memcpy(&footer, mapped + mappedSize - sizeof(footer), sizeof(footer));
+        std::size_t tableEnd = mappedSize - sizeof(footer);
+        if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION
+                || footer.magic != JOURNAL_MAGIC || footer.version != JOURNAL_VERSION
+                || footer.namesOffset < sizeof(header) || footer.namesOffset > footer.indexOffset
+                || footer.indexOffset > tableEnd) {
+            close();
+            return;
+        }
+        records = mapped + sizeof(header);
+        recordsEnd = mapped + footer.namesOffset;
+
+        const char* at = recordsEnd;
+        const char* end = mapped + footer.indexOffset;
+        std::uint64_t count = number(at, end);
+        for (std::uint64_t i = 0; i < count && !damaged; i++) {
+            std::uint64_t length = number(at, end);
+            if (length > static_cast<std::uint64_t>(end - at)) {
+                damaged = true;
+                break;
+            }
+            names.intern(std::string_view(at, length));
+            at += length;
+        }
+        end = mapped + tableEnd;
+        count = number(at, end);
+        for (std::uint64_t i = 0; i < count && !damaged; i++) {
+            std::uint64_t command = number(at, end);
+            std::uint64_t offset = number(at, end);
+            if (offset < sizeof(header) || offset >= footer.namesOffset
+                    || mapped[offset] != static_cast<char>(JournalRecord::Checkpoint)) {
+                damaged = true;
+                break;
+            }
+            checkpoints.emplace_back(command, mapped + offset);
+        }
+        if (damaged) {
+            close();
+        }
+    }
+    JournalReader(const JournalReader&) = delete;
+    JournalReader& operator=(const JournalReader&) = delete;
+    ~JournalReader() {
+        close();
+    }
+
+    void close() {
+        if (mapped != nullptr) {
+            munmap(const_cast<char*>(mapped), mappedSize);
+            mapped = nullptr;
+        }
+    }
+    bool is_open() const {
+        return mapped != nullptr;
+    }
+    // Answer "Show <what> [name] at N" with what Show printed after command N.
+    // Other lines are a wrong command; N past the end or a damaged journal is an error.
+    void answer(std::string_view line, OutputSink& out) {
+        while (!line.empty() && (line.back() == ' ' || line.back() == '\r')) {
+            line.remove_suffix(1);
+        }
+        std::string_view tokens[5];
+        int count = 0;
+        while (!line.empty() && count < 5) {
+            std::size_t start = line.find_first_not_of(' ');
+            if (start == std::string_view::npos) {
+                break;
+            }
+            line.remove_prefix(start);
+            std::size_t length = std::min(line.find(' '), line.size());
+            tokens[count++] = line.substr(0, length);
+            line.remove_prefix(length);
+        }
+        unsigned long long command = 0;
+        std::string_view at = count >= 4 ? tokens[count - 1] : std::string_view();
+        if (count < 4 || !line.empty() || tokens[0] != "Show" || tokens[count - 2] != "at"
+                || std::from_chars(at.data(), at.data() + at.size(), command).ptr != at.data() + at.size()) {
+            out << "wrong command\n";
+            return;
+        }
+        if (command > footer.commands || !seek(command)) {
+            out << "Error caught\n";
+            return;
+        }
+        std::vector<NameId> listed;
+        std::string_view what = tokens[1];
+        if (what.empty() || what[0] == 'c') {
+            const std::vector<JournalTown::Resident>& residents = town.getResidents();
+            listed = town.getLiving();
+            sortByName(listed);
+            for (NameId id : listed) {
+                const JournalTown::Resident& resident = residents[id];
+                out.print(names.name(id), ':', CharacterClasses::INFO[resident.type].name, ':', resident.hp, ' ');
+            }
+            out << "\n";
+            return;
+        }
+        int kind = what[0] == 'w' ? 0 : what[0] == 'p' ? 1 : what[0] == 's' ? 2 : -1;
+        if (kind < 0) {
+            return;     // Show prints nothing for anything else
+        }
+        const JournalTown::Resident* resident = count == 5 ? town.find(names.find(tokens[2])) : nullptr;
+        if (resident == nullptr || CharacterClasses::INFO[resident->type].capacity[kind] == 0) {
+            out << "Error caught\n";
+            return;
+        }
+        std::vector<const JournalTown::Item*> items;
+        for (const JournalTown::Item& item : resident->items[kind]) {
+            items.push_back(&item);
+        }
+        std::sort(items.begin(), items.end(), [this](const JournalTown::Item* a, const JournalTown::Item* b) {
+            return names.name(a->name) < names.name(b->name);
+        });
+        for (const JournalTown::Item* item : items) {
+            narrateListed(out, names.name(item->name), item->value);
+        }
+        out << "\n";
+    }
+};
+
+#endif //FANTASY_JOURNAL_H
@@ -16,82 +16,151 @@
 #include "string"
 #include "iostream"
 #include "memory"
-#include "sstream"
+#include "mutex"
 #include "iterator"
-#include "map"
 #include "set"
+#include "algorithm"
+#include "atomic"
+#include "charconv"
+#include "type_traits"
 #include "vector"
+#include "string_view"
+
+#include "batch.h"
+#include "bench.h"
+#include "bulk.h"
+#include "character_traits.h"
+#include "compiled.h"
+#include "compress.h"
+#include "generator.h"
+#include "hp_index.h"
+#include "input.h"
+#include "journal.h"
+#include "narration.h"
+#include "output.h"
+#include "parallel.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "scenario.h"
+#include "server.h"
+#include "snapshot.h"
+#include "soa_world.h"
+#include "symbols.h"
 
 
-std::ofstream outputFile("output.txt");
-
 // Forward declarations
 class PhysicalItem;
 class Weapon;
 class Potion;
 class Spell;
+class Character;
 
 
-// Container class template for managing collections of items
-template<typename T>
+// Container class template for managing collections of items.
+// Items are owned by the world's pools; the container only points at them.
+template<typename T, int N>
 class Container {
 private:
-    std::map<std::string, std::shared_ptr<T>> container;  // Map to store items
+    T* container[N];    // Items ordered by name
+    int count;      // Number of items held
     int maxSize;    // Maximum size of the container
     int size;       // Current size of the container
 
 public:
-    explicit Container(int maxsize) : maxSize(maxsize), size(0) {}    // Constructor with maximum size
-    explicit Container() : maxSize(0), size(0) {}    // Default constructor
+    explicit Container(int maxsize) : container(), count(0), maxSize(maxsize), size(0) {}    // Constructor with maximum size
+    explicit Container() : container(), count(0), maxSize(0), size(0) {}    // Default constructor
 
-    // Add an item to the container
-    void addItem(std::shared_ptr<T>& item) {
+    // Add an item to the container, false if the container is full.
+    // An item with the same name is replaced and handed back through replaced.
+    bool addItem(T* item, T*& replaced) {
+        replaced = nullptr;
         if (size < maxSize) {   // Check if container is not full
-            container[item->getName()] = item;    // Add item to the container
+            // Containers hold a handful of items: a linear scan keeps them in name order
+            int i = 0;
+            while (i < count && container[i]->getName() < item->getName()) {
+                i++;
+            }
+            if (i < count && container[i]->getId() == item->getId()) {
+                replaced = container[i];  // Same name: the new item replaces the old one
+                container[i] = item;
+            }
+            else {
+                for (int j = count; j > i; j--) {
+                    container[j] = container[j - 1];
+                }
+                container[i] = item;    // Add item to the container
+                count += 1;
+            }
             size += 1;  // Increment size
+            return true;
         }
-        else {
-            outputFile << "Error caught\n";    // Output error if container is full
-        }
+        return false;
     }
 
-    // Find an item in the container by label
-    std::shared_ptr<T> find(std::string label) {
-        auto it = container.find(label);    // Find item in the container
-        if (it != container.end()) {
-            return it->second;  // Return item if found
+    // Find an item in the container by name
+    T* find(NameId label) const {
+        for (int i = 0; i < count; i++) {   // Find item in the container
+            if (container[i]->getId() == label) {
+                return container[i];  // Return item if found
+            }
         }
         return nullptr; // Return null if item not found
     }
 
-    // Delete an item from the container by label
-    void deleteItem(std::string label) {
-        container.erase(label); // Erase item from the container
+    // Delete an item from the container by name, returns the item taken out
+    T* deleteItem(NameId label) {
+        T* removed = nullptr;
+        for (int i = 0; i < count; i++) {
+            if (container[i]->getId() == label) {
+                removed = container[i]; // Erase item from the container
+                for (int j = i + 1; j < count; j++) {
+                    container[j - 1] = container[j];
+                }
+                count -= 1;
+                break;
+            }
+        }
         size -= 1;  // Decrement size
+        return removed;
     }
 
-    // Getters for container attributes
-    std::map<std::string, std::shared_ptr<T>>& getContainer() {
-        return container;   // Return the container
+    // Items in name order
+    T* const* begin() const {
+        return container;
+    }
+    T* const* end() const {
+        return container + count;
     }
-    int getRemainingSize() {
+    // Getters for container attributes
+    int getRemainingSize() const {
         return maxSize - size;  // Return remaining size of the container
     }
-    int getMaxSize() {
+    int getMaxSize() const {
         return maxSize; // Return maximum size of the container
     }
+    // Capacity used up, as restored from a snapshot
+    void setUsedSize(int used) {
+        size = used;
+    }
 };
 
+// Container sizes are fixed by the roomiest character class
+using WeaponContainer = Container<Weapon, CharacterClasses::MAX_GUNS>;
+using PotionContainer = Container<Potion, CharacterClasses::MAX_POTIONS>;
+using SpellContainer = Container<Spell, CharacterClasses::MAX_SPELLS>;
+
 // Base class for characters
 class Character {
 protected:
-    Container<Weapon> guns;     // Container for weapons
-    Container<Potion> drugs;    // Container for potions
-    Container<Spell> swears;    // Container for spells
+    WeaponContainer guns;       // Container for weapons
+    PotionContainer drugs;      // Container for potions
+    SpellContainer swears;      // Container for spells
 
     int hp;                     // Hit points
-    std::string name;           // Name of the character
-    std::string type;           // Type of the character
+    NameId id;                  // Interned name of the character
+    std::string_view name;      // Name of the character (owned by the symbol table)
+    std::string_view type;      // Type of the character
 
     // Functions for managing health
     void takeDamage(int damage) {}
@@ -99,14 +168,14 @@ protected:
 
 public:
     // Constructor
-    Character(std::string name, int hp, std::string type,
+    Character(NameId id, std::string_view name, int hp, std::string_view type,
               int MAX_ALLOWED_GUNS, int MAX_ALLOWED_POTIONS, int MAX_ALLOWED_SPELLS):
             guns(MAX_ALLOWED_GUNS), drugs(MAX_ALLOWED_POTIONS), swears(MAX_ALLOWED_SPELLS) {
         this->hp = hp;
+        this->id = id;
         this->name = name;
         this->type = type;
     }
-    virtual ~Character() = default; // Destructor
     // Getters and setters for character attributes
     int getHP() const {
         return hp;
@@ -114,44 +183,80 @@ public:
     void setHP(int hp) {
         this->hp = hp;
     }
-    std::string getName() {
+    NameId getId() const {
+        return id;
+    }
+    std::string_view getName() const {
         return name;
     }
-    std::string getType() {
+    std::string_view getType() const {
         return type;
     }
-    // Virtual functions for character actions
-    virtual void attack(std::shared_ptr<Character> character, std::string itemName) = 0;
-    virtual void potion(std::shared_ptr<Character> character, std::string itemName) = 0;
-    virtual void spell(std::shared_ptr<Character> character, std::string itemName) = 0;
-    virtual void assignItem(std::shared_ptr<PhysicalItem> item, std::string type) = 0;
-    virtual void assignItem(std::shared_ptr<PhysicalItem> item, std::map<std::string, std::shared_ptr<Character>> victims) = 0;
-    virtual Container<Weapon> getWeapons() = 0;
-    virtual Container<Potion> getPotions() = 0;
-    virtual Container<Spell> getSpells() = 0;
+    // Character actions (defined once the item classes are complete).
+    // Potions and spells are used up: they are returned for the world to free.
+    void attack(Character *character, NameId itemId);
+    Potion* potion(Character *character, NameId itemId);
+    Spell* spell(Character *character, NameId itemId);
+    // Area-of-effect actions: the weapon hits every target, the potion heals
+    // every drinker and the spell is used up once (its victims are removed by the world)
+    void attackAll(Character* const* targets, std::size_t count, NameId itemId);
+    Potion* potionAll(Character* const* drinkers, std::size_t count, NameId itemId);
+    Spell* spellAll(NameId itemId);
+    // Give an item to the character, false if there is no room for it.
+    // The container is picked from the item type at compile time.
+    template<typename Item>
+    bool assignItem(Item* item, Item*& replaced) {
+        if constexpr (std::is_same_v<Item, Weapon>) {
+            return guns.addItem(item, replaced);
+        }
+        else if constexpr (std::is_same_v<Item, Potion>) {
+            return drugs.addItem(item, replaced);
+        }
+        else {
+            static_assert(std::is_same_v<Item, Spell>, "characters only hold weapons, potions and spells");
+            return swears.addItem(item, replaced);
+        }
+    }
+    // Inventory views: references to the character's own containers, never copies
+    const WeaponContainer& getWeapons() const {
+        return guns;
+    }
+    const PotionContainer& getPotions() const {
+        return drugs;
+    }
+    const SpellContainer& getSpells() const {
+        return swears;
+    }
+    // Capacity used up by each container, as restored from a snapshot
+    void restoreUsage(int weapons, int potions, int spells) {
+        guns.setUsedSize(weapons);
+        drugs.setUsedSize(potions);
+        swears.setUsedSize(spells);
+    }
 };
 
 
 // Base class for physical items
 class PhysicalItem {
 private:
-    std::shared_ptr<Character> owner;  // Owner of the item
-    std::string name;   // Name of the item
+    Handle<Character> owner;    // Owner of the item, checked against the world on use
+    NameId id;              // Interned name of the item
+    std::string_view name;  // Name of the item (owned by the symbol table)
     friend class Character; // Friend class declaration
 
 public:
     // Constructor
-    PhysicalItem(std::shared_ptr<Character>& owner, std::string name) : owner(owner), name(name) {}
+    PhysicalItem(Handle<Character> owner, NameId id, std::string_view name) : owner(owner), id(id), name(name) {}
 
-    virtual ~PhysicalItem() {} ;    // Destructor
-    // Virtual function for using the item
-    virtual void use(Character *user, std::shared_ptr<Character> target) = 0;
     // Getter for item name
-    std::string getName() {
+    NameId getId() const {
+        return id;  // Return the interned name of the item
+    }
+    std::string_view getName() const {
         return name;    // Return the name of the item
     }
-    // Getter for owner of the item
-    std::shared_ptr<Character> getOwner() {
+    // Getter for owner of the item (resolve it with World::resolve)
+    Handle<Character> getOwner() const {
         return owner;   // Return the owner of the item
     };
 };
@@ -161,13 +266,13 @@ class Weapon : public PhysicalItem {
 private:
     int damage;
 public:
-    Weapon(std::shared_ptr<Character> owner, std::string name, int damage) : PhysicalItem(owner, name), damage(damage) {
+    Weapon(Handle<Character> owner, NameId id, std::string_view name, int damage) : PhysicalItem(owner, id, name), damage(damage) {
     }
 
-    void use(Character *user, std::shared_ptr<Character> target) override {
+    void use(Character *user, Character *target) {
         target->setHP(target->getHP() - damage);
     }
-    int getDamage() {
+    int getDamage() const {
         return damage;
     }
 };
@@ -177,247 +282,375 @@ class Potion : public PhysicalItem {
 private:
     int heal;
 public:
-    Potion(std::shared_ptr<Character> owner, std::string name, int heal) : PhysicalItem(owner, name), heal(heal) {
+    Potion(Handle<Character> owner, NameId id, std::string_view name, int heal) : PhysicalItem(owner, id, name), heal(heal) {
     }
-    void use(Character *user, std::shared_ptr<Character> target) override {
+    void use(Character *user, Character *target) {
         target->setHP(target->getHP() + heal);
     }
-    int getHeal() {
+    int getHeal() const {
         return heal;
     }
 };
 
 // Derived class for spells
 class Spell : public PhysicalItem {
+public:
+    static constexpr int MAX_VICTIMS = 50;
+
 private:
-    std::map<std::string, std::shared_ptr<Character>> victims;
+    // Names the spell works on, sorted and without repeats. These are names rather
+    // than handles on purpose: a spell works on whoever bears the name, and keeps
+    // counting a victim that has died (Show spells prints the count).
+    NameId victims[MAX_VICTIMS];
+    int victimCount;
 public:
-    Spell(std::shared_ptr<Character> owner, std::string name, std::map<std::string, std::shared_ptr<Character>> victims) :
-            PhysicalItem(owner, name), victims(std::move(victims)) {};
+    Spell(Handle<Character> owner, NameId id, std::string_view name, const std::vector<NameId>& victims) :
+            PhysicalItem(owner, id, name), victimCount(static_cast<int>(victims.size())) {
+        std::copy(victims.begin(), victims.end(), this->victims);
+    };
 
-    void use(Character *user, std::shared_ptr<Character> target) override {
-        target.reset();
+    void use(Character *user, Character *target) {
+        // The victim is removed from the world by the caller
+    }
+    std::size_t getVictimCount() const {
+        return static_cast<std::size_t>(victimCount);
     }
-    std::map<std::string, std::shared_ptr<Character>> getVictims() {
+    bool hasVictim(NameId victim) const {
+        return std::binary_search(victims, victims + victimCount, victim);
+    }
+    const NameId* getVictims() const {
         return victims;
     }
 };
 
-// Derived class for fighters
-class Fighter : public Character {
+inline void Character::attack(Character *character, NameId itemId) {
+    guns.find(itemId)->use(this, character);
+}
+inline Potion* Character::potion(Character *character, NameId itemId) {
+    drugs.find(itemId)->use(this, character);
+    return drugs.deleteItem(itemId);
+}
+inline Spell* Character::spell(Character *character, NameId itemId) {
+    swears.find(itemId)->use(this, character);
+    return swears.deleteItem(itemId);
+}
+inline void Character::attackAll(Character* const* targets, std::size_t count, NameId itemId) {
+    Weapon* weapon = guns.find(itemId);
+    for (std::size_t i = 0; i < count; i++) {
+        weapon->use(this, targets[i]);
+    }
+}
+inline Potion* Character::potionAll(Character* const* drinkers, std::size_t count, NameId itemId) {
+    Potion* potion = drugs.find(itemId);
+    for (std::size_t i = 0; i < count; i++) {
+        potion->use(this, drinkers[i]);
+    }
+    return drugs.deleteItem(itemId);
+}
+inline Spell* Character::spellAll(NameId itemId) {
+    return swears.deleteItem(itemId);
+}
+
+// Character of one class: the class only decides the name and the capacities,
+// which come from its traits (see character_traits.h)
+template<typename Traits>
+class CharacterKind : public Character {
 public:
-    Fighter(std::string name, int hp) : Character(std::move(name), hp, "fighter",
-                                                  MAX_ALLOWED_GUNS, MAX_ALLOWED_POTIONS, MAX_ALLOWED_SPELLS) {};
+    CharacterKind(NameId id, std::string_view name, int hp) : Character(id, name, hp, Traits::NAME,
+                                                                        Traits::MAX_ALLOWED_GUNS,
+                                                                        Traits::MAX_ALLOWED_POTIONS,
+                                                                        Traits::MAX_ALLOWED_SPELLS) {};
+};
 
-    const static int MAX_ALLOWED_GUNS = 3;
-    const static int MAX_ALLOWED_POTIONS = 5;
-    const static int MAX_ALLOWED_SPELLS = 0;
+using Fighter = CharacterKind<FighterTraits>;
+using Archer = CharacterKind<ArcherTraits>;
+using Wizard = CharacterKind<WizardTraits>;
 
-    void assignItem(std::shared_ptr<PhysicalItem> item, std::string type) override {
-        if (type == "weapon") {
-            std::shared_ptr<Weapon> weaponItem = std::dynamic_pointer_cast<Weapon>(item);
-            guns.addItem(weaponItem);
-        }
-        if (type == "potion") {
-            std::shared_ptr<Potion> potionItem = std::dynamic_pointer_cast<Potion>(item);
-            drugs.addItem(potionItem);
-        }
-        if (type == "spell") {
-            std::shared_ptr<Spell> spellItem = std::dynamic_pointer_cast<Spell>(item);
-            swears.addItem(spellItem);
+
+// All living characters of the story, indexed by interned name.
+// The world owns every character and item through its pools, so a whole
+// scenario is torn down at once by clear() and the memory is reused.
+// Commands on disjoint characters may run concurrently (see parallel.h):
+// apart from their own characters, they only touch the world by freeing
+// items and dead characters and by updating the hit point index, which is
+// done under a lock.
+class World {
+private:
+    // Orders name ids by the text of the names
+    struct ByName {
+        const SymbolTable* names;
+        bool operator()(NameId a, NameId b) const {
+            return names->name(a) < names->name(b);
         }
-    }
+    };
 
-    void assignItem(std::shared_ptr<PhysicalItem> item, std::map<std::string, std::shared_ptr<Character>> victims) override {
-        {}; // CANT be assigned.
-    }
+public:
+    SymbolTable names;  // Interned character and item names
+    BulkScratch<Character*> scratch;    // Buffers of the area-of-effect commands
+    JournalWriter* journal = nullptr;   // Where the changes are recorded, if anywhere (not in parallel mode)
+
+private:
+    ObjectPool<Character> characterPool;    // Storage of the characters
+    ObjectPool<Weapon> weaponPool;          // Storage of the items
+    ObjectPool<Potion> potionPool;
+    ObjectPool<Spell> spellPool;
 
-    void attack (std::shared_ptr<Character> character, std::string itemName) override {
-        guns.find(itemName)->use(this, character);
+    std::vector<Handle<Character>> characters;  // Living characters by name id
+    std::set<NameId, ByName> roster;        // Living characters in name order, for Show
+    std::mutex structureLock;               // Serializes frees from commands running in parallel
 
+    std::string rosterText;                 // Rendered Show characters line
+    std::atomic<bool> rosterDirty{true};    // Whether a character came, went or changed HP since it was rendered
+    HitPointIndex hpIndex{names};           // Living characters by HP, once asked for
+
+    void dispose(Weapon* item) {
+        weaponPool.destroy(item);
     }
-    void potion (std::shared_ptr<Character> character, std::string itemName) override{
-        drugs.find(itemName)->use(this, character);
-        drugs.deleteItem(itemName);
+    void dispose(Potion* item) {
+        potionPool.destroy(item);
     }
-    void spell (std::shared_ptr<Character> character, std::string itemName) override {
-        swears.find(itemName)->use(this, character);
-        swears.deleteItem(itemName);
+    void dispose(Spell* item) {
+        spellPool.destroy(item);
     }
 
-    Container<Weapon> getWeapons() override {
-        return guns;
+    // Inventory section and journalled value of an item
+    static int kindOf(const Weapon*) {
+        return 0;
     }
-    Container<Potion> getPotions() override {
-        return drugs;
+    static int kindOf(const Potion*) {
+        return 1;
     }
-    Container<Spell> getSpells() override {
-        return swears;
+    static int kindOf(const Spell*) {
+        return 2;
+    }
+    static int valueOf(const Weapon* item) {
+        return item->getDamage();
+    }
+    static int valueOf(const Potion* item) {
+        return item->getHeal();
+    }
+    static int valueOf(const Spell* item) {
+        return static_cast<int>(item->getVictimCount());
     }
 
-
-};
-
-// Derived class for archers
-class Archer : public Character {
 public:
-    Archer(std::string name, int hp) : Character(std::move(name), hp, "archer",
-                                                 MAX_ALLOWED_GUNS, MAX_ALLOWED_POTIONS, MAX_ALLOWED_SPELLS) {};
+    World() : roster(ByName{&names}) {}
+    World(const World&) = delete;
+    World& operator=(const World&) = delete;
+
+    // Living character with this name, nullptr if there is none
+    Character* find(NameId id) const {
+        return id < characters.size() ? characterPool.get(characters[id]) : nullptr;
+    }
 
-    const static int MAX_ALLOWED_GUNS = 2;
-    const static int MAX_ALLOWED_POTIONS = 3;
-    const static int MAX_ALLOWED_SPELLS = 2;
+    // Character behind a handle, nullptr once it has died
+    Character* resolve(Handle<Character> handle) const {
+        return characterPool.get(handle);
+    }
 
-    void assignItem(std::shared_ptr<PhysicalItem> item, std::string type) override {
-        if (type == "weapon") {
-            std::shared_ptr<Weapon> weaponItem = std::dynamic_pointer_cast<Weapon>(item);
-            guns.addItem(weaponItem);
+    // Create a character of the class given by Traits, false if the name is already taken
+    template<typename Traits>
+    bool add(NameId id, int hp) {
+        if (id >= characters.size()) {
+            characters.resize(names.size());
         }
-        if (type == "potion") {
-            std::shared_ptr<Potion> potionItem = std::dynamic_pointer_cast<Potion>(item);
-            drugs.addItem(potionItem);
+        if (find(id) != nullptr) {
+            return false;
         }
-        if (type == "spell") {
-            std::shared_ptr<Spell> spellItem = std::dynamic_pointer_cast<Spell>(item);
-            swears.addItem(spellItem);
+        characters[id] = characterPool.handleOf(characterPool.create<CharacterKind<Traits>>(id, names.name(id), hp));
+        roster.insert(id);
+        rosterDirty = true;
+        if (hpIndex.isBuilt()) {
+            hpIndex.add(id, CharacterClasses::indexOf(Traits::NAME), hp);
         }
+        if (journal != nullptr) {
+            journal->arrive(id, CharacterClasses::indexOf(Traits::NAME), hp);
+        }
+        return true;
     }
-    void assignItem(std::shared_ptr<PhysicalItem> item, std::map<std::string, std::shared_ptr<Character>> victims) override {
-        std::shared_ptr<Spell> spell = std::dynamic_pointer_cast<Spell>(item);
-        swears.addItem(spell);
-    }
-    void attack (std::shared_ptr<Character> character, std::string itemName) override {
-        guns.find(itemName)->use(this, character);
-    }
-    void potion (std::shared_ptr<Character> character, std::string itemName) override{
-        drugs.find(itemName)->use(this, std::move(character));
-        drugs.deleteItem(itemName);
+
+    // Create an item and give it to its owner, false if the owner has no room for it
+    template<typename Item, typename... Args>
+    bool giveItem(Character* owner, Args&&... args) {
+        Item* item = poolOf<Item>().create(characterPool.handleOf(owner), std::forward<Args>(args)...);
+        Item* replaced;
+        if (!owner->assignItem(item, replaced)) {
+            dispose(item);
+            return false;
+        }
+        if (replaced != nullptr) {
+            dispose(replaced);
+        }
+        if (journal != nullptr) {
+            journal->addItem(owner->getId(), kindOf(item), item->getId(), valueOf(item));
+        }
+        return true;
     }
-    void spell (std::shared_ptr<Character> character, std::string itemName) override {
-        swears.find(itemName)->use(this, std::move(character));
-        swears.deleteItem(itemName);
+
+    // Free an item that was used up
+    template<typename Item>
+    void useUp(Item* item) {
+        if (item != nullptr) {
+            std::lock_guard<std::mutex> guard(structureLock);
+            const Character* owner = journal == nullptr ? nullptr : resolve(item->getOwner());
+            if (owner != nullptr) {
+                journal->removeItem(owner->getId(), kindOf(item), item->getId());
+            }
+            dispose(item);
+        }
     }
-    Container<Weapon> getWeapons() override {
-        return guns;
+
+    // Remove a dead character, freeing everything it carried
+    void remove(NameId id) {
+        std::lock_guard<std::mutex> guard(structureLock);
+        discard(id);
     }
-    Container<Potion> getPotions() override {
-        return drugs;
+
+    // Remove several dead characters at once
+    void removeAll(Character* const* dead, std::size_t count) {
+        std::lock_guard<std::mutex> guard(structureLock);
+        for (std::size_t i = 0; i < count; i++) {
+            discard(dead[i]->getId());
+        }
     }
-    Container<Spell> getSpells() override {
-        return swears;
+
+private:
+    void discard(NameId id) {
+        Character* character = find(id);
+        for (Weapon* item : character->getWeapons()) {
+            dispose(item);
+        }
+        for (Potion* item : character->getPotions()) {
+            dispose(item);
+        }
+        for (Spell* item : character->getSpells()) {
+            dispose(item);
+        }
+        roster.erase(id);
+        rosterDirty = true;
+        if (hpIndex.isBuilt()) {
+            hpIndex.remove(id);
+        }
+        if (journal != nullptr) {
+            journal->depart(id);
+        }
+        characterPool.destroy(character);   // Handles to it, e.g. owners of stray items, stop resolving
+        characters[id] = Handle<Character>();
     }
-};
 
-// Derived class for wizards
-class Wizard : public Character {
 public:
-    Wizard(std::string name, int hp) : Character(std::move(name), hp, "wizard",
-                                                 MAX_ALLOWED_GUNS, MAX_ALLOWED_POTIONS, MAX_ALLOWED_SPELLS) {};
-
-    const static int MAX_ALLOWED_GUNS = 0;
-    const static int MAX_ALLOWED_POTIONS = 10;
-    const static int MAX_ALLOWED_SPELLS = 10;
 
-    void assignItem(std::shared_ptr<PhysicalItem> item, std::string type) override {
-        if (type == "weapon") {
-            std::shared_ptr<Weapon> weaponItem = std::dynamic_pointer_cast<Weapon>(item);
-            guns.addItem(weaponItem);
+    // Forget the whole scenario in one go, keeping the memory for the next one
+    void clear() {
+        roster.clear();
+        rosterText.clear();
+        rosterDirty = true;
+        hpIndex.clear();
+        characters.clear();
+        characterPool.clear();
+        weaponPool.clear();
+        potionPool.clear();
+        spellPool.clear();
+        names.clear();
+    }
+
+    // Ids of the living characters in name order
+    const std::set<NameId, ByName>& getRoster() const {
+        return roster;
+    }
+
+    // Note that the HP of a character changed
+    void touchHP(const Character* character) {
+        rosterDirty.store(true, std::memory_order_relaxed);
+        if (hpIndex.isBuilt()) {
+            std::lock_guard<std::mutex> guard(structureLock);
+            hpIndex.update(character->getId(), character->getHP());
         }
-        if (type == "potion") {
-            std::shared_ptr<Potion> potionItem = std::dynamic_pointer_cast<Potion>(item);
-            drugs.addItem(potionItem);
+        if (journal != nullptr) {
+            journal->setHP(character->getId(), character->getHP());
         }
-        if (type == "spell") {
-            std::shared_ptr<Spell> spellItem = std::dynamic_pointer_cast<Spell>(item);
-            swears.addItem(spellItem);
-        }
-    }
-    void assignItem(std::shared_ptr<PhysicalItem> item, std::map<std::string, std::shared_ptr<Character>> victims) override {
-        std::shared_ptr<Spell> spell = std::dynamic_pointer_cast<Spell>(item);
-        swears.addItem(spell);
-    }
-    void attack (std::shared_ptr<Character> character, std::string itemName) override {
-        guns.find(itemName)->use(this, character);
-    }
-    void potion (std::shared_ptr<Character> character, std::string itemName) override{
-        drugs.find(itemName)->use(this, std::move(character));
-        drugs.deleteItem(itemName);
-    }
-    void spell (std::shared_ptr<Character> character, std::string itemName) override {
-        swears.find(itemName)->use(this, std::move(character));
-        swears.deleteItem(itemName);
     }
-    Container<Weapon> getWeapons() override {
-        return guns;
-    }
-    Container<Potion> getPotions() override {
-        return drugs;
-    }
-    Container<Spell> getSpells() override {
-        return swears;
-    }
-};
-
 
-// Function to split a string based delimiter is whitespace
-std::vector<std::string> split(const std::string& input) {
-    std::vector<std::string> tokens;
-    std::stringstream ss(input);
-    std::string token;
+    // The Show characters line, "name:type:hp " per character and a newline.
+    // It is rendered again only after something in it changed.
+    std::string_view getRosterLine() {
+        if (rosterDirty) {
+            rosterText.clear();
+            char digits[16];
+            for (NameId id : roster) {
+                const Character* character = find(id);
+                rosterText.append(character->getName()).append(1, ':').append(character->getType()).append(1, ':');
+                auto result = std::to_chars(digits, digits + sizeof(digits), character->getHP());
+                rosterText.append(digits, result.ptr).append(1, ' ');
+            }
+            rosterText.append(1, '\n');
+            rosterDirty = false;
+        }
+        return rosterText;
+    }
 
-    while (std::getline(ss, token, ' ')) {
-        tokens.push_back(token);
+    // The hit point index, built on first use (a Show that builds it is a barrier)
+    const HitPointIndex& getHitPointIndex() {
+        if (!hpIndex.isBuilt()) {
+            hpIndex.build([this](auto&& add) {
+                for (NameId id : roster) {
+                    const Character* character = find(id);
+                    add(id, CharacterClasses::indexOf(character->getType()), character->getHP());
+                }
+            });
+        }
+        return hpIndex;
     }
 
-    return tokens;
-}
+    template<typename Item>
+    ObjectPool<Item>& poolOf() {
+        if constexpr (std::is_same_v<Item, Weapon>) {
+            return weaponPool;
+        }
+        else if constexpr (std::is_same_v<Item, Potion>) {
+            return potionPool;
+        }
+        else {
+            return spellPool;
+        }
+    }
+};
 
 // Function to create a new character
-void createCharacter(std::vector<std::string> &keywords, std::map<std::string, std::shared_ptr<Character>> &characters) {
+void createCharacter(const Command &command, World &world, OutputSink &outputFile) {
     // Create character $[string]type $[string]name $[int]initHP - example of keywords
-    std::string characterType = keywords[2];
-    std::string characterName = keywords[3];
-    int characterHp = std::stoi(keywords[4]);
+    std::string_view characterType = command.kind;
+    std::string_view characterName = world.names.name(command.actorId);
+    int characterHp = numberOf(command);
 
     // HP check
     if (!(1 <= characterHp && characterHp <= 200)) {
         outputFile << "Error caught\n";
         return;
     }
-    if (characterType == "fighter") {
-        std::shared_ptr<Character> character = std::make_shared<Fighter>(characterName, characterHp);
-        characters.insert(std::make_pair(characterName, character));
-
-    }
-    else if (characterType == "archer") {
-        std::shared_ptr<Character> character = std::make_shared<Archer>(characterName, characterHp);
-        characters.insert(std::make_pair(characterName, character));
-    }
-    else if (characterType == "wizard") {
-        std::shared_ptr<Character> character = std::make_shared<Wizard>(characterName, characterHp);
-        characters.insert(std::make_pair(characterName, character));
-    }
-    outputFile << "A new " << characterType << " came to town, " << characterName << ".\n";
+    CharacterClasses::withName(characterType, [&](auto traits) {
+        world.add<decltype(traits)>(command.actorId, characterHp);
+    });
+    INSTRUMENT_STAGE(Phase::Format);
+    narrateArrival(outputFile, characterType, characterName);
 }
 
 // Function to create a new item (weapon, potion, spell)
-void createItem(std::vector<std::string> &keywords, std::map<std::string, std::shared_ptr<Character>> &characters) {
-    std::string itemType = keywords[2];
-    std::string itemOwnerName = keywords[3];
-    std::string itemName = keywords[4];
-    std::shared_ptr<Character> owner;
+void createItem(const Command &command, World &world, OutputSink &outputFile) {
+    std::string_view itemType = command.kind;
+    std::string_view itemOwnerName = command.actor;
+    std::string_view itemName = world.names.name(command.objectId);
 
     // Check owner of the item:
-    auto it = characters.find(itemOwnerName);
-    if (it != characters.end()) {
-        owner = it->second;
-    }
-    else {
+    INSTRUMENT_STAGE(Phase::Lookup);
+    Character* owner = world.find(command.actorId);
+    if (owner == nullptr) {
         outputFile << "Error caught\n";
         return;
     }
+    INSTRUMENT_STAGE(Phase::Mutate);
 
-    switch (itemType[0]) {
+    switch (itemType.empty() ? '\0' : itemType[0]) {
         // Weapon creation
         case 'w': {
             // Check availability:
@@ -425,14 +658,15 @@ void createItem(std::vector<std::string> &keywords, std::map<std::string, std::s
                 outputFile << "Error caught\n";
                 return;
             }
-            int damageValue = std::stoi(keywords[5]);
+            int damageValue = numberOf(command);
             // Check damage:
             if (!(1 <= damageValue && damageValue <= 50)) {
                 outputFile << "Error caught\n";
                 return;
             }
-            std::shared_ptr<PhysicalItem> physicalItem = std::make_shared<Weapon>(owner, itemName, damageValue);
-            owner->assignItem(physicalItem, "weapon");
+            if (!world.giveItem<Weapon>(owner, command.objectId, itemName, damageValue)) {
+                outputFile << "Error caught\n";
+            }
             break;
         }
         // Potion creation
@@ -442,14 +676,15 @@ void createItem(std::vector<std::string> &keywords, std::map<std::string, std::s
                 outputFile << "Error caught\n";
                 return;
             }
-            int healValue = std::stoi(keywords[5]);
+            int healValue = numberOf(command);
             // Check heal:
             if (!(1 <= healValue && healValue <= 50)) {
                 outputFile << "Error caught\n";
                 return;
             }
-            std::shared_ptr<PhysicalItem> physicalItem = std::make_shared<Potion>(owner, itemName, healValue);
-            owner->assignItem(physicalItem, "potion");
+            if (!world.giveItem<Potion>(owner, command.objectId, itemName, healValue)) {
+                outputFile << "Error caught\n";
+            }
             break;
         }
         // Spell creation
@@ -459,73 +694,62 @@ void createItem(std::vector<std::string> &keywords, std::map<std::string, std::s
                 outputFile << "Error caught\n";
                 return;
             }
-            std::map<std::string, std::shared_ptr<Character>> victims;
-            int len = std::stoi(keywords[5]);
+            std::vector<NameId> victims;
+            int len = numberOf(command);
             // Check len:
             if (!(0 <= len && len <= 50)) {
                 outputFile << "Error caught\n";
                 return;
             }
             for (int i = 0; i < len; i++) {
-                auto chel = characters.find(keywords[i+6]);
-                if (chel == characters.end()) {
+                NameId chel = world.names.find(command.rest[i]);
+                if (world.find(chel) == nullptr) {
                     outputFile << "Error caught\n";
                     return;
                 }
-                victims[chel->first] = chel->second;
+                victims.push_back(chel);
+            }
+            // A victim named twice counts once
+            std::sort(victims.begin(), victims.end());
+            victims.erase(std::unique(victims.begin(), victims.end()), victims.end());
+            if (!world.giveItem<Spell>(owner, command.objectId, itemName, victims)) {
+                outputFile << "Error caught\n";
             }
-            std::shared_ptr<PhysicalItem> physicalItem = std::make_shared<Spell>(owner, itemName, victims);
-            owner->assignItem(physicalItem, victims);
             break;
         }
         default:
             outputFile << "oshibka\n";
             break;
     }
-    outputFile << itemOwnerName << " just obtained a new " << itemType << " called " << itemName << ".\n";
+    INSTRUMENT_STAGE(Phase::Format);
+    narrateNewItem(outputFile, itemOwnerName, itemType, itemName);
 };
 
-
-template <typename K, typename V>
-void sortMapByKey(const std::map<K, V>& map) {
-    // Create a custom comparator function to compare keys
-    auto cmp = [](const K& a, const K& b) {
-        return a < b;
-    };
-
-    // Create a set to store the sorted keys
-    std::set<K, decltype(cmp)> sortedKeys(cmp);
-
-    // Populate the set with keys from the map
-    for (const auto& pair : map) {
-        sortedKeys.insert(pair.first);
-    }
-}
-
 // Function to display information about characters, items, or spells
-void showSomething(std::vector<std::string> &keywords, std::map<std::string, std::shared_ptr<Character>> &characters) {
-    std::string type = keywords[1];
-    switch (type[0]) {
+void showSomething(const Command &command, World &world, OutputSink &outputFile) {
+    std::string_view type = command.kind;
+    INSTRUMENT_STAGE(Phase::Lookup);
+    if (isRankingShow(type)) {
+        INSTRUMENT_STAGE(Phase::Format);
+        world.getHitPointIndex().show(command, outputFile);
+        return;
+    }
+    switch (type.empty() ? '\0' : type[0]) {
         case 'c': {
-            sortMapByKey(characters);
-            for (const auto& pair : characters) {
-                outputFile << pair.first << ":" << pair.second->getType() << ":" << pair.second->getHP() << " ";
-            }
-            outputFile << "\n";
+            INSTRUMENT_STAGE(Phase::Format);
+            outputFile << world.getRosterLine();
             break;
         }
         case 'w': {
-            std::string name = keywords[2];
-            auto it = characters.find(name);
-            if (it != characters.end()) {
-                auto wp = it->second->getWeapons().getContainer();
-                if (it->second->getWeapons().getMaxSize() == 0) {
+            const Character* character = world.find(command.actorId);
+            if (character != nullptr) {
+                if (character->getWeapons().getMaxSize() == 0) {
                     outputFile << "Error caught\n";
                     return;
                 }
-                sortMapByKey(wp);
-                for (auto const& pair : wp) {
-                    outputFile << pair.first << ":" << pair.second->getDamage() << " ";
+                INSTRUMENT_STAGE(Phase::Format);
+                for (const Weapon* item : character->getWeapons()) {
+                    narrateListed(outputFile, item->getName(), item->getDamage());
                 }
                 outputFile << "\n";
             }
@@ -536,17 +760,15 @@ void showSomething(std::vector<std::string> &keywords, std::map<std::string, std
             break;
         }
         case 'p': {
-            std::string name = keywords[2];
-            auto it = characters.find(name);
-            if (it != characters.end()) {
-                auto wp = it->second->getPotions().getContainer();
-                sortMapByKey(wp);
-                if (it->second->getPotions().getMaxSize() == 0) {
+            const Character* character = world.find(command.actorId);
+            if (character != nullptr) {
+                if (character->getPotions().getMaxSize() == 0) {
                     outputFile << "Error caught\n";
                     return;
                 }
-                for (auto const& pair : wp) {
-                    outputFile << pair.first << ":" << pair.second->getHeal() << " ";
+                INSTRUMENT_STAGE(Phase::Format);
+                for (const Potion* item : character->getPotions()) {
+                    narrateListed(outputFile, item->getName(), item->getHeal());
                 }
                 outputFile << "\n";
             }
@@ -557,17 +779,15 @@ void showSomething(std::vector<std::string> &keywords, std::map<std::string, std
             break;
         }
         case 's': {
-            std::string name = keywords[2];
-            auto it = characters.find(name);
-            if (it != characters.end()) {
-                auto wp = it->second->getSpells().getContainer();
-                sortMapByKey(wp);
-                if (it->second->getSpells().getMaxSize() == 0) {
+            const Character* character = world.find(command.actorId);
+            if (character != nullptr) {
+                if (character->getSpells().getMaxSize() == 0) {
                     outputFile << "Error caught\n";
                     return;
                 }
-                for (auto const& pair : wp) {
-                    outputFile << pair.first << ":" << pair.second->getVictims().size() << " ";
+                INSTRUMENT_STAGE(Phase::Format);
+                for (const Spell* item : character->getSpells()) {
+                    narrateListed(outputFile, item->getName(), item->getVictimCount());
                 }
                 outputFile << "\n";
             }
@@ -583,63 +803,72 @@ void showSomething(std::vector<std::string> &keywords, std::map<std::string, std
 }
 
 // Function to execute actions (attack, cast spell, drink potion)
-void doAction(std::vector<std::string> &keywords, std::map<std::string, std::shared_ptr<Character>> &characters) {
-    std::string action = keywords[0];
-    std::string user = keywords[1];
-    std::string target = keywords[2];
-    std::string objectName = keywords[3];
+void doAction(const Command &command, World &world, OutputSink &outputFile) {
+    std::string_view user = command.actor;
+    std::string_view target = command.target;
+    std::string_view objectName = command.object;
 
     // Names check:
-    auto it1 = characters.find(user);
-    auto it2 = characters.find(target);
-    if (!(it1 != characters.end() && it2 != characters.end())) {
+    INSTRUMENT_STAGE(Phase::Lookup);
+    Character* it1 = world.find(command.actorId);
+    Character* it2 = world.find(command.targetId);
+    if (!(it1 != nullptr && it2 != nullptr)) {
         outputFile << "Error caught\n";
         return;
     }
 
-    switch (action[0]) {
-        case 'A': {
+    switch (command.op) {
+        case Opcode::Attack: {
             // Weapon name check:
-            if (it1->second->getWeapons().find(objectName) == nullptr) {
+            if (it1->getWeapons().find(command.objectId) == nullptr) {
                 outputFile << "Error caught\n";
                 return;
             }
-            it1->second->attack(it2->second, objectName);
-            outputFile << user << " attacks " << target << " with their " << objectName << "!\n";
+            INSTRUMENT_STAGE(Phase::Mutate);
+            it1->attack(it2, command.objectId);
+            world.touchHP(it2);
+            INSTRUMENT_STAGE(Phase::Format);
+            narrateAttack(outputFile, user, target, objectName);
             // Check for death
-            if (it2->second->getHP() <= 0) {
-                outputFile << it2->second->getName() << " has died...\n";
-                characters.erase(it2->second->getName());
+            if (it2->getHP() <= 0) {
+                narrateDeath(outputFile, it2->getName());
+                INSTRUMENT_STAGE(Phase::Mutate);
+                world.remove(command.targetId);
             }
             break;
         }
-        case 'C': {
+        case Opcode::Cast: {
             // Weapon name check:
-            auto harchok = it1->second->getSpells().find(objectName);
+            const Spell* harchok = it1->getSpells().find(command.objectId);
             if (harchok == nullptr) {
                 outputFile << "Error caught\n";
                 return;
             } else {
-                auto chel = harchok->getVictims().find(target);
-                if (chel == harchok->getVictims().end()) { // No chel
+                if (!harchok->hasVictim(command.targetId)) { // No chel
                     outputFile << "Error caught\n";
                     return;
                 }
             }
-            it1->second->spell(it2->second, objectName);
-            outputFile << user << " casts " << objectName << " on " << target <<  "!\n";
-            outputFile << target << " has died...\n";
-            characters.erase(target);
+            INSTRUMENT_STAGE(Phase::Mutate);
+            world.useUp(it1->spell(it2, command.objectId));
+            INSTRUMENT_STAGE(Phase::Format);
+            narrateCast(outputFile, user, objectName, target);
+            narrateDeath(outputFile, target);
+            INSTRUMENT_STAGE(Phase::Mutate);
+            world.remove(command.targetId);
             break;
         }
-        case 'D': {
+        case Opcode::Drink: {
             // Weapon name check:
-            if (it1->second->getPotions().find(objectName) == nullptr) {
+            if (it1->getPotions().find(command.objectId) == nullptr) {
                 outputFile << "Error caught\n";
                 return;
             }
-            it1->second->potion(it2->second, objectName);
-            outputFile << target << " drinks " << objectName << " from " << user <<  ".\n";
+            INSTRUMENT_STAGE(Phase::Mutate);
+            world.useUp(it1->potion(it2, command.objectId));
+            world.touchHP(it2);
+            INSTRUMENT_STAGE(Phase::Format);
+            narrateDrink(outputFile, target, objectName, user);
             break;
         }
         default:
@@ -647,25 +876,153 @@ void doAction(std::vector<std::string> &keywords, std::map<std::string, std::sha
     }
 }
 
-// Function to handle character dialogues
-void doChat(std::vector<std::string> &keywords, std::map<std::string, std::shared_ptr<Character>> &characters) {
-    std::string name = keywords[1];
-    int len = std::stoi(keywords[2]);
-    if (len <= 10 && len >= 1) {
-        if (name == "Narrator") {
-            outputFile << "Narrator: ";}
+// Function for a volley: the same as count Attack lines, one per target.
+// When the targets are distinct and the attacker is not one of them no hit
+// depends on another, so they all land in one pass.
+void doVolley(const Command &command, World &world, OutputSink &outputFile) {
+    std::size_t count;
+    if (!bulkCount(command, count)) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Lookup);
+    BulkScratch<Character*>& scratch = world.scratch;
+    Character* user = world.find(command.actorId);
+    scratch.named.resize(count);
+    scratch.found.clear();
+    for (std::size_t i = 0; i < count; i++) {
+        scratch.named[i] = world.find(world.names.find(command.rest[i]));
+        if (scratch.named[i] != nullptr) {
+            scratch.found.push_back(scratch.named[i]);
+        }
+    }
+    scratch.found.push_back(user);
+    bool distinct = user != nullptr && user->getWeapons().find(command.objectId) != nullptr
+            && allDistinct(scratch.found, scratch.keys);
+    scratch.found.pop_back();
+    if (!distinct) {
+        // No weapon to hit with, or hits on the same character: one Attack at a time
+        Command single = command;
+        single.op = Opcode::Attack;
+        single.rest = TokenSpan();
+        for (std::size_t i = 0; i < count; i++) {
+            single.target = command.rest[i];
+            single.targetId = world.names.find(single.target);
+            doAction(single, world, outputFile);
+        }
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    user->attackAll(scratch.found.data(), scratch.found.size(), command.objectId);
+    for (const Character* target : scratch.found) {
+        world.touchHP(target);
+    }
+    INSTRUMENT_STAGE(Phase::Format);
+    scratch.dead.clear();
+    for (std::size_t i = 0; i < count; i++) {
+        if (scratch.named[i] == nullptr) {
+            outputFile << "Error caught\n";
+            continue;
+        }
+        narrateAttack(outputFile, command.actor, command.rest[i], command.object);
+        if (scratch.named[i]->getHP() <= 0) {
+            narrateDeath(outputFile, scratch.named[i]->getName());
+            scratch.dead.push_back(scratch.named[i]);
+        }
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    world.removeAll(scratch.dead.data(), scratch.dead.size());
+}
+
+// Function to unleash a spell on every one of its victims still in town; the
+// spell is used up once. Its victims are kept sorted by name id, so they are
+// hit in the order their names first appeared in the scenario.
+void doUnleash(const Command &command, World &world, OutputSink &outputFile) {
+    INSTRUMENT_STAGE(Phase::Lookup);
+    Character* user = world.find(command.actorId);
+    const Spell* spell = user == nullptr ? nullptr : user->getSpells().find(command.objectId);
+    if (spell == nullptr) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    std::vector<Character*>& victims = world.scratch.dead;
+    victims.clear();
+    for (std::size_t i = 0; i < spell->getVictimCount(); i++) {
+        if (Character* victim = world.find(spell->getVictims()[i])) {
+            victims.push_back(victim);
+        }
+    }
+    if (victims.empty()) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    world.useUp(user->spellAll(command.objectId));
+    INSTRUMENT_STAGE(Phase::Format);
+    for (const Character* victim : victims) {
+        narrateCast(outputFile, command.actor, command.object, victim->getName());
+        narrateDeath(outputFile, victim->getName());
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    world.removeAll(victims.data(), victims.size());
+}
+
+// Function to share a potion: every drinker drinks it, and it is used up
+// once. A drinker who is not in town gets "Error caught" in their place; one
+// named twice drinks twice.
+void doShare(const Command &command, World &world, OutputSink &outputFile) {
+    std::size_t count;
+    if (!bulkCount(command, count)) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Lookup);
+    BulkScratch<Character*>& scratch = world.scratch;
+    Character* user = world.find(command.actorId);
+    if (user == nullptr || user->getPotions().find(command.objectId) == nullptr) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    scratch.named.resize(count);
+    scratch.found.clear();
+    for (std::size_t i = 0; i < count; i++) {
+        scratch.named[i] = world.find(world.names.find(command.rest[i]));
+        if (scratch.named[i] != nullptr) {
+            scratch.found.push_back(scratch.named[i]);
+        }
+    }
+    if (!scratch.found.empty()) {
+        INSTRUMENT_STAGE(Phase::Mutate);
+        world.useUp(user->potionAll(scratch.found.data(), scratch.found.size(), command.objectId));
+        for (const Character* drinker : scratch.found) {
+            world.touchHP(drinker);
+        }
+    }
+    INSTRUMENT_STAGE(Phase::Format);
+    for (std::size_t i = 0; i < count; i++) {
+        if (scratch.named[i] == nullptr) {
+            outputFile << "Error caught\n";
+        }
         else {
-            auto it = characters.find(name);
-            if (it == characters.end()) {
+            narrateDrink(outputFile, command.rest[i], command.object, command.actor);
+        }
+    }
+}
+
+// Function to handle character dialogues
+void doChat(const Command &command, World &world, OutputSink &outputFile) {
+    std::string_view name = command.actor;
+    int len = numberOf(command);
+    if (len <= 10 && len >= 1 && command.rest.size() >= static_cast<std::size_t>(len)) {
+        if (name != "Narrator") {   // The narrator needs no character
+            INSTRUMENT_STAGE(Phase::Lookup);
+            if (world.find(command.actorId) == nullptr) {
                 outputFile << "Error caught\n";
                 return;
             }
-            outputFile << name << ": ";
-        }
-        for (int i = 0; i < len; i++) {
-            outputFile << keywords[i + 3] << ' ';
         }
-        outputFile << "\n";
+        INSTRUMENT_STAGE(Phase::Format);
+        narrateSpeech(outputFile, name, command.rest, len);
     }
     else {
         outputFile << "Error caught\n";
@@ -673,64 +1030,597 @@ void doChat(std::vector<std::string> &keywords, std::map<std::string, std::share
     }
 }
 
-// Function to execute commands and simulate gameplay
-void execute(std::string &input, std::map<std::string, std::shared_ptr<Character>> &characters, std::ofstream& outputFile) {
-    // Split input into commands
+// Write the state of the world into a snapshot (see snapshot.h for the layout)
+void saveState(const World &world, SnapshotWriter &snapshot) {
+    for (NameId id : world.getRoster()) {
+        const Character* character = world.find(id);
+        snapshot.put(id);
+        snapshot.put(static_cast<std::uint32_t>(CharacterClasses::indexOf(character->getType())));
+        snapshot.putInt(character->getHP());
+
+        const WeaponContainer& weapons = character->getWeapons();
+        snapshot.putInt(weapons.getMaxSize() - weapons.getRemainingSize());
+        snapshot.put(static_cast<std::uint32_t>(weapons.end() - weapons.begin()));
+        for (const Weapon* item : weapons) {
+            snapshot.put(item->getId());
+            snapshot.putInt(item->getDamage());
+        }
+        const PotionContainer& potions = character->getPotions();
+        snapshot.putInt(potions.getMaxSize() - potions.getRemainingSize());
+        snapshot.put(static_cast<std::uint32_t>(potions.end() - potions.begin()));
+        for (const Potion* item : potions) {
+            snapshot.put(item->getId());
+            snapshot.putInt(item->getHeal());
+        }
+        const SpellContainer& spells = character->getSpells();
+        snapshot.putInt(spells.getMaxSize() - spells.getRemainingSize());
+        snapshot.put(static_cast<std::uint32_t>(spells.end() - spells.begin()));
+        for (const Spell* item : spells) {
+            snapshot.put(item->getId());
+            snapshot.put(static_cast<std::uint32_t>(item->getVictimCount()));
+            for (std::size_t i = 0; i < item->getVictimCount(); i++) {
+                snapshot.put(item->getVictims()[i]);
+            }
+        }
+    }
+}
+
+// Replace the world with the state stored in a snapshot, false if the snapshot is damaged
+bool loadState(World &world, SnapshotReader &snapshot) {
+    world.clear();
+    snapshot.loadNames(world.names);
+    auto nameOk = [&](std::uint32_t id) {
+        return id < world.names.size();
+    };
+    while (!snapshot.atEnd()) {
+        std::uint32_t id, classIndex;
+        int hp;
+        if (!snapshot.get(id) || !snapshot.get(classIndex) || !snapshot.getInt(hp)
+                || !nameOk(id) || classIndex >= static_cast<std::uint32_t>(CharacterClasses::COUNT)) {
+            return false;
+        }
+        bool added = false;
+        CharacterClasses::withName(CharacterClasses::INFO[classIndex].name, [&](auto traits) {
+            added = world.add<decltype(traits)>(id, hp);
+        });
+        if (!added) {
+            return false;
+        }
+        Character* character = world.find(id);
+
+        int used[3];
+        for (int kind = 0; kind < 3; kind++) {
+            std::uint32_t held;
+            if (!snapshot.getInt(used[kind]) || !snapshot.get(held)) {
+                return false;
+            }
+            for (std::uint32_t i = 0; i < held; i++) {
+                std::uint32_t itemId;
+                if (!snapshot.get(itemId) || !nameOk(itemId)) {
+                    return false;
+                }
+                std::string_view itemName = world.names.name(itemId);
+                bool given;
+                if (kind == 2) {
+                    std::uint32_t count;
+                    if (!snapshot.get(count) || count > Spell::MAX_VICTIMS) {
+                        return false;
+                    }
+                    std::vector<NameId> victims(count);
+                    for (NameId& victim : victims) {
+                        if (!snapshot.get(victim) || !nameOk(victim)) {
+                            return false;
+                        }
+                    }
+                    given = world.giveItem<Spell>(character, itemId, itemName, victims);
+                }
+                else {
+                    int value;
+                    if (!snapshot.getInt(value)) {
+                        return false;
+                    }
+                    given = kind == 0 ? world.giveItem<Weapon>(character, itemId, itemName, value)
+                                      : world.giveItem<Potion>(character, itemId, itemName, value);
+                }
+                if (!given) {
+                    return false;
+                }
+            }
+        }
+        character->restoreUsage(used[0], used[1], used[2]);
+    }
+    return true;
+}
+
+// Function to execute a parsed command and simulate gameplay
+void execute(const Command &command, World &world, OutputSink &outputFile) {
+    INSTRUMENT_COMMAND(commandTypeOf(command));
+    if (world.journal != nullptr) {
+        world.journal->beginCommand();
+    }
+    if (!command.complete) {
+        outputFile << "Error caught\n";
+        outputFile.endCommand();
+        return;
+    }
     // Determine command type and execute corresponding function
-    std::vector<std::string> commands = split(input);
-    std::string command = commands[0];
+    switch (command.op) {
+        // Creation block
+        case Opcode::CreateCharacter:
+            createCharacter(command, world, outputFile);
+            break;
+        case Opcode::CreateItem:
+            createItem(command, world, outputFile);
+            break;
+        // Attacking block
+        case Opcode::Attack:
+        case Opcode::Cast:
+        case Opcode::Drink:
+            doAction(command, world, outputFile);
+            break;
+        // Area-of-effect block
+        case Opcode::Volley:
+            doVolley(command, world, outputFile);
+            break;
+        case Opcode::Unleash:
+            doUnleash(command, world, outputFile);
+            break;
+        case Opcode::Share:
+            doShare(command, world, outputFile);
+            break;
+        case Opcode::Dialogue:
+            doChat(command, world, outputFile);
+            break;
+        case Opcode::Show:
+            showSomething(command, world, outputFile);
+            break;
+        case Opcode::Unknown:
+            outputFile << "wrong command\n";
+            break;
+        default:
+            break;
+    }
+    outputFile.endCommand();
+}
+
+
+// Command line settings
+struct Options {
+    std::string input = "input.txt";    // Scenario to run
+    std::string output = "output.txt";  // Where the narration goes
+    std::string sink = "file";          // file, stdout, memory or null
+    std::string engine = "objects";     // objects or soa
+    std::string mode = "serial";        // serial, pipeline (reading, simulating and writing on separate threads)
+                                        // or parallel (independent commands at the same time)
+    SinkOptions sinkOptions;            // Output buffering
+    std::string batch;                  // Directory or list of scenarios to run instead of input
+    std::string compile;                // Compile input into this image instead of running it
+    std::string replay;                 // Compiled image to run instead of input
+    std::string resume;                 // Snapshot to continue the scenario from
+    SnapshotOptions snapshot;           // Snapshots taken while running
+    BatchOptions batchOptions;          // Threads and output placement of a batch
+    std::string generate;               // Write a generated scenario here instead of running one
+    GeneratorOptions generator;         // What to generate
+    std::string bench;                  // Scenario to benchmark instead of running it
+    std::string benchScan;              // Scenario to benchmark line and token scanning on
+    std::string stats;                  // Instrumentation reports go here, empty for stderr
+    unsigned long long statsEvery = 0;  // Commands between instrumentation reports, 0 for only at exit
+    std::string serve;                  // Unix socket to serve sessions on, or - for stdin and stdout
+    std::string journal;                // Record the changes to the town here
+    unsigned long long journalEvery = 10000;    // Commands between checkpoints of the journal
+    std::string query;                  // Journal to answer queries from stdin about
+};
+
+void printUsage() {
+    std::cerr << "usage: fantasy [--input PATH] [--output PATH] [--engine objects|soa] [--mode serial|pipeline|parallel]\n"
+                 "               [--sink file|stdout|memory|null]\n"
+                 "               [--buffer BYTES] [--writev BLOCKS] [--flush full|command|close]\n"
+                 "               [--batch DIR|LIST] [--jobs N] [--output-dir DIR]\n"
+                 "               [--compile IMAGE] [--replay IMAGE]\n"
+                 "               [--snapshot PATH] [--snapshot-every N] [--resume PATH]\n"
+                 "               [--generate PATH] [--seed N] [--commands N] [--town N] [--fill SHARE]\n"
+                 "               [--errors SHARE] [--mix KIND=WEIGHT,...] [--bench PATH] [--bench-scan PATH]\n"
+                 "               [--serve SOCKET|-] [--journal PATH] [--journal-every N] [--query JOURNAL]\n"
+                 "               [--stats PATH] [--stats-every N] (built with -DFANTASY_INSTRUMENT)\n";
+}
 
-    // Creation block
-    if (command == "Create") {
-        if (commands[1] == "character") {
-            createCharacter(commands, characters);
+// Parse the command line, false on a bad option
+bool parseOptions(int argc, char* argv[], Options &options) try {
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;   // Every option takes a value
+        }
+        std::string_view value = argv[++i];
+        if (arg == "--input") {
+            options.input = std::string(value);
+        }
+        else if (arg == "--output") {
+            options.output = std::string(value);
         }
-        else if (commands[1] == "item") {
-            createItem(commands, characters);
+        else if (arg == "--engine" && (value == "objects" || value == "soa")) {
+            options.engine = std::string(value);
+        }
+        else if (arg == "--mode" && (value == "serial" || value == "pipeline" || value == "parallel")) {
+            options.mode = std::string(value);
+        }
+        else if (arg == "--sink" && (value == "file" || value == "stdout" || value == "memory" || value == "null")) {
+            options.sink = std::string(value);
+        }
+        else if (arg == "--buffer") {
+            options.sinkOptions.blockSize = std::stoul(std::string(value));
+        }
+        else if (arg == "--writev") {
+            options.sinkOptions.writevBlocks = std::stoi(std::string(value));
+        }
+        else if (arg == "--batch") {
+            options.batch = std::string(value);
+        }
+        else if (arg == "--compile") {
+            options.compile = std::string(value);
+        }
+        else if (arg == "--replay") {
+            options.replay = std::string(value);
+        }
+        else if (arg == "--snapshot") {
+            options.snapshot.path = std::string(value);
+        }
+        else if (arg == "--snapshot-every") {
+            options.snapshot.every = std::stoull(std::string(value));
+        }
+        else if (arg == "--resume") {
+            options.resume = std::string(value);
+        }
+        else if (arg == "--jobs") {
+            options.batchOptions.jobs = std::stoul(std::string(value));
+        }
+        else if (arg == "--output-dir") {
+            options.batchOptions.outputDir = std::string(value);
+        }
+        else if (arg == "--generate") {
+            options.generate = std::string(value);
+        }
+        else if (arg == "--seed") {
+            options.generator.seed = std::stoull(std::string(value));
+        }
+        else if (arg == "--commands") {
+            options.generator.commands = std::stoull(std::string(value));
+        }
+        else if (arg == "--town") {
+            options.generator.town = std::stoul(std::string(value));
+        }
+        else if (arg == "--fill") {
+            options.generator.fill = std::stod(std::string(value));
+        }
+        else if (arg == "--errors") {
+            options.generator.errors = std::stod(std::string(value));
+        }
+        else if (arg == "--mix") {
+            // Comma-separated kind=weight pairs; kinds not named keep their weight
+            while (!value.empty()) {
+                std::string_view pair = value.substr(0, value.find(','));
+                value.remove_prefix(std::min(value.size(), pair.size() + 1));
+                std::size_t equals = pair.find('=');
+                if (equals == std::string_view::npos
+                        || !options.generator.setWeight(pair.substr(0, equals), std::stod(std::string(pair.substr(equals + 1))))) {
+                    return false;
+                }
+            }
+        }
+        else if (arg == "--bench") {
+            options.bench = std::string(value);
+        }
+        else if (arg == "--bench-scan") {
+            options.benchScan = std::string(value);
+        }
+        else if (arg == "--serve") {
+            options.serve = std::string(value);
+        }
+        else if (arg == "--journal") {
+            options.journal = std::string(value);
+        }
+        else if (arg == "--journal-every") {
+            options.journalEvery = std::stoull(std::string(value));
+        }
+        else if (arg == "--query") {
+            options.query = std::string(value);
+        }
+        else if (arg == "--stats" && INSTRUMENTED) {
+            options.stats = std::string(value);
+        }
+        else if (arg == "--stats-every" && INSTRUMENTED) {
+            options.statsEvery = std::stoull(std::string(value));
+        }
+        else if (arg == "--flush" && value == "full") {
+            options.sinkOptions.flush = FlushPolicy::Full;
+        }
+        else if (arg == "--flush" && value == "command") {
+            options.sinkOptions.flush = FlushPolicy::Command;
+        }
+        else if (arg == "--flush" && value == "close") {
+            options.sinkOptions.flush = FlushPolicy::Close;
+        }
+        else {
+            return false;
         }
     }
-    // Attacking block
-    else if (command == "Attack") {
-        doAction(commands, characters);
+    if (options.mode == "parallel" && options.engine == "soa") {
+        return false;   // Only World takes concurrent commands
     }
-    else if (command == "Cast") {
-        doAction(commands, characters);
+    if ((!options.snapshot.path.empty() || !options.resume.empty()) && options.mode != "serial") {
+        return false;   // Snapshots are taken between commands of the serial loop
     }
-    else if (command == "Drink") {
-        doAction(commands, characters);
+    if (!options.journal.empty() && (options.mode == "parallel" || !options.resume.empty())) {
+        return false;   // The journal needs the commands in order, from the first one
     }
-    else if (command == "Dialogue") {
-        doChat(commands, characters);
+    if (!options.resume.empty() && codecOfPath(options.output) != Codec::None) {
+        return false;   // A compressed narration cannot be cut back to where the snapshot was taken
     }
-    else if (command == "Show") {
-        showSomething(commands, characters);
+    return true;
+}
+catch (const std::exception&) {    // Malformed number
+    return false;
+}
+
+// Record the changes to the world in journal, if there is one
+template<typename W>
+void attachJournal(W &world, JournalWriter *journal) {
+    world.journal = journal;
+    if (journal != nullptr) {
+        journal->useNames(world.names);
     }
-    else {
-        outputFile << "wrong command\n";
+}
+
+// Close the journal of the world, while its name table is still there
+template<typename W>
+void finishJournal(W &world) {
+    if (world.journal != nullptr) {
+        world.journal->finish();
     }
 }
 
+// Run a scenario serially or pipelined, as chosen on the command line.
+// With a snapshot to resume from, the world is loaded from it and the input
+// continues where it was taken. False if that snapshot does not fit.
+template<typename W>
+bool runWithMode(const Options &options, InputReader &inputFile, W &world, OutputTarget &target,
+                 SnapshotReader *resume) {
+    if (options.mode == "pipeline") {
+        runPipelined(inputFile, world, target, options.sinkOptions);
+        return true;
+    }
+    OutputSink outputFile(target, options.sinkOptions);
+    if (options.mode == "parallel") {
+        runParallel(inputFile, world, outputFile, options.batchOptions.jobs);
+    }
+    else if (resume != nullptr || !options.snapshot.path.empty()) {
+        SnapshotPosition start;
+        if (resume != nullptr) {
+            start = resume->getPosition();
+            if (!loadState(world, *resume) || !inputFile.skipTo(start.inputOffset)) {
+                return false;
+            }
+        }
+        else {
+            std::string_view header;
+            inputFile.nextLine(header);   // The first line is the number of commands
+        }
+        runWithSnapshots(inputFile, world, outputFile, options.snapshot, start);
+    }
+    else {
+        runScenario(inputFile, world, outputFile);
+    }
+    outputFile.flush();
+    return true;
+}
 
-int main () {
+int main (int argc, char* argv[]) {
     // Initialize variables
     // Open input file
     // Read each line from the file and execute corresponding commands
 
     using namespace std;
 
-    map<string, shared_ptr<Character>> characters;
-    std::ifstream inputFile("input.txt");
-    std::string line;
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
 
-    if (inputFile.is_open()) { // Check if the file is open successfully
-        std::getline(inputFile, line);
-        while (std::getline(inputFile, line)) { // Read each line from the file
-            execute(line, characters, outputFile);
+    startInstrumentReports(options.stats, options.statsEvery);
+
+    if (!options.batch.empty()) {
+        std::vector<std::string> inputs;
+        if (!collectBatchInputs(options.batch, inputs)) {
+            std::cerr << "batch: cannot read " << options.batch << "\n";
+            return 1;
+        }
+        options.batchOptions.sink = options.sink;
+        options.batchOptions.sinkOptions = options.sinkOptions;
+        BatchReport report = options.engine == "soa"
+                ? runBatch<SoaWorld>(inputs, options.batchOptions, std::cerr)
+                : runBatch<World>(inputs, options.batchOptions, std::cerr);
+        printBatchReport(report, std::cerr);
+        return report.failed == 0 ? 0 : 1;
+    }
+
+    if (!options.generate.empty()) {
+        std::unique_ptr<OutputTarget> target = openOutputFile(options.generate);   // .gz and .zst compressed
+        if (target == nullptr) {
+            std::cerr << "generate: cannot write " << options.generate << "\n";
+            return 1;
+        }
+        OutputSink scenario(*target);
+        ScenarioGenerator(options.generator).generate(scenario);
+        scenario.flush();
+        if (!target->close()) {
+            std::cerr << "generate: cannot write " << options.generate << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!options.bench.empty()) {
+        bool ok = options.engine == "soa"
+                ? runBenchmark<SoaWorld>(options.bench, std::cout)
+                : runBenchmark<World>(options.bench, std::cout);
+        return ok ? 0 : 1;
+    }
+
+    if (!options.benchScan.empty()) {
+        return runScanBenchmark(options.benchScan, std::cout) ? 0 : 1;
+    }
+
+    if (!options.serve.empty()) {
+        stopServerOnSignals();
+        if (options.serve == "-") {
+            if (options.engine == "soa") {
+                serveStream<SoaWorld>(STDIN_FILENO, STDOUT_FILENO);
+            }
+            else {
+                serveStream<World>(STDIN_FILENO, STDOUT_FILENO);
+            }
+            return 0;
         }
+        bool served = options.engine == "soa"
+                ? serveSocket<SoaWorld>(options.serve, std::cerr)
+                : serveSocket<World>(options.serve, std::cerr);
+        return served ? 0 : 1;
     }
 
-    outputFile.close();
+    if (!options.query.empty()) {
+        JournalReader journal(options.query);
+        if (!journal.is_open()) {
+            std::cerr << "query: " << options.query << " is not a finished journal\n";
+            return 1;
+        }
+        FdTarget target(STDOUT_FILENO);
+        OutputSink answers(target, SinkOptions{1 << 16, 1, FlushPolicy::Command});
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            journal.answer(line, answers);
+            answers.endCommand();
+        }
+        return 0;
+    }
+
+    if (!options.compile.empty()) {
+        InputReader inputFile(options.input);
+        if (!inputFile.is_open() || !compileScenario(inputFile, options.compile) || inputFile.isDamaged()) {
+            std::cerr << "compile: cannot compile " << options.input << " into " << options.compile << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // A resumed run continues the narration of the run the snapshot was taken in
+    std::unique_ptr<SnapshotReader> resume;
+    if (!options.resume.empty()) {
+        resume = std::make_unique<SnapshotReader>(options.resume);
+        if (!resume->is_open()) {
+            std::cerr << "resume: " << options.resume << " is not a snapshot\n";
+            return 1;
+        }
+    }
+    std::unique_ptr<JournalWriter> journal;
+    if (!options.journal.empty()) {
+        journal = std::make_unique<JournalWriter>(options.journal, options.journalEvery);
+        if (!journal->is_open()) {
+            std::cerr << "journal: cannot write " << options.journal << "\n";
+            return 1;
+        }
+    }
+    if (!options.snapshot.path.empty()) {
+        std::signal(SIGUSR1, [](int) { snapshotRequested = 1; });  // Snapshot on demand
+    }
+
+    // Output target chosen on the command line
+    std::unique_ptr<OutputTarget> target;
+    if (options.sink == "stdout") {
+        target = std::make_unique<FdTarget>(STDOUT_FILENO);
+    }
+    else if (options.sink == "memory") {
+        target = std::make_unique<MemoryTarget>();
+    }
+    else if (options.sink == "null") {
+        target = std::make_unique<NullTarget>();
+    }
+    else if (resume != nullptr) {
+        auto file = std::make_unique<FdTarget>(options.output, resume->getPosition().outputOffset);
+        if (!file->is_open()) {
+            std::cerr << "resume: " << options.output << " is shorter than the snapshot says\n";
+            return 1;
+        }
+        target = std::move(file);
+    }
+    else {
+        target = openOutputFile(options.output);
+        if (target == nullptr) {
+            std::cerr << "output: cannot write " << options.output;
+            Codec codec = codecOfPath(options.output);
+            if (!codecSupported(codec)) {
+                std::cerr << " (built without " << codecName(codec) << ")";
+            }
+            std::cerr << "\n";
+            return 1;
+        }
+    }
+    if (!options.replay.empty()) {
+        CompiledScenario scenario(options.replay);
+        if (!scenario.is_open()) {
+            std::cerr << "replay: " << options.replay << " is not a compiled scenario\n";
+            return 1;
+        }
+        OutputSink outputFile(*target, options.sinkOptions);
+        if (options.engine == "soa") {
+            SoaWorld world;
+            attachJournal(world, journal.get());
+            runCompiled(scenario, world, outputFile);
+            finishJournal(world);
+        }
+        else {
+            World world;
+            attachJournal(world, journal.get());
+            runCompiled(scenario, world, outputFile);
+            finishJournal(world);
+        }
+        outputFile.flush();
+        if (!target->close()) {
+            std::cerr << "output: cannot write " << options.output << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    InputReader inputFile(options.input);  // Memory-mapped when possible
+
+    if (inputFile.is_open()) { // Check if the file is open successfully
+        bool ran;
+        if (options.engine == "soa") {
+            SoaWorld world;
+            attachJournal(world, journal.get());
+            ran = runWithMode(options, inputFile, world, *target, resume.get());
+            finishJournal(world);
+        }
+        else {
+            World world;
+            attachJournal(world, journal.get());
+            ran = runWithMode(options, inputFile, world, *target, resume.get());
+            finishJournal(world);
+        }
+        if (!ran) {
+            std::cerr << "resume: " << options.resume << " does not fit " << options.input << "\n";
+            return 1;
+        }
+        if (inputFile.isDamaged()) {
+            std::cerr << "input: " << options.input << ": " << inputFile.problem() << "\n";
+            return 1;
+        }
+    }
+    if (!target->close()) {    // A full disk shows here at the latest, compressed output only here
+        std::cerr << "output: cannot write " << options.output << "\n";
+        return 1;
+    }
 
     return 0;
 }
-
@@ -0,0 +1,63 @@
+//
+// Overview: the narration, one function per kind of message.
+//
+// Both engines narrate through these, so the text of every message is spelled
+// out once. Each message is a single OutputSink::print() of its constant
+// fragments and the names and numbers that go between them. One-piece
+// messages ("Error caught" and the like) are written directly.
+//
+
+#ifndef FANTASY_NARRATION_H
+#define FANTASY_NARRATION_H
+
+#include "string_view"
+
+#include "output.h"
+#include "parser.h"
+
+
+// Create character
+inline void narrateArrival(OutputSink& out, std::string_view type, std::string_view name) {
+    out.print("A new ", type, " came to town, ", name, ".\n");
+}
+
+// Create item
+inline void narrateNewItem(OutputSink& out, std::string_view owner, std::string_view type, std::string_view item) {
+    out.print(owner, " just obtained a new ", type, " called ", item, ".\n");
+}
+
+// Attack (and every hit of a Volley)
+inline void narrateAttack(OutputSink& out, std::string_view attacker, std::string_view target, std::string_view weapon) {
+    out.print(attacker, " attacks ", target, " with their ", weapon, "!\n");
+}
+
+// Cast (and every victim of an Unleash)
+inline void narrateCast(OutputSink& out, std::string_view caster, std::string_view spell, std::string_view target) {
+    out.print(caster, " casts ", spell, " on ", target, "!\n");
+}
+
+inline void narrateDeath(OutputSink& out, std::string_view name) {
+    out.print(name, " has died...\n");
+}
+
+// Drink (and every drinker of a Share)
+inline void narrateDrink(OutputSink& out, std::string_view drinker, std::string_view potion, std::string_view supplier) {
+    out.print(drinker, " drinks ", potion, " from ", supplier, ".\n");
+}
+
+// One item of a Show listing: its name and its damage, heal or victim count
+template<typename Value>
+void narrateListed(OutputSink& out, std::string_view item, Value value) {
+    out.print(item, ':', value, ' ');
+}
+
+// Dialogue: the speaker and the first count words
+inline void narrateSpeech(OutputSink& out, std::string_view speaker, TokenSpan words, int count) {
+    out.print(speaker, ": ");
+    for (int i = 0; i < count; i++) {
+        out.print(words[i], ' ');
+    }
+    out.print('\n');
+}
+
+#endif //FANTASY_NARRATION_H
@@ -0,0 +1,379 @@
+//
+// Overview: buffered output sink for the narration.
+//
+// The simulation writes into an OutputSink, which collects the text in large
+// user-space blocks and hands them to an OutputTarget (a file descriptor,
+// memory or nothing at all) according to its flush policy.
+// Several full blocks can be handed over with one writev() call.
+//
+
+#ifndef FANTASY_OUTPUT_H
+#define FANTASY_OUTPUT_H
+
+#include "algorithm"
+#include "charconv"
+#include "cerrno"
+#include "climits"
+#include "cstddef"
+#include "cstring"
+#include "memory"
+#include "string"
+#include "string_view"
+#include "vector"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "instrument.h"
+
+
+// Where the buffered bytes finally go
+class OutputTarget {
+public:
+    virtual ~OutputTarget() = default;
+    // Write all the parts, in order
+    virtual void write(const struct iovec* parts, int count) = 0;
+    // Finish the output; false if any of it could not be written
+    virtual bool close() {
+        return true;
+    }
+};
+
+// Writes to a file descriptor: a file, stdout or /dev/null
+class FdTarget : public OutputTarget {
+private:
+    int fd;         // Destination descriptor
+    bool ownsFd;    // Whether the descriptor is closed by the target
+    bool failed = false;    // A write failed
+
+public:
+    explicit FdTarget(int fd, bool owns = false) : fd(fd), ownsFd(owns) {}
+    // Create (or truncate) a file
+    explicit FdTarget(const std::string& path)
+            : fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)), ownsFd(true) {}
+    // Continue an existing file after its first keep bytes, dropping the rest;
+    // not open if the file is shorter than that
+    FdTarget(const std::string& path, unsigned long long keep)
+            : fd(::open(path.c_str(), O_WRONLY | O_CLOEXEC)), ownsFd(true) {
+        struct stat info {};
+        if (fd >= 0 && (fstat(fd, &info) != 0 || static_cast<unsigned long long>(info.st_size) < keep
+                || ::ftruncate(fd, static_cast<off_t>(keep)) != 0
+                || ::lseek(fd, static_cast<off_t>(keep), SEEK_SET) < 0)) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    FdTarget(const FdTarget&) = delete;
+    FdTarget& operator=(const FdTarget&) = delete;
+    ~FdTarget() override {
+        close();
+    }
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    void write(const struct iovec* parts, int count) override {
+        if (fd < 0) {
+            return;
+        }
+        int first = 0;
+        while (first < count) {
+            ssize_t written = ::writev(fd, parts + first, std::min(count - first, IOV_MAX));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                return;     // Nothing sensible left to do with the output, but close() says so
+            }
+            auto left = static_cast<std::size_t>(written);
+            while (first < count && left >= parts[first].iov_len) {
+                left -= parts[first].iov_len;
+                first++;
+            }
+            if (left > 0) {     // writev() stopped inside a part: finish that one alone
+                const char* rest = static_cast<const char*>(parts[first].iov_base) + left;
+                std::size_t length = parts[first].iov_len - left;
+                while (length > 0) {
+                    ssize_t more = ::write(fd, rest, length);
+                    if (more < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        failed = true;
+                        return;
+                    }
+                    rest += more;
+                    length -= static_cast<std::size_t>(more);
+                }
+                first++;
+            }
+        }
+    }
+
+    bool close() override {
+        if (ownsFd && fd >= 0) {
+            failed = ::close(fd) != 0 || failed;
+            fd = -1;
+        }
+        return !failed;
+    }
+};
+
+// Keeps everything in a string
+class MemoryTarget : public OutputTarget {
+private:
+    std::string text;   // Everything written so far
+
+public:
+    void write(const struct iovec* parts, int count) override {
+        for (int i = 0; i < count; i++) {
+            text.append(static_cast<const char*>(parts[i].iov_base), parts[i].iov_len);
+        }
+    }
+    const std::string& str() const {
+        return text;
+    }
+    void clear() {
+        text.clear();
+    }
+};
+
+// Throws everything away, for measuring the simulation alone
+class NullTarget : public OutputTarget {
+private:
+    unsigned long long bytes = 0;   // Number of bytes discarded
+
+public:
+    void write(const struct iovec* parts, int count) override {
+        for (int i = 0; i < count; i++) {
+            bytes += parts[i].iov_len;
+        }
+    }
+    unsigned long long discarded() const {
+        return bytes;
+    }
+};
+
+// When the sink hands its buffer to the target
+enum class FlushPolicy {
+    Full,       // Only when the buffer is full
+    Command,    // After every command
+    Close       // Only when the sink is flushed explicitly or closed; the buffer grows as needed
+};
+
+struct SinkOptions {
+    std::size_t blockSize = 1 << 20;        // Size of one buffer block
+    int writevBlocks = 1;                   // Full blocks collected before one writev()
+    FlushPolicy flush = FlushPolicy::Full;  // Flush policy
+};
+
+// Buffered text output in front of an OutputTarget
+class OutputSink {
+private:
+    OutputTarget* target;                       // Destination of the flushed bytes
+    SinkOptions options;                        // Buffering configuration
+    std::vector<std::unique_ptr<char[]>> blocks;    // Buffer blocks, reused after each flush
+    std::size_t current = 0;                    // Index of the block being filled
+    char* cursor = nullptr;                     // Next free byte in the current block
+    char* limit = nullptr;                      // End of the current block
+    unsigned long long written = 0;             // Bytes accepted so far
+
+    void startBlock(std::size_t index) {
+        if (index == blocks.size()) {
+            blocks.emplace_back(new char[options.blockSize]);
+        }
+        current = index;
+        cursor = blocks[index].get();
+        limit = cursor + options.blockSize;
+    }
+
+    // The current block is full: move on to the next one, or flush the batch
+    void nextBlock() {
+        if (options.flush != FlushPolicy::Close && current + 1 >= static_cast<std::size_t>(options.writevBlocks)) {
+            flushBlocks(nullptr, 0);
+        }
+        else {
+            startBlock(current + 1);
+        }
+    }
+
+    // Hand all buffered blocks (plus an optional unbuffered payload) to the target at once
+    void flushBlocks(const char* extra, std::size_t extraSize) {
+        INSTRUMENT_SCOPE(Phase::Write);
+        struct iovec stackParts[16];
+        std::vector<struct iovec> heapParts;
+        struct iovec* parts = stackParts;
+        if (current + 2 > 16) {
+            heapParts.resize(current + 2);
+            parts = heapParts.data();
+        }
+        int count = 0;
+        for (std::size_t i = 0; i < current; i++) {
+            parts[count++] = {blocks[i].get(), options.blockSize};
+        }
+        std::size_t used = static_cast<std::size_t>(cursor - blocks[current].get());
+        if (used > 0) {
+            parts[count++] = {blocks[current].get(), used};
+        }
+        if (extraSize > 0) {
+            parts[count++] = {const_cast<char*>(extra), extraSize};
+        }
+        if (count > 0) {
+            target->write(parts, count);
+        }
+        startBlock(0);
+    }
+
+    // Longest text a part of print() turns into
+    template<std::size_t N>
+    static constexpr std::size_t maxLength(const char (&)[N]) {
+        return N - 1;
+    }
+    static std::size_t maxLength(std::string_view text) {
+        return text.size();
+    }
+    static constexpr std::size_t maxLength(char) {
+        return 1;
+    }
+    static constexpr std::size_t maxLength(int) {
+        return 11;      // "-2147483648"
+    }
+    static constexpr std::size_t maxLength(unsigned long) {
+        return 20;
+    }
+
+    // Put a part of print() at the cursor, which has room for it
+    template<std::size_t N>
+    void place(const char (&text)[N]) {
+        std::memcpy(cursor, text, N - 1);
+        cursor += N - 1;
+    }
+    void place(std::string_view text) {
+        std::memcpy(cursor, text.data(), text.size());
+        cursor += text.size();
+    }
+    void place(char c) {
+        *cursor++ = c;
+    }
+    void place(int value) {
+        cursor = std::to_chars(cursor, limit, value).ptr;
+    }
+    void place(unsigned long value) {
+        cursor = std::to_chars(cursor, limit, value).ptr;
+    }
+
+public:
+    explicit OutputSink(OutputTarget& target, SinkOptions options = SinkOptions())
+            : target(&target), options(options) {
+        if (this->options.blockSize < 64) {
+            this->options.blockSize = 64;
+        }
+        if (this->options.writevBlocks < 1) {
+            this->options.writevBlocks = 1;
+        }
+        startBlock(0);
+    }
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+    ~OutputSink() {
+        flush();
+    }
+
+    // Append raw bytes
+    void write(const char* text, std::size_t length) {
+        written += length;
+        if (static_cast<std::size_t>(limit - cursor) >= length) {
+            std::memcpy(cursor, text, length);
+            cursor += length;
+            return;
+        }
+        if (length >= options.blockSize && options.flush != FlushPolicy::Close) {
+            flushBlocks(text, length);  // Big payload: send it along with the buffer, uncopied
+            return;
+        }
+        while (length > 0) {
+            if (cursor == limit) {
+                nextBlock();
+            }
+            std::size_t chunk = std::min(length, static_cast<std::size_t>(limit - cursor));
+            std::memcpy(cursor, text, chunk);
+            cursor += chunk;
+            text += chunk;
+            length -= chunk;
+        }
+    }
+    void put(char c) {
+        written += 1;
+        if (cursor == limit) {
+            nextBlock();
+        }
+        *cursor++ = c;
+    }
+
+    OutputSink& operator<<(std::string_view text) {
+        write(text.data(), text.size());
+        return *this;
+    }
+    OutputSink& operator<<(const char* text) {
+        write(text, std::strlen(text));
+        return *this;
+    }
+    OutputSink& operator<<(char c) {
+        put(c);
+        return *this;
+    }
+    OutputSink& operator<<(int value) {
+        char digits[16];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        write(digits, static_cast<std::size_t>(result.ptr - digits));
+        return *this;
+    }
+    OutputSink& operator<<(unsigned long value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        write(digits, static_cast<std::size_t>(result.ptr - digits));
+        return *this;
+    }
+
+    // Append a whole message: string literals, views, characters and numbers,
+    // in order. When the longest text the parts can make fits in the current
+    // block (nearly always), there is one room check for the lot; literals are
+    // copied with their length known at compile time and numbers are
+    // formatted straight into the block. Only pass literals as char arrays:
+    // their length is taken from the array type.
+    template<typename... Parts>
+    void print(const Parts&... parts) {
+        std::size_t longest = (maxLength(parts) + ...);
+        if (static_cast<std::size_t>(limit - cursor) >= longest) {
+            char* start = cursor;
+            (place(parts), ...);
+            written += static_cast<std::size_t>(cursor - start);
+        }
+        else {
+            ((*this << parts), ...);
+        }
+    }
+
+    // Called by the engine after each command
+    void endCommand() {
+        if (options.flush == FlushPolicy::Command) {
+            flush();
+        }
+    }
+
+    // Hand everything buffered to the target
+    void flush() {
+        flushBlocks(nullptr, 0);
+    }
+
+    // Total bytes written into the sink
+    unsigned long long bytesWritten() const {
+        return written;
+    }
+};
+
+#endif //FANTASY_OUTPUT_H
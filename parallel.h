@@ -0,0 +1,191 @@
+//
+// Overview: parallel execution of commands that touch different characters.
+//
+// The scenario is read in windows of parsed commands. Names are resolved in
+// order on the scheduling thread, then each run of commands between two
+// barriers is split into levels: a command goes one level above the last
+// earlier command that names one of its characters, so the commands of a
+// level never share a character and can run at the same time. Every command
+// writes into its own buffer, and the buffers are committed in input order,
+// so the narration is exactly that of the serial loop.
+//
+// Barriers run alone: creations (they grow the world's tables and pools),
+// Cast (it kills), the area-of-effect commands (they touch a whole group)
+// and every Show but those of one character's items (they read everybody).
+//
+
+#ifndef FANTASY_PARALLEL_H
+#define FANTASY_PARALLEL_H
+
+#include "algorithm"
+#include "cstddef"
+#include "cstdint"
+#include "memory"
+#include "string_view"
+#include "vector"
+
+#include "input.h"
+#include "output.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+
+// Whether a command has to run with nothing else in flight
+inline bool isBarrier(const Command& command) {
+    switch (command.op) {
+        case Opcode::CreateCharacter:
+        case Opcode::CreateItem:
+        case Opcode::Cast:
+        case Opcode::Volley:
+        case Opcode::Unleash:
+        case Opcode::Share:
+            return true;
+        case Opcode::Show:
+            return command.kind.empty() || (command.kind[0] != 'w' && command.kind[0] != 'p' && command.kind[0] != 's');
+        default:
+            return false;
+    }
+}
+
+// Narration of a single command, kept until it is its turn to be committed
+struct CommandOutput {
+    MemoryTarget text;
+    OutputSink sink;
+
+    CommandOutput() : sink(text, SinkOptions{256, 1, FlushPolicy::Close}) {}
+};
+
+// Run a whole scenario like runScenario(), executing independent commands on
+// jobs threads (0 for one per core). The world must tolerate concurrent
+// commands on disjoint characters. Returns the number of commands executed.
+template<typename W>
+unsigned long long runParallel(InputReader &inputFile, W &world, OutputSink &outputFile, unsigned jobs = 0) {
+    const std::size_t PARALLEL_MIN = 32;    // Smaller levels are not worth waking the workers for
+
+    WorkStealingPool pool(jobs);
+    CommandParser parser;   // Names are resolved separately, in order
+    CommandBatch batch;
+    std::vector<std::unique_ptr<CommandOutput>> outputs;
+    std::vector<std::uint32_t> nextLevel;   // Per name id: lowest level free of that character
+    std::vector<std::uint32_t> seenIn;      // Per name id: segment that last set nextLevel
+    std::uint32_t segment = 0;
+    std::vector<std::uint32_t> levelOf;     // Per command of the segment
+    std::vector<std::size_t> levelStart;    // Counting sort of the segment by level
+    std::vector<std::size_t> byLevel;
+    std::vector<std::size_t> fill;          // Next free place of each level in byLevel
+    unsigned long long commands = 0;
+
+    auto run = [&](std::size_t i) {
+        CommandOutput& out = *outputs[i];
+        execute(batch.commands[i], world, out.sink);
+        out.sink.flush();
+    };
+
+    // Run the commands byLevel[first, last), which are independent of each other
+    auto runLevel = [&](std::size_t first, std::size_t last) {
+        std::size_t count = last - first;
+        if (pool.size() < 2 || count < PARALLEL_MIN) {
+            for (std::size_t k = first; k < last; k++) {
+                run(byLevel[k]);
+            }
+            return;
+        }
+        std::size_t share = (count + pool.size() - 1) / pool.size();
+        for (std::size_t from = first; from < last; from += share) {
+            std::size_t to = std::min(last, from + share);
+            pool.submit([&, from, to](unsigned) {
+                for (std::size_t k = from; k < to; k++) {
+                    run(byLevel[k]);
+                }
+            });
+        }
+        pool.wait();
+    };
+
+    std::string_view line;
+    inputFile.nextLine(line);   // The first line is the number of commands
+    bool more = true;
+    while (more) {
+        // Read and parse a window, line by line: it holds at most MAX_LINES
+        // commands, each with an output buffer of its own
+        batch.clear();
+        for (std::size_t lines = 0; lines < CommandBatch::MAX_LINES && batch.text.size() < CommandBatch::MAX_BYTES; lines++) {
+            if (!inputFile.nextLine(line)) {
+                more = false;
+                break;
+            }
+            batch.append(line);
+        }
+        batch.parse(parser);
+        std::size_t n = batch.commands.size();
+        for (Command& command : batch.commands) {
+            resolveNames(command, world.names);
+        }
+        while (outputs.size() < n) {
+            outputs.push_back(std::make_unique<CommandOutput>());
+        }
+        nextLevel.resize(world.names.size());
+        seenIn.resize(world.names.size(), 0);
+        levelOf.resize(n);
+
+        std::size_t i = 0;
+        while (i < n) {
+            if (isBarrier(batch.commands[i])) {
+                run(i);
+                i++;
+                continue;
+            }
+            // Level every command up to the next barrier
+            segment++;
+            std::size_t end = i;
+            std::uint32_t levels = 0;
+            for (; end < n && !isBarrier(batch.commands[end]); end++) {
+                const Command& command = batch.commands[end];
+                NameId keys[2] = {command.actorId, command.targetId};
+                std::uint32_t level = 0;
+                for (NameId key : keys) {
+                    if (key != NO_NAME && seenIn[key] == segment) {
+                        level = std::max(level, nextLevel[key]);
+                    }
+                }
+                for (NameId key : keys) {
+                    if (key != NO_NAME) {
+                        seenIn[key] = segment;
+                        nextLevel[key] = level + 1;
+                    }
+                }
+                levelOf[end] = level;
+                levels = std::max(levels, level + 1);
+            }
+            levelStart.assign(levels + 1, 0);
+            for (std::size_t k = i; k < end; k++) {
+                levelStart[levelOf[k] + 1]++;
+            }
+            for (std::uint32_t level = 0; level < levels; level++) {
+                levelStart[level + 1] += levelStart[level];
+            }
+            byLevel.resize(end - i);
+            fill.assign(levelStart.begin(), levelStart.end() - 1);
+            for (std::size_t k = i; k < end; k++) {
+                byLevel[fill[levelOf[k]]++] = k;
+            }
+            for (std::uint32_t level = 0; level < levels; level++) {
+                runLevel(levelStart[level], levelStart[level + 1]);
+            }
+            i = end;
+        }
+
+        // Commit the narration in input order
+        for (std::size_t k = 0; k < n; k++) {
+            CommandOutput& out = *outputs[k];
+            outputFile << std::string_view(out.text.str());
+            outputFile.endCommand();
+            out.text.clear();
+        }
+        commands += n;
+    }
+    return commands;
+}
+
+#endif //FANTASY_PARALLEL_H
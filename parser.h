@@ -0,0 +1,336 @@
+//
+// Overview: allocation-free command parser.
+//
+// A line is split into std::string_view tokens over a buffer that is reused
+// from line to line, and then classified into a typed Command.
+// Nothing here owns the text: views stay valid as long as the line does.
+//
+
+#ifndef FANTASY_PARSER_H
+#define FANTASY_PARSER_H
+
+#include "charconv"
+#include "limits"
+#include "cstddef"
+#include "cstdint"
+#include "string_view"
+#include "vector"
+
+#include "instrument.h"
+#include "symbols.h"
+
+
+// Kinds of commands understood by the simulator
+enum class Opcode {
+    Empty,              // Blank line, nothing to do
+    CreateCharacter,    // Create character <type> <name> <hp>
+    CreateItem,         // Create item <type> <owner> <name> <value|len> [victims...]
+    CreateOther,        // Create <anything else>, silently ignored
+    Attack,             // Attack <attacker> <target> <weapon>
+    Cast,               // Cast <caster> <target> <spell>
+    Drink,              // Drink <supplier> <drinker> <potion>
+    Dialogue,           // Dialogue <speaker> <len> <words...>
+    Show,               // Show <what> [name], or an analytical query (see hp_index.h)
+    Unknown,            // Anything else
+    // Area-of-effect commands, numbered after Unknown so that compiled images keep their opcodes
+    Volley,             // Volley <attacker> <weapon> <count> <targets...>
+    Unleash,            // Unleash <caster> <spell>
+    Share               // Share <supplier> <potion> <count> <drinkers...>
+};
+
+// Read-only window over a run of tokens
+class TokenSpan {
+private:
+    const std::string_view* first;  // First token of the span
+    std::size_t count;              // Number of tokens in the span
+
+public:
+    TokenSpan() : first(nullptr), count(0) {}
+    TokenSpan(const std::string_view* first, std::size_t count) : first(first), count(count) {}
+
+    std::size_t size() const {
+        return count;
+    }
+    // Missing tokens read as empty strings instead of running off the end
+    std::string_view operator[](std::size_t i) const {
+        return i < count ? first[i] : std::string_view();
+    }
+    const std::string_view* begin() const {
+        return first;
+    }
+    const std::string_view* end() const {
+        return first + count;
+    }
+};
+
+// Parsed command: the opcode plus views of its fields.
+// Which fields are set depends on the opcode (see the comments in Opcode).
+struct Command {
+    Opcode op = Opcode::Empty;
+    std::string_view kind;      // Character type, item type or Show subject
+    std::string_view actor;     // Character name, item owner, attacker, caster, supplier or speaker
+    std::string_view target;    // Target of Attack/Cast/Drink
+    std::string_view object;    // Item name
+    std::string_view number;    // Raw HP, value, victim count, word count or target count
+    int value = 0;              // The number, when it was converted in advance (see numberOf)
+    bool hasValue = false;      // Whether value holds the number
+    bool complete = true;       // Whether the line had every token its opcode needs (see arityOf)
+    TokenSpan rest;             // Spell victims, dialogue words, or targets of Volley and Share
+
+    NameId actorId = NO_NAME;   // Interned actor, NO_NAME if the name is unknown
+    NameId targetId = NO_NAME;  // Interned target
+    NameId objectId = NO_NAME;  // Interned item name
+};
+
+// Type of a command for the instrumentation and the benchmark (see instrument.h)
+inline int commandTypeOf(const Command& command) {
+    static_assert(static_cast<int>(Opcode::Share) + 2 == COMMAND_TYPES, "one type per opcode, plus Show characters");
+    if (command.op == Opcode::Show && !command.kind.empty() && command.kind[0] == 'c') {
+        return COMMAND_TYPES - 1;
+    }
+    return static_cast<int>(command.op);
+}
+
+// Resolve the names of a command to ids. Names being introduced (a new
+// character or item) are interned, names that are only referred to are
+// looked up, so a typo in an Attack never grows the table.
+inline void resolveNames(Command& command, SymbolTable& symbols) {
+    switch (command.op) {
+        case Opcode::CreateCharacter:
+            command.actorId = symbols.intern(command.actor);
+            break;
+        case Opcode::CreateItem:
+            command.actorId = symbols.find(command.actor);
+            command.objectId = symbols.intern(command.object);
+            break;
+        case Opcode::Attack:
+        case Opcode::Cast:
+        case Opcode::Drink:
+            command.actorId = symbols.find(command.actor);
+            command.targetId = symbols.find(command.target);
+            command.objectId = symbols.find(command.object);
+            break;
+        case Opcode::Volley:
+        case Opcode::Unleash:
+        case Opcode::Share:
+            command.actorId = symbols.find(command.actor);     // Targets are looked up by the handlers
+            command.objectId = symbols.find(command.object);
+            break;
+        case Opcode::Dialogue:
+        case Opcode::Show:
+            command.actorId = symbols.find(command.actor);
+            break;
+        default:
+            break;
+    }
+}
+
+// Split a string on single spaces, the same way std::getline(ss, token, ' ') does:
+// every space ends a token (so runs of spaces give empty tokens),
+// but a trailing space does not produce an empty token at the end.
+inline void splitTokens(std::string_view input, std::vector<std::string_view>& tokens) {
+    tokens.clear();     // Keeps the capacity, so a warmed up buffer never reallocates
+    std::size_t start = 0;
+    while (start < input.size()) {
+        std::size_t space = input.find(' ', start);
+        if (space == std::string_view::npos) {
+            tokens.push_back(input.substr(start));
+            break;
+        }
+        tokens.push_back(input.substr(start, space - start));
+        start = space + 1;
+    }
+}
+
+// Split a line like splitTokens(), given the offsets of its spaces (as found
+// by scanDelimiters() over the block the line is in; lineStart is the offset
+// of the line in that block)
+inline void splitTokensAt(std::string_view line, const std::uint32_t* spaces, std::size_t count,
+                          std::size_t lineStart, std::vector<std::string_view>& tokens) {
+    tokens.resize(count + 1);   // Every token is known up front: no growth checks per token
+    const char* block = line.data() - lineStart;
+    std::size_t start = lineStart;
+    for (std::size_t i = 0; i < count; i++) {
+        tokens[i] = std::string_view(block + start, spaces[i] - start);
+        start = spaces[i] + 1;
+    }
+    std::size_t end = lineStart + line.size();
+    if (start < end) {
+        tokens[count] = std::string_view(block + start, end - start);
+    }
+    else {
+        tokens.pop_back();
+    }
+}
+
+// Value of a number that does not convert. It lies outside the valid range
+// of every numeric field, so the handlers' range checks turn it into
+// "Error caught" like any other bad value, without a separate error path.
+constexpr int BAD_NUMBER = std::numeric_limits<int>::min();
+
+// Convert a token to int with the same rules as std::stoi (leading whitespace
+// and a sign are accepted, trailing junk is ignored), without throwing.
+// False if std::stoi would have thrown.
+inline bool parseInt(std::string_view token, int& value) {
+    std::size_t i = 0;
+    while (i < token.size() && (token[i] == ' ' || (token[i] >= '\t' && token[i] <= '\r'))) {
+        i++;
+    }
+    bool plus = i < token.size() && token[i] == '+';
+    if (plus) {
+        i++;
+    }
+    const char* first = token.data() + i;
+    const char* last = token.data() + token.size();
+    if (plus && (first == last || *first == '-')) {
+        return false;
+    }
+    return std::from_chars(first, last, value).ec == std::errc();
+}
+
+// Numeric field of a command: the value converted in advance, or the text
+// converted now. BAD_NUMBER if it does not convert.
+inline int numberOf(const Command& command) {
+    int value;
+    if (command.hasValue) {
+        return command.value;
+    }
+    return parseInt(command.number, value) ? value : BAD_NUMBER;
+}
+
+// Fewest tokens a line of this opcode needs. Shorter lines are incomplete and
+// get "Error caught" without running the handler.
+inline std::size_t arityOf(Opcode op) {
+    switch (op) {
+        case Opcode::CreateCharacter:
+            return 5;   // Create character <type> <name> <hp>
+        case Opcode::CreateItem:
+            return 6;   // Create item <type> <owner> <name> <value|len>
+        case Opcode::Attack:
+        case Opcode::Cast:
+        case Opcode::Drink:
+            return 4;   // <verb> <actor> <target> <item>
+        case Opcode::Dialogue:
+            return 3;   // Dialogue <speaker> <len>, the words are checked against len
+        case Opcode::Show:
+            return 2;   // Show <what>, a name is checked by the handler
+        case Opcode::Volley:
+        case Opcode::Share:
+            return 4;   // <verb> <actor> <item> <count>, the targets are checked against count
+        case Opcode::Unleash:
+            return 3;   // Unleash <caster> <spell>
+        default:
+            return 0;
+    }
+}
+
+// Turns lines into Commands, reusing its token buffer between calls
+class CommandParser {
+private:
+    std::vector<std::string_view> tokens;   // Token buffer shared by all parsed lines
+    SymbolTable* symbols;                   // Names are resolved against it when set
+
+public:
+    explicit CommandParser(SymbolTable* symbols = nullptr) : symbols(symbols) {
+        tokens.reserve(64);     // Enough for the longest valid command (a spell with 50 victims)
+    }
+
+    // Parse one line. The result refers into both the line and this parser,
+    // so it is only valid until the next call.
+    Command parse(std::string_view line) {
+        INSTRUMENT_SCOPE(Phase::Parse);
+        splitTokens(line, tokens);
+        return classify();
+    }
+    // Parse one line of a scanned block, whose spaces are already known (see splitTokensAt)
+    Command parse(std::string_view line, const std::uint32_t* spaces, std::size_t count, std::size_t lineStart) {
+        INSTRUMENT_SCOPE(Phase::Parse);
+        splitTokensAt(line, spaces, count, lineStart, tokens);
+        return classify();
+    }
+
+private:
+    // Turn the tokens of a line into a Command
+    Command classify() {
+        Command command;
+        if (tokens.empty()) {
+            return command;
+        }
+        TokenSpan args(tokens.data(), tokens.size());
+        std::string_view word = args[0];
+
+        if (word == "Create") {
+            if (args[1] == "character") {
+                command.op = Opcode::CreateCharacter;
+                command.kind = args[2];
+                command.actor = args[3];
+                command.number = args[4];
+            }
+            else if (args[1] == "item") {
+                command.op = Opcode::CreateItem;
+                command.kind = args[2];
+                command.actor = args[3];
+                command.object = args[4];
+                command.number = args[5];
+                if (args.size() > 6) {
+                    command.rest = TokenSpan(tokens.data() + 6, tokens.size() - 6);
+                }
+            }
+            else {
+                command.op = Opcode::CreateOther;
+            }
+        }
+        else if (word == "Attack" || word == "Cast" || word == "Drink") {
+            command.op = word[0] == 'A' ? Opcode::Attack : word[0] == 'C' ? Opcode::Cast : Opcode::Drink;
+            command.actor = args[1];
+            command.target = args[2];
+            command.object = args[3];
+        }
+        else if (word == "Dialogue") {
+            command.op = Opcode::Dialogue;
+            command.actor = args[1];
+            command.number = args[2];
+            if (args.size() > 3) {
+                command.rest = TokenSpan(tokens.data() + 3, tokens.size() - 3);
+            }
+        }
+        else if (word == "Volley" || word == "Share") {
+            command.op = word[0] == 'V' ? Opcode::Volley : Opcode::Share;
+            command.actor = args[1];
+            command.object = args[2];
+            command.number = args[3];
+            if (args.size() > 4) {
+                command.rest = TokenSpan(tokens.data() + 4, tokens.size() - 4);
+            }
+        }
+        else if (word == "Unleash") {
+            command.op = Opcode::Unleash;
+            command.actor = args[1];
+            command.object = args[2];
+        }
+        else if (word == "Show") {
+            command.op = Opcode::Show;
+            command.kind = args[1];
+            command.actor = args[2];
+            if (args.size() > 2) {
+                command.rest = TokenSpan(tokens.data() + 2, tokens.size() - 2);   // Arguments of the analytical forms
+            }
+        }
+        else {
+            command.op = Opcode::Unknown;
+        }
+
+        // Validation: arity, and the number converted once, here
+        command.complete = args.size() >= arityOf(command.op);
+        if (!command.number.empty()) {
+            command.value = numberOf(command);
+            command.hasValue = true;
+        }
+        if (symbols != nullptr) {
+            resolveNames(command, *symbols);
+        }
+        return command;
+    }
+};
+
+#endif //FANTASY_PARSER_H
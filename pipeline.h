@@ -0,0 +1,181 @@
+//
+// Overview: pipelined execution of a scenario on three threads.
+//
+//   reader:     reads blocks of lines, copies them into a batch and parses them
+//   simulation: resolves names and executes the commands of each batch
+//   writer:     writes the narration blocks produced by the simulation
+//
+// The stages are joined by SPSC queues. Batches and output chunks travel
+// forward full and come back empty on a return queue, so the memory in
+// flight is bounded and reused. The simulation runs the same handlers in
+// the same order as the serial driver, which keeps the output identical.
+//
+
+#ifndef FANTASY_PIPELINE_H
+#define FANTASY_PIPELINE_H
+
+#include "cstddef"
+#include "cstdint"
+#include "memory"
+#include "string_view"
+#include "thread"
+#include "vector"
+
+#include "input.h"
+#include "output.h"
+#include "parser.h"
+#include "scan.h"
+#include "spsc_queue.h"
+
+
+// Lines of a scenario parsed ahead of the simulation. The batch owns its text;
+// the commands point into it, and their names are not resolved yet (the symbol
+// table belongs to the simulation thread). The text keeps the '\n' of every
+// line, so one scan finds both the lines and their tokens (see scan.h).
+struct CommandBatch {
+    static constexpr std::size_t MAX_LINES = 4096;
+    static constexpr std::size_t MAX_BYTES = 256 << 10;
+
+    std::vector<char> text;                 // The lines, each ending with '\n'
+    ScanOffsets scan;                       // Newlines and spaces of text
+    std::vector<std::string_view> tokens;   // Spell victims and dialogue words of all commands
+    std::vector<Command> commands;          // One per line
+    std::vector<std::size_t> restAt;        // Where the rest tokens of each command start in tokens
+
+    void clear() {
+        text.clear();
+    }
+    // Add one or more whole lines (a block from InputReader::nextBlock, or a
+    // single line from nextLine)
+    void append(std::string_view lines) {
+        text.insert(text.end(), lines.begin(), lines.end());
+        if (lines.empty() || lines.back() != '\n') {
+            text.push_back('\n');
+        }
+    }
+
+    // Parse the collected lines. Called once the text is complete, so views into it stay valid.
+    void parse(CommandParser& parser) {
+        commands.clear();
+        tokens.clear();
+        restAt.clear();
+        scanDelimiters(text.data(), text.size(), scan);
+        std::size_t start = 0;
+        std::size_t space = 0;
+        for (std::uint32_t end : scan.newlines) {
+            std::size_t first = space;
+            while (space < scan.spaces.size() && scan.spaces[space] < end) {
+                space++;
+            }
+            Command command = parser.parse(std::string_view(text.data() + start, end - start),
+                                           scan.spaces.data() + first, space - first, start);
+            restAt.push_back(tokens.size());
+            tokens.insert(tokens.end(), command.rest.begin(), command.rest.end());
+            commands.push_back(command);
+            start = end + 1;
+        }
+        // The parser's token buffer is reused per line: point the spans into ours
+        for (std::size_t i = 0; i < commands.size(); i++) {
+            std::size_t count = commands[i].rest.size();
+            commands[i].rest = count > 0 ? TokenSpan(tokens.data() + restAt[i], count) : TokenSpan();
+        }
+    }
+};
+
+// Output target of the simulation stage: copies what the sink flushes into
+// a chunk and passes it on to the writer
+class HandoffTarget : public OutputTarget {
+private:
+    SpscQueue<std::vector<char>*>& full;    // To the writer
+    SpscQueue<std::vector<char>*>& empty;   // Back from the writer
+
+public:
+    HandoffTarget(SpscQueue<std::vector<char>*>& full, SpscQueue<std::vector<char>*>& empty)
+            : full(full), empty(empty) {}
+
+    void write(const struct iovec* parts, int count) override {
+        std::vector<char>* chunk = empty.pop();
+        chunk->clear();
+        for (int i = 0; i < count; i++) {
+            const char* bytes = static_cast<const char*>(parts[i].iov_base);
+            chunk->insert(chunk->end(), bytes, bytes + parts[i].iov_len);
+        }
+        full.push(chunk);
+    }
+};
+
+// Run a whole scenario like runScenario(), with reading and parsing, simulation
+// and writing on separate threads. The narration goes to target.
+// Returns the number of commands executed.
+template<typename W>
+unsigned long long runPipelined(InputReader &inputFile, W &world, OutputTarget &target,
+                                SinkOptions sinkOptions = SinkOptions()) {
+    const std::size_t IN_FLIGHT = 8;    // Batches (and output chunks) queued between two stages
+
+    std::vector<std::unique_ptr<CommandBatch>> batches;
+    SpscQueue<CommandBatch*> parsed(IN_FLIGHT);     // Reader to simulation; nullptr ends the scenario
+    SpscQueue<CommandBatch*> recycled(IN_FLIGHT + 2);
+    for (std::size_t i = 0; i < IN_FLIGHT + 2; i++) {
+        batches.push_back(std::make_unique<CommandBatch>());
+        recycled.push(batches.back().get());
+    }
+
+    std::vector<std::unique_ptr<std::vector<char>>> chunks;
+    SpscQueue<std::vector<char>*> written(IN_FLIGHT);   // Simulation to writer; nullptr ends the output
+    SpscQueue<std::vector<char>*> spare(IN_FLIGHT + 2);
+    for (std::size_t i = 0; i < IN_FLIGHT + 2; i++) {
+        chunks.push_back(std::make_unique<std::vector<char>>());
+        spare.push(chunks.back().get());
+    }
+
+    std::thread reader([&] {
+        CommandParser parser;   // No symbol table: names are resolved by the simulation
+        std::string_view line;
+        inputFile.nextLine(line);   // The first line is the number of commands
+        bool more = true;
+        while (more) {
+            CommandBatch* batch = recycled.pop();
+            batch->clear();
+            std::string_view block;
+            if (inputFile.nextBlock(block, CommandBatch::MAX_BYTES)) {
+                batch->append(block);
+            }
+            else {
+                more = false;
+            }
+            batch->parse(parser);
+            parsed.push(batch);
+        }
+        parsed.push(nullptr);
+    });
+
+    std::thread writer([&] {
+        while (std::vector<char>* chunk = written.pop()) {
+            struct iovec part = {chunk->data(), chunk->size()};
+            target.write(&part, 1);
+            spare.push(chunk);
+        }
+    });
+
+    unsigned long long commands = 0;
+    {
+        HandoffTarget handoff(written, spare);
+        OutputSink outputFile(handoff, sinkOptions);
+        while (CommandBatch* batch = parsed.pop()) {
+            for (Command& command : batch->commands) {
+                resolveNames(command, world.names);
+                execute(command, world, outputFile);
+            }
+            commands += batch->commands.size();
+            recycled.push(batch);
+        }
+        outputFile.flush();
+    }
+    written.push(nullptr);
+
+    reader.join();
+    writer.join();
+    return commands;
+}
+
+#endif //FANTASY_PIPELINE_H
@@ -0,0 +1,144 @@
+//
+// Overview: typed object pool.
+//
+// Objects are carved out of large chunks instead of being allocated one by one,
+// and destroyed objects go on a free list for reuse. Objects can be referred
+// to by generational handles, which are checked on use and never dangle.
+// Pooled types must be trivially destructible, so clear() can drop every
+// object at once without visiting them and keep the chunks for the next scenario.
+//
+
+#ifndef FANTASY_POOL_H
+#define FANTASY_POOL_H
+
+#include "cstddef"
+#include "cstdint"
+#include "memory"
+#include "new"
+#include "type_traits"
+#include "utility"
+#include "vector"
+
+
+// Generational reference to a pooled object. It stops resolving once the
+// object is destroyed, even if its memory has been reused for another one.
+template<typename T>
+struct Handle {
+    std::uint32_t index = UINT32_MAX;   // Node of the object in its pool
+    std::uint64_t generation = 0;       // Stamp of the object; 0 never resolves
+
+    bool operator==(const Handle& other) const {
+        return index == other.index && generation == other.generation;
+    }
+    bool operator!=(const Handle& other) const {
+        return !(*this == other);
+    }
+};
+
+template<typename T, std::size_t CHUNK_OBJECTS = 1024>
+class ObjectPool {
+private:
+    static_assert(std::is_trivially_destructible_v<T>, "pooled objects are dropped without running destructors");
+
+    // Storage for one object; while the object is free it links the free list.
+    // The storage comes first, so an object pointer is also a node pointer.
+    struct Node {
+        union {
+            std::uint32_t nextFree;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+        std::uint64_t generation;   // Stamp of the current object, 0 while free
+        std::uint32_t index;        // Position of the node in the pool
+    };
+
+    static constexpr std::uint32_t NO_NODE = UINT32_MAX;
+
+    std::vector<std::unique_ptr<Node[]>> chunks;    // Memory of the pool
+    std::uint32_t used = 0;         // Nodes handed out so far, counting through the chunks
+    std::uint32_t freeList = NO_NODE;   // Destroyed nodes, reused first
+    std::uint64_t nextStamp = 1;    // Generation of the next object; 64 bits never wrap, so clear() needs no sweep
+    std::size_t live = 0;           // Objects currently alive
+
+    Node& node(std::uint32_t index) const {
+        return chunks[index / CHUNK_OBJECTS][index % CHUNK_OBJECTS];
+    }
+    static Node* nodeOf(const T* object) {
+        return reinterpret_cast<Node*>(const_cast<T*>(object));
+    }
+
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    // Construct an object in the pool. U may be a class derived from T
+    // as long as it adds no data (the node is sized for T).
+    template<typename U = T, typename... Args>
+    U* create(Args&&... args) {
+        static_assert(sizeof(U) <= sizeof(T) && alignof(U) <= alignof(T), "object does not fit a pool node");
+        Node* place;
+        if (freeList != NO_NODE) {
+            place = &node(freeList);
+            freeList = place->nextFree;
+        }
+        else {
+            if (used == chunks.size() * CHUNK_OBJECTS) {
+                chunks.emplace_back(new Node[CHUNK_OBJECTS]);
+            }
+            place = &node(used);
+            place->index = used;
+            used++;
+        }
+        place->generation = nextStamp++;
+        live++;
+        return new (place->storage) U(std::forward<Args>(args)...);
+    }
+
+    // Give an object back to the pool; handles to it stop resolving
+    void destroy(T* object) {
+        Node* place = nodeOf(object);
+        place->generation = 0;
+        place->nextFree = freeList;
+        freeList = place->index;
+        live--;
+    }
+
+    // Handle of a living object
+    Handle<T> handleOf(const T* object) const {
+        const Node* place = nodeOf(object);
+        return Handle<T>{place->index, place->generation};
+    }
+
+    // Object behind a handle, nullptr if it has been destroyed
+    T* get(Handle<T> handle) const {
+        if (handle.index >= used || handle.generation == 0) {
+            return nullptr;
+        }
+        Node& place = node(handle.index);
+        return place.generation == handle.generation ? reinterpret_cast<T*>(place.storage) : nullptr;
+    }
+
+    // Drop every object at once; the memory stays with the pool for reuse
+    void clear() {
+        used = 0;
+        freeList = NO_NODE;
+        live = 0;
+    }
+
+    // Drop every object and give the memory back
+    void release() {
+        clear();
+        chunks.clear();
+    }
+
+    // Number of objects alive
+    std::size_t size() const {
+        return live;
+    }
+    // Bytes of memory held by the pool
+    std::size_t capacityBytes() const {
+        return chunks.size() * CHUNK_OBJECTS * sizeof(Node);
+    }
+};
+
+#endif //FANTASY_POOL_H
@@ -0,0 +1,181 @@
+//
+// Overview: vectorised scanning of a block of lines for '\n' and ' '.
+//
+// scanDelimiters() finds every newline and every space of a block in one pass
+// and stores their offsets, so a whole batch of lines is split into lines and
+// tokens without looking at any byte twice. The kernel is picked once, at the
+// first call, for the CPU the program runs on: AVX2 (two 32-byte registers,
+// 64 bytes per step), SSE2 (two 16-byte registers, 32 bytes per step, always
+// there on x86-64) or plain C++ elsewhere. All of them give the same offsets.
+// Offsets are 32 bits: a block must be smaller than 4 GiB.
+//
+
+#ifndef FANTASY_SCAN_H
+#define FANTASY_SCAN_H
+
+#include "algorithm"
+#include "cstddef"
+#include "cstdint"
+#include "vector"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FANTASY_SCAN_X86 1
+#endif
+
+
+// Where the delimiters of a block are, in increasing order
+struct ScanOffsets {
+    std::vector<std::uint32_t> newlines;
+    std::vector<std::uint32_t> spaces;
+};
+
+// Appends offsets to a vector through a raw pointer, growing it ahead of time
+class OffsetWriter {
+private:
+    std::vector<std::uint32_t>& offsets;
+    std::size_t used = 0;
+
+public:
+    explicit OffsetWriter(std::vector<std::uint32_t>& offsets) : offsets(offsets) {}
+    ~OffsetWriter() {
+        offsets.resize(used);
+    }
+
+    // Room for at least count more offsets
+    std::uint32_t* reserve(std::size_t count) {
+        if (offsets.size() < used + count) {
+            offsets.resize(std::max(offsets.size() * 2, used + count));
+        }
+        return offsets.data() + used;
+    }
+    void advance(std::size_t count) {
+        used += count;
+    }
+    // Store base + the position of every set bit of mask
+    void putBits(std::uint32_t base, std::uint64_t mask, std::size_t bits) {
+        std::uint32_t* out = reserve(bits);
+        std::size_t count = 0;
+        while (mask != 0) {
+            out[count++] = base + static_cast<std::uint32_t>(__builtin_ctzll(mask));
+            mask &= mask - 1;
+        }
+        used += count;
+    }
+    void put(std::uint32_t offset) {
+        *reserve(1) = offset;
+        used++;
+    }
+};
+
+using ScanKernel = void (*)(const char* data, std::size_t size, ScanOffsets& offsets);
+
+inline void scanScalar(const char* data, std::size_t size, ScanOffsets& offsets) {
+    OffsetWriter newlines(offsets.newlines);
+    OffsetWriter spaces(offsets.spaces);
+    for (std::size_t i = 0; i < size; i++) {
+        if (data[i] == '\n') {
+            newlines.put(static_cast<std::uint32_t>(i));
+        }
+        else if (data[i] == ' ') {
+            spaces.put(static_cast<std::uint32_t>(i));
+        }
+    }
+}
+
+#ifdef FANTASY_SCAN_X86
+
+inline void scanSse2(const char* data, std::size_t size, ScanOffsets& offsets) {
+    OffsetWriter newlines(offsets.newlines);
+    OffsetWriter spaces(offsets.spaces);
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    std::size_t i = 0;
+    for (; i + 32 <= size; i += 32) {     // Two vectors per step, one 32-bit mask each
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16));
+        auto newlineMask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(low, newline)))
+                | static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(high, newline))) << 16;
+        auto spaceMask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(low, space)))
+                | static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(high, space))) << 16;
+        newlines.putBits(static_cast<std::uint32_t>(i), newlineMask, 32);
+        spaces.putBits(static_cast<std::uint32_t>(i), spaceMask, 32);
+    }
+    for (; i < size; i++) {
+        if (data[i] == '\n') {
+            newlines.put(static_cast<std::uint32_t>(i));
+        }
+        else if (data[i] == ' ') {
+            spaces.put(static_cast<std::uint32_t>(i));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+inline void scanAvx2(const char* data, std::size_t size, ScanOffsets& offsets) {
+    OffsetWriter newlines(offsets.newlines);
+    OffsetWriter spaces(offsets.spaces);
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    std::size_t i = 0;
+    for (; i + 64 <= size; i += 64) {     // Two vectors per step, one 64-bit mask each
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+        std::uint64_t newlineMask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline)))
+                | static_cast<std::uint64_t>(static_cast<std::uint32_t>(
+                        _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)))) << 32;
+        std::uint64_t spaceMask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, space)))
+                | static_cast<std::uint64_t>(static_cast<std::uint32_t>(
+                        _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, space)))) << 32;
+        newlines.putBits(static_cast<std::uint32_t>(i), newlineMask, 64);
+        spaces.putBits(static_cast<std::uint32_t>(i), spaceMask, 64);
+    }
+    for (; i < size; i++) {
+        if (data[i] == '\n') {
+            newlines.put(static_cast<std::uint32_t>(i));
+        }
+        else if (data[i] == ' ') {
+            spaces.put(static_cast<std::uint32_t>(i));
+        }
+    }
+}
+
+#endif
+
+// Name of a kernel, for reports
+inline const char* scanKernelName(ScanKernel kernel) {
+#ifdef FANTASY_SCAN_X86
+    if (kernel == scanAvx2) {
+        return "avx2";
+    }
+    if (kernel == scanSse2) {
+        return "sse2";
+    }
+#endif
+    return kernel == scanScalar ? "scalar" : "unknown";
+}
+
+// Every kernel the CPU can run, fastest last
+inline std::vector<ScanKernel> availableScanKernels() {
+    std::vector<ScanKernel> kernels = {scanScalar};
+#ifdef FANTASY_SCAN_X86
+    kernels.push_back(scanSse2);
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(scanAvx2);
+    }
+#endif
+    return kernels;
+}
+
+// The kernel used by scanDelimiters()
+inline ScanKernel bestScanKernel() {
+    static const ScanKernel best = availableScanKernels().back();
+    return best;
+}
+
+// Find the offsets of all newlines and spaces of a block (replacing what offsets held)
+inline void scanDelimiters(const char* data, std::size_t size, ScanOffsets& offsets) {
+    bestScanKernel()(data, size, offsets);
+}
+
+#endif //FANTASY_SCAN_H
@@ -0,0 +1,34 @@
+//
+// Overview: running one scenario from start to end.
+//
+// The driver is shared by every entry point (single run, batch) and by both
+// storage engines: execute() is found for whatever world type it is given.
+//
+
+#ifndef FANTASY_SCENARIO_H
+#define FANTASY_SCENARIO_H
+
+#include "string_view"
+
+#include "input.h"
+#include "output.h"
+#include "parser.h"
+
+
+// Run a whole scenario: skip the first line, then execute every other line.
+// Returns the number of commands executed.
+template<typename W>
+unsigned long long runScenario(InputReader &inputFile, W &world, OutputSink &outputFile) {
+    CommandParser parser(&world.names);  // Names are interned as lines are parsed
+    std::string_view line;
+    unsigned long long commands = 0;
+
+    inputFile.nextLine(line);   // The first line is the number of commands
+    while (inputFile.nextLine(line)) { // Read each line from the file
+        execute(parser.parse(line), world, outputFile);
+        commands++;
+    }
+    return commands;
+}
+
+#endif //FANTASY_SCENARIO_H
@@ -0,0 +1,275 @@
+//
+// Overview: long-running server mode.
+//
+// The simulator listens on a Unix domain socket, or reads stdin and writes
+// stdout, and keeps a world per session (connection). Every line is a command
+// (there is no header line); it is executed as soon as it arrives, and the
+// narration of everything that arrived in one read goes back in one write.
+// The narration is the same text a file run writes, so a command that
+// narrates nothing (a blank line, an unknown Create) sends nothing back.
+//
+// One thread serves all sessions with an epoll loop; sockets are non-blocking
+// and a slow reader only holds up its own session: once MAX_PENDING bytes of
+// its narration are waiting, the server stops reading its commands until they
+// have gone out. SIGINT and SIGTERM stop the server cleanly.
+//
+
+#ifndef FANTASY_SERVER_H
+#define FANTASY_SERVER_H
+
+#include "csignal"
+#include "cstddef"
+#include "cstdint"
+#include "cstring"
+#include "iostream"
+#include "memory"
+#include "string"
+#include "string_view"
+#include "unordered_map"
+#include "vector"
+
+#include <cerrno>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "parser.h"
+
+
+// Set from a signal handler to stop the server
+inline volatile std::sig_atomic_t serverStopRequested = 0;
+
+// Stop the server on SIGINT and SIGTERM. The handlers are installed without
+// SA_RESTART, so a blocking read() returns EINTR and the flag gets checked.
+inline void stopServerOnSignals() {
+    struct sigaction action {};
+    action.sa_handler = [](int) { serverStopRequested = 1; };
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+}
+
+// One client and its world
+template<typename W>
+class ServerSession {
+public:
+    static constexpr std::size_t READ_SIZE = 64 << 10;
+    static constexpr std::size_t MAX_LINE = 1 << 20;   // A longer line ends the session
+    static constexpr std::size_t MAX_PENDING = 4 << 20; // No commands are read while more narration waits
+
+private:
+    std::unique_ptr<W> world = std::make_unique<W>();
+    CommandParser parser{&world->names};
+    std::vector<char> input;            // Received, not yet executed; never holds a whole line
+    MemoryTarget narration;             // Produced, not yet sent
+    OutputSink outputFile{narration, SinkOptions{READ_SIZE, 1, FlushPolicy::Close}};
+    std::size_t sent = 0;               // Part of the narration already sent
+    bool finished = false;              // The client has stopped sending
+
+public:
+    std::uint32_t watched = EPOLLIN | EPOLLRDHUP;   // Events the server waits for on the session's socket
+
+private:
+
+    void run(std::string_view line) {
+        execute(parser.parse(line), *world, outputFile);
+    }
+
+public:
+    // Execute the complete lines of data (and with last, what is left as the
+    // final line). False if a line is too long.
+    bool receive(const char* data, std::size_t size, bool last) {
+        std::size_t start = 0;
+        while (const void* found = std::memchr(data + start, '\n', size - start)) {
+            std::size_t end = static_cast<const char*>(found) - data;
+            if (input.empty()) {
+                run(std::string_view(data + start, end - start));
+            }
+            else {
+                input.insert(input.end(), data + start, data + end);
+                run(std::string_view(input.data(), input.size()));
+                input.clear();
+            }
+            start = end + 1;
+        }
+        input.insert(input.end(), data + start, data + size);
+        if (last && !input.empty()) {   // Last line without a trailing '\n'
+            run(std::string_view(input.data(), input.size()));
+            input.clear();
+        }
+        finished = finished || last;
+        outputFile.flush();
+        return input.size() <= MAX_LINE;
+    }
+
+    bool isFinished() const {
+        return finished;
+    }
+
+    // Whether the client should be sent its narration before more commands are read
+    bool isBacklogged() const {
+        return narration.str().size() - sent > MAX_PENDING;
+    }
+
+    // Narration not sent yet
+    std::string_view pending() const {
+        return std::string_view(narration.str()).substr(sent);
+    }
+    void consume(std::size_t bytes) {
+        sent += bytes;
+        if (sent == narration.str().size()) {
+            narration.clear();
+            sent = 0;
+        }
+    }
+};
+
+// Serve one session on a pair of blocking descriptors (stdin and stdout) until
+// the input ends
+template<typename W>
+void serveStream(int in, int out) {
+    auto session = std::make_unique<ServerSession<W>>();
+    std::vector<char> buffer(ServerSession<W>::READ_SIZE);
+    while (!serverStopRequested) {
+        ssize_t got = ::read(in, buffer.data(), buffer.size());
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        bool last = got <= 0;
+        if (!session->receive(buffer.data(), last ? 0 : static_cast<std::size_t>(got), last)) {
+            break;
+        }
+        std::string_view text = session->pending();
+        struct iovec part = {const_cast<char*>(text.data()), text.size()};
+        FdTarget(out).write(&part, 1);
+        session->consume(text.size());
+        if (last) {
+            break;
+        }
+    }
+}
+
+// Listen on a Unix domain socket at path and serve every connection with a
+// world of its own, until SIGINT or SIGTERM. Returns false if the socket
+// cannot be set up.
+template<typename W>
+bool serveSocket(const std::string& path, std::ostream& errors) {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        errors << "serve: socket path too long: " << path << "\n";
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ::unlink(path.c_str());     // A socket left over from an earlier run
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listener, SOMAXCONN) != 0) {
+        errors << "serve: cannot listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        return false;
+    }
+    int poller = ::epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = listener;
+    ::epoll_ctl(poller, EPOLL_CTL_ADD, listener, &event);
+
+    std::unordered_map<int, std::unique_ptr<ServerSession<W>>> sessions;
+    std::vector<char> buffer(ServerSession<W>::READ_SIZE);
+    auto close = [&](int fd) {
+        ::epoll_ctl(poller, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        sessions.erase(fd);
+    };
+    // Send what the socket takes; if something is left, wait for it to drain.
+    // False once the session is over: hung up, or finished with nothing left to send.
+    auto flush = [&](int fd, ServerSession<W>& session) {
+        std::string_view text = session.pending();
+        while (!text.empty()) {
+            ssize_t written = ::send(fd, text.data(), text.size(), MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return false;
+            }
+            session.consume(static_cast<std::size_t>(written));
+            text = session.pending();
+        }
+        if (session.isFinished() && text.empty()) {
+            return false;
+        }
+        bool reading = !session.isFinished() && !session.isBacklogged();
+        std::uint32_t wanted = (reading ? static_cast<std::uint32_t>(EPOLLIN | EPOLLRDHUP) : std::uint32_t(0))
+                | (text.empty() ? std::uint32_t(0) : static_cast<std::uint32_t>(EPOLLOUT));
+        if (wanted != session.watched) {
+            epoll_event change {};
+            change.events = wanted;
+            change.data.fd = fd;
+            ::epoll_ctl(poller, EPOLL_CTL_MOD, fd, &change);
+            session.watched = wanted;
+        }
+        return true;
+    };
+
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    while (!serverStopRequested) {
+        int ready = ::epoll_wait(poller, events, MAX_EVENTS, -1);
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listener) {
+                int client;
+                while ((client = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    epoll_event added {};
+                    added.events = EPOLLIN | EPOLLRDHUP;
+                    added.data.fd = client;
+                    ::epoll_ctl(poller, EPOLL_CTL_ADD, client, &added);
+                    sessions.emplace(client, std::make_unique<ServerSession<W>>());
+                }
+                continue;
+            }
+            auto found = sessions.find(fd);
+            if (found == sessions.end()) {
+                continue;
+            }
+            ServerSession<W>& session = *found->second;
+            if ((events[i].events & EPOLLOUT) && !flush(fd, session)) {
+                close(fd);
+                continue;
+            }
+            if (!session.isFinished() && !session.isBacklogged() && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                ssize_t got = ::recv(fd, buffer.data(), buffer.size(), 0);
+                if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    continue;
+                }
+                bool last = got <= 0;   // Once the client is done sending, the rest goes out and the session ends
+                if (!session.receive(buffer.data(), last ? 0 : static_cast<std::size_t>(got), last)
+                        || !flush(fd, session)) {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    for (auto& entry : sessions) {
+        ::close(entry.first);
+    }
+    ::close(poller);
+    ::close(listener);
+    ::unlink(path.c_str());
+    return true;
+}
+
+#endif //FANTASY_SERVER_H
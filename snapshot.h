@@ -0,0 +1,255 @@
+//
+// Overview: world snapshots and resuming a scenario from one.
+//
+// A snapshot holds the whole state of a world in a form both engines share:
+// the name table in id order, then every living character in name order with
+// its class, HP and inventory (items in name order, the capacity each section
+// has used up, spell victims). It also records where the scenario stood: the
+// input offset of the next line, the narration bytes written so far and the
+// number of commands executed. Every engine provides
+//     void saveState(const W&, SnapshotWriter&);
+//     bool loadState(W&, SnapshotReader&);
+// Words are 32 bits in host byte order.
+//
+
+#ifndef FANTASY_SNAPSHOT_H
+#define FANTASY_SNAPSHOT_H
+
+#include "csignal"
+#include "cstddef"
+#include "cstdint"
+#include "cstdio"
+#include "cstring"
+#include "iostream"
+#include "string"
+#include "string_view"
+#include "vector"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "output.h"
+#include "parser.h"
+#include "symbols.h"
+
+
+const std::uint32_t SNAPSHOT_MAGIC = 0x504e5346;    // "FSNP" on a little-endian host
+const std::uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    std::uint32_t magic;            // SNAPSHOT_MAGIC
+    std::uint32_t version;          // SNAPSHOT_VERSION
+    std::uint32_t nameCount;        // Entries of the name table
+    std::uint32_t nameBytes;        // Text of the name table
+    std::uint64_t stateWords;       // Size of the character records
+    std::uint64_t inputOffset;      // Input offset of the next command
+    std::uint64_t outputOffset;     // Narration bytes written before it
+    std::uint64_t commands;         // Commands executed before it
+};
+
+// Where the scenario stands when a snapshot is taken
+struct SnapshotPosition {
+    unsigned long long inputOffset = 0;
+    unsigned long long outputOffset = 0;
+    unsigned long long commands = 0;
+};
+
+// Set from a signal handler to ask for a snapshot after the current command
+inline volatile std::sig_atomic_t snapshotRequested = 0;
+
+// Collects a snapshot and writes it out
+class SnapshotWriter {
+private:
+    std::vector<std::uint32_t> state;   // Character records
+    const SymbolTable* names = nullptr;
+
+public:
+    void putNames(const SymbolTable& table) {
+        names = &table;
+    }
+    void put(std::uint32_t word) {
+        state.push_back(word);
+    }
+    void putInt(int value) {
+        state.push_back(static_cast<std::uint32_t>(value));
+    }
+
+    // Write the snapshot to path, replacing the old one only once the new one
+    // is complete. Returns false on failure.
+    bool save(const std::string& path, const SnapshotPosition& position) const {
+        SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, 0, state.size(),
+                                 position.inputOffset, position.outputOffset, position.commands};
+        std::vector<std::uint32_t> lengths;
+        if (names != nullptr) {
+            for (NameId id = 0; id < names->size(); id++) {
+                lengths.push_back(static_cast<std::uint32_t>(names->name(id).size()));
+                header.nameBytes += lengths.back();
+            }
+        }
+        header.nameCount = static_cast<std::uint32_t>(lengths.size());
+
+        std::string temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        FdTarget target(fd);
+        {
+            OutputSink out(target);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(lengths.data()), lengths.size() * sizeof(std::uint32_t));
+            for (NameId id = 0; id < header.nameCount; id++) {
+                out << names->name(id);
+            }
+            const char zeros[4] = {0, 0, 0, 0};
+            out.write(zeros, (4 - header.nameBytes % 4) % 4);
+            out.write(reinterpret_cast<const char*>(state.data()), state.size() * sizeof(std::uint32_t));
+        }   // Flushed here
+        bool complete = target.close() && ::fsync(fd) == 0;    // The descriptor stays open: it is not the target's
+        ::close(fd);
+        if (complete && std::rename(temporary.c_str(), path.c_str()) == 0) {
+            return true;
+        }
+        ::unlink(temporary.c_str());    // The last good snapshot stays as it was
+        return false;
+    }
+};
+
+// Reads a snapshot back
+class SnapshotReader {
+private:
+    std::vector<char> file;     // The whole snapshot
+    SnapshotHeader header = {};
+    const std::uint32_t* nameLengths = nullptr;
+    const char* nameText = nullptr;
+    const std::uint32_t* next = nullptr;    // Next word of the character records
+    const std::uint32_t* end = nullptr;
+
+public:
+    // Read a snapshot; is_open() tells whether it is a valid one
+    explicit SnapshotReader(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info {};
+        if (fstat(fd, &info) == 0) {
+            file.resize(static_cast<std::size_t>(info.st_size));
+            std::size_t got = 0;
+            while (got < file.size()) {
+                ssize_t chunk = ::read(fd, file.data() + got, file.size() - got);
+                if (chunk <= 0) {
+                    break;
+                }
+                got += static_cast<std::size_t>(chunk);
+            }
+            file.resize(got);
+        }
+        ::close(fd);
+        if (file.size() < sizeof(header)) {
+            file.clear();
+            return;
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+        std::size_t namesEnd = sizeof(header) + std::size_t(header.nameCount) * sizeof(std::uint32_t)
+                + header.nameBytes + (4 - header.nameBytes % 4) % 4;
+        if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION
+                || namesEnd + header.stateWords * sizeof(std::uint32_t) != file.size()) {
+            file.clear();
+            return;
+        }
+        // The file buffer comes from operator new, so the words are aligned
+        nameLengths = reinterpret_cast<const std::uint32_t*>(file.data() + sizeof(header));
+        nameText = file.data() + sizeof(header) + std::size_t(header.nameCount) * sizeof(std::uint32_t);
+        next = reinterpret_cast<const std::uint32_t*>(file.data() + namesEnd);
+        end = next + header.stateWords;
+    }
+
+    bool is_open() const {
+        return !file.empty();
+    }
+    SnapshotPosition getPosition() const {
+        return SnapshotPosition{header.inputOffset, header.outputOffset, header.commands};
+    }
+
+    // Intern the name table in order, so ids match the records
+    void loadNames(SymbolTable& names) const {
+        const char* text = nameText;
+        for (std::uint32_t i = 0; i < header.nameCount; i++) {
+            names.intern(std::string_view(text, nameLengths[i]));
+            text += nameLengths[i];
+        }
+    }
+    std::uint32_t nameCount() const {
+        return header.nameCount;
+    }
+
+    bool atEnd() const {
+        return next == end;
+    }
+    // Next word; false once the records run out
+    bool get(std::uint32_t& word) {
+        if (next == end) {
+            return false;
+        }
+        word = *next++;
+        return true;
+    }
+    bool getInt(int& value) {
+        std::uint32_t word;
+        if (!get(word)) {
+            return false;
+        }
+        value = static_cast<int>(word);
+        return true;
+    }
+};
+
+// Where and how often snapshots are taken
+struct SnapshotOptions {
+    std::string path;               // Snapshot file, empty for none
+    unsigned long long every = 0;   // Commands between snapshots, 0 for only on request (SIGUSR1)
+};
+
+// Take a snapshot of the world as it stands
+template<typename W>
+bool takeSnapshot(const W &world, OutputSink &outputFile, const SnapshotPosition& position,
+                  const std::string& path) {
+    outputFile.flush();     // The narration up to the snapshot must be in the file to resume from it
+    SnapshotWriter writer;
+    writer.putNames(world.names);
+    saveState(world, writer);
+    return writer.save(path, position);
+}
+
+// Run the rest of a scenario from where the input stands, taking snapshots
+// on the way. start is the position the input stands at, whose narration is
+// already written; outputFile has taken nothing yet. Returns the number of commands executed by this call.
+template<typename W>
+unsigned long long runWithSnapshots(InputReader &inputFile, W &world, OutputSink &outputFile,
+                                    const SnapshotOptions& options, SnapshotPosition start) {
+    CommandParser parser(&world.names);
+    std::string_view line;
+    unsigned long long commands = 0;
+    unsigned long long sinceSnapshot = 0;
+
+    while (inputFile.nextLine(line)) {
+        execute(parser.parse(line), world, outputFile);
+        commands++;
+        sinceSnapshot++;
+        if (!options.path.empty() && ((options.every != 0 && sinceSnapshot == options.every) || snapshotRequested)) {
+            SnapshotPosition position = {inputFile.offset(), start.outputOffset + outputFile.bytesWritten(),
+                                         start.commands + commands};
+            if (!takeSnapshot(world, outputFile, position, options.path)) {
+                std::cerr << "snapshot: cannot write " << options.path << "\n";
+            }
+            snapshotRequested = 0;
+            sinceSnapshot = 0;
+        }
+    }
+    return commands;
+}
+
+#endif //FANTASY_SNAPSHOT_H
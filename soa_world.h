@@ -0,0 +1,982 @@
+//
+// Overview: structure-of-arrays storage engine.
+//
+// Same commands and narration as the object engine in main.cpp, but the world
+// is kept in flat arrays: hit points, types and names of the characters sit in
+// parallel vectors indexed by slot, inventories are fixed strides of item handles,
+// and weapons, potions and spells live in per-kind pools addressed by handle.
+// Selected with --engine soa.
+//
+
+#ifndef FANTASY_SOA_WORLD_H
+#define FANTASY_SOA_WORLD_H
+
+#include "algorithm"
+#include "charconv"
+#include "cstdint"
+#include "string"
+#include "string_view"
+#include "vector"
+
+#include "bulk.h"
+#include "character_traits.h"
+#include "hp_index.h"
+#include "journal.h"
+#include "narration.h"
+#include "output.h"
+#include "parser.h"
+#include "snapshot.h"
+#include "symbols.h"
+
+
+class SoaWorld {
+public:
+    using Slot = std::uint32_t;
+    using Handle = std::uint32_t;
+    static constexpr Slot NO_SLOT = UINT32_MAX;
+
+    // Item kinds, also the index of the inventory section
+    enum ItemKind { WEAPON = 0, POTION = 1, SPELL = 2 };
+
+    // Stride of every inventory section: the largest capacity of any character class
+    static constexpr int MAX_WEAPONS = CharacterClasses::MAX_GUNS;
+    static constexpr int MAX_POTIONS = CharacterClasses::MAX_POTIONS;
+    static constexpr int MAX_SPELLS = CharacterClasses::MAX_SPELLS;
+    static constexpr int INVENTORY_STRIDE = MAX_WEAPONS + MAX_POTIONS + MAX_SPELLS;
+
+    SymbolTable names;  // Interned character and item names
+    BulkScratch<Slot> scratch;  // Buffers of the area-of-effect commands
+    JournalWriter* journal = nullptr;   // Where the changes are recorded, if anywhere
+
+    // Weapons and potions: a name and a value per handle
+    struct ValuePool {
+        std::vector<NameId> name;
+        std::vector<int> value;
+        std::vector<Handle> freeHandles;
+
+        Handle add(NameId itemName, int itemValue) {
+            if (!freeHandles.empty()) {
+                Handle handle = freeHandles.back();
+                freeHandles.pop_back();
+                name[handle] = itemName;
+                value[handle] = itemValue;
+                return handle;
+            }
+            name.push_back(itemName);
+            value.push_back(itemValue);
+            return static_cast<Handle>(name.size() - 1);
+        }
+        void remove(Handle handle) {
+            freeHandles.push_back(handle);
+        }
+    };
+
+    // Spells: a name and a range of victims in one shared array per handle
+    struct SpellPool {
+        static constexpr int ROOM_CLASSES = 9;      // Victim rooms 0, 1, 2-3, 4-7, ..., 128-255
+
+        std::vector<NameId> name;
+        std::vector<std::uint32_t> victimStart;     // First victim in victims
+        std::vector<std::uint8_t> victimCount;      // Number of victims
+        std::vector<std::uint8_t> victimRoom;       // Victims the range can hold when reused
+        std::vector<NameId> victims;                // Victim names of all spells, sorted per spell
+        std::vector<Handle> freeHandles[ROOM_CLASSES];  // Freed spells by the power of two of their room
+
+        // Room class of a victim count: the number of bits it takes
+        static int roomClass(unsigned room) {
+            int bits = 0;
+            for (; room != 0; room >>= 1) {
+                bits++;
+            }
+            return bits;
+        }
+
+        Handle add(NameId spellName, const std::vector<NameId>& spellVictims) {
+            auto count = static_cast<std::uint8_t>(spellVictims.size());
+            // Reuse the newest freed spell whose room is big enough: the one on top of
+            // the count's own class if it fits, or else any of a class with more room
+            int own = roomClass(count);
+            for (int room = own; room < ROOM_CLASSES; room++) {
+                std::vector<Handle>& candidates = freeHandles[room];
+                if (!candidates.empty() && (room > own || victimRoom[candidates.back()] >= count)) {
+                    Handle handle = candidates.back();
+                    candidates.pop_back();
+                    name[handle] = spellName;
+                    victimCount[handle] = count;
+                    std::copy(spellVictims.begin(), spellVictims.end(), victims.begin() + victimStart[handle]);
+                    return handle;
+                }
+            }
+            name.push_back(spellName);
+            victimStart.push_back(static_cast<std::uint32_t>(victims.size()));
+            victimCount.push_back(count);
+            victimRoom.push_back(count);
+            victims.insert(victims.end(), spellVictims.begin(), spellVictims.end());
+            return static_cast<Handle>(name.size() - 1);
+        }
+        void remove(Handle handle) {
+            freeHandles[roomClass(victimRoom[handle])].push_back(handle);
+        }
+        void clear() {
+            name.clear();
+            victimStart.clear();
+            victimCount.clear();
+            victimRoom.clear();
+            victims.clear();
+            for (std::vector<Handle>& candidates : freeHandles) {
+                candidates.clear();
+            }
+        }
+        bool hasVictim(Handle handle, NameId victim) const {
+            auto first = victims.begin() + victimStart[handle];
+            return std::binary_search(first, first + victimCount[handle], victim);
+        }
+    };
+private:
+    // Characters, one entry per slot
+    std::vector<int> hp;                    // Hit points
+    std::vector<std::uint8_t> type;         // Class id in CharacterClasses
+    std::vector<NameId> nameOf;             // Name of the character in the slot
+    std::vector<Handle> inventory;          // INVENTORY_STRIDE item handles per slot, each section in name order
+    std::vector<std::uint8_t> held;         // Items actually in each section, 3 per slot
+    std::vector<std::uint8_t> used;         // Capacity used by each section, 3 per slot
+    std::vector<Slot> freeSlots;            // Slots of dead characters, reused first
+
+    std::vector<Slot> slotOf;               // Slot of the living character with a name, by name id
+    std::vector<Slot> order;                // Living characters in name order
+
+    std::string rosterText;                 // Rendered Show characters line
+    bool rosterDirty = true;                // Whether a character came, went or changed HP since it was rendered
+    HitPointIndex hpIndex{names};           // Living characters by HP, once asked for
+
+    ValuePool weapons;
+    ValuePool potions;
+
+    SpellPool spells;
+
+    static int sectionStart(int kind) {
+        return kind == WEAPON ? 0 : kind == POTION ? MAX_WEAPONS : MAX_WEAPONS + MAX_POTIONS;
+    }
+    Handle* section(Slot slot, int kind) {
+        return inventory.data() + static_cast<std::size_t>(slot) * INVENTORY_STRIDE + sectionStart(kind);
+    }
+    const Handle* section(Slot slot, int kind) const {
+        return inventory.data() + static_cast<std::size_t>(slot) * INVENTORY_STRIDE + sectionStart(kind);
+    }
+    NameId itemName(int kind, Handle handle) const {
+        return kind == WEAPON ? weapons.name[handle] : kind == POTION ? potions.name[handle] : spells.name[handle];
+    }
+
+public:
+    SoaWorld() = default;
+    SoaWorld(const SoaWorld&) = delete;
+    SoaWorld& operator=(const SoaWorld&) = delete;
+
+    // Forget the whole scenario in one go, keeping the memory for the next one
+    void clear() {
+        hp.clear();
+        type.clear();
+        nameOf.clear();
+        inventory.clear();
+        held.clear();
+        used.clear();
+        freeSlots.clear();
+        slotOf.clear();
+        order.clear();
+        rosterText.clear();
+        rosterDirty = true;
+        hpIndex.clear();
+        for (ValuePool* pool : {&weapons, &potions}) {
+            pool->name.clear();
+            pool->value.clear();
+            pool->freeHandles.clear();
+        }
+        spells.clear();
+        names.clear();
+    }
+
+    // Slot of the living character with this name, NO_SLOT if there is none
+    Slot find(NameId id) const {
+        return id < slotOf.size() ? slotOf[id] : NO_SLOT;
+    }
+
+    // Add a character, false if the name is already taken
+    bool add(NameId id, int typeIndex, int hitPoints) {
+        if (id >= slotOf.size()) {
+            slotOf.resize(names.size(), NO_SLOT);
+        }
+        if (slotOf[id] != NO_SLOT) {
+            return false;
+        }
+        Slot slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            hp[slot] = hitPoints;
+            type[slot] = static_cast<std::uint8_t>(typeIndex);
+            nameOf[slot] = id;
+        }
+        else {
+            slot = static_cast<Slot>(hp.size());
+            hp.push_back(hitPoints);
+            type.push_back(static_cast<std::uint8_t>(typeIndex));
+            nameOf.push_back(id);
+            inventory.resize(inventory.size() + INVENTORY_STRIDE);
+            held.resize(held.size() + 3);
+            used.resize(used.size() + 3);
+        }
+        std::fill(held.begin() + slot * 3, held.begin() + slot * 3 + 3, 0);
+        std::fill(used.begin() + slot * 3, used.begin() + slot * 3 + 3, 0);
+        slotOf[id] = slot;
+        std::string_view name = names.name(id);
+        auto place = std::lower_bound(order.begin(), order.end(), name, [this](Slot a, std::string_view b) {
+            return names.name(nameOf[a]) < b;
+        });
+        order.insert(place, slot);
+        rosterDirty = true;
+        if (hpIndex.isBuilt()) {
+            hpIndex.add(id, typeIndex, hitPoints);
+        }
+        if (journal != nullptr) {
+            journal->arrive(id, typeIndex, hitPoints);
+        }
+        return true;
+    }
+
+private:
+    // Free the items of a dead character
+    void freeItems(Slot slot) {
+        for (int kind = WEAPON; kind <= SPELL; kind++) {
+            const Handle* items = section(slot, kind);
+            for (int i = 0; i < held[slot * 3 + kind]; i++) {
+                if (kind == WEAPON) {
+                    weapons.remove(items[i]);
+                }
+                else if (kind == POTION) {
+                    potions.remove(items[i]);
+                }
+                else {
+                    spells.remove(items[i]);
+                }
+            }
+        }
+    }
+
+public:
+    // Remove a dead character and free its items
+    void remove(Slot slot) {
+        freeItems(slot);
+        std::string_view name = names.name(nameOf[slot]);
+        auto place = std::lower_bound(order.begin(), order.end(), name, [this](Slot a, std::string_view b) {
+            return names.name(nameOf[a]) < b;
+        });
+        order.erase(place);
+        rosterDirty = true;
+        if (hpIndex.isBuilt()) {
+            hpIndex.remove(nameOf[slot]);
+        }
+        if (journal != nullptr) {
+            journal->depart(nameOf[slot]);
+        }
+        slotOf[nameOf[slot]] = NO_SLOT;
+        freeSlots.push_back(slot);
+    }
+
+    // Remove several dead characters (distinct slots) with one pass over the name order
+    void removeAll(const Slot* slots, std::size_t count) {
+        if (count < 2) {
+            if (count == 1) {
+                remove(slots[0]);
+            }
+            return;
+        }
+        for (std::size_t i = 0; i < count; i++) {
+            freeItems(slots[i]);
+            if (hpIndex.isBuilt()) {
+                hpIndex.remove(nameOf[slots[i]]);
+            }
+            if (journal != nullptr) {
+                journal->depart(nameOf[slots[i]]);
+            }
+            slotOf[nameOf[slots[i]]] = NO_SLOT;
+            freeSlots.push_back(slots[i]);
+        }
+        order.erase(std::remove_if(order.begin(), order.end(), [this](Slot slot) {
+            return slotOf[nameOf[slot]] != slot;
+        }), order.end());
+        rosterDirty = true;
+    }
+
+    int getHP(Slot slot) const {
+        return hp[slot];
+    }
+    void changeHP(Slot slot, int delta) {
+        hp[slot] += delta;
+        rosterDirty = true;
+        if (hpIndex.isBuilt()) {
+            hpIndex.update(nameOf[slot], hp[slot]);
+        }
+        if (journal != nullptr) {
+            journal->setHP(nameOf[slot], hp[slot]);
+        }
+    }
+    // Change the HP of several characters (distinct slots) at once; died[i]
+    // tells whether slots[i] is left at 0 or below (see addHitPoints)
+    void changeHP(const Slot* slots, std::size_t count, int delta, std::uint8_t* died) {
+        addHitPoints(hp.data(), slots, count, delta, died);
+        rosterDirty = true;
+        if (hpIndex.isBuilt()) {
+            for (std::size_t i = 0; i < count; i++) {
+                hpIndex.update(nameOf[slots[i]], hp[slots[i]]);
+            }
+        }
+        if (journal != nullptr) {
+            for (std::size_t i = 0; i < count; i++) {
+                journal->setHP(nameOf[slots[i]], hp[slots[i]]);
+            }
+        }
+    }
+    std::string_view getType(Slot slot) const {
+        return CharacterClasses::INFO[type[slot]].name;
+    }
+    std::string_view getName(Slot slot) const {
+        return names.name(nameOf[slot]);
+    }
+    NameId getNameId(Slot slot) const {
+        return nameOf[slot];
+    }
+    int getClass(Slot slot) const {
+        return type[slot];
+    }
+    const std::vector<Slot>& getOrder() const {
+        return order;
+    }
+
+    // The Show characters line, "name:type:hp " per character and a newline.
+    // It is rendered again only after something in it changed.
+    std::string_view getRosterLine() {
+        if (rosterDirty) {
+            rosterText.clear();
+            char digits[16];
+            for (Slot slot : order) {
+                rosterText.append(getName(slot)).append(1, ':').append(getType(slot)).append(1, ':');
+                auto result = std::to_chars(digits, digits + sizeof(digits), hp[slot]);
+                rosterText.append(digits, result.ptr).append(1, ' ');
+            }
+            rosterText.append(1, '\n');
+            rosterDirty = false;
+        }
+        return rosterText;
+    }
+
+    // The hit point index, built on first use
+    const HitPointIndex& getHitPointIndex() {
+        if (!hpIndex.isBuilt()) {
+            hpIndex.build([this](auto&& add) {
+                for (Slot slot : order) {
+                    add(nameOf[slot], type[slot], hp[slot]);
+                }
+            });
+        }
+        return hpIndex;
+    }
+
+    int getMaxSize(Slot slot, int kind) const {
+        return CharacterClasses::INFO[type[slot]].capacity[kind];
+    }
+    int getRemainingSize(Slot slot, int kind) const {
+        return getMaxSize(slot, kind) - used[slot * 3 + kind];
+    }
+    int getHeld(Slot slot, int kind) const {
+        return held[slot * 3 + kind];
+    }
+    const Handle* getItems(Slot slot, int kind) const {
+        return section(slot, kind);
+    }
+
+    // Find an item of a character by name, returns its position in the section or -1
+    int findItem(Slot slot, int kind, NameId item) const {
+        const Handle* items = section(slot, kind);
+        for (int i = 0; i < held[slot * 3 + kind]; i++) {
+            if (itemName(kind, items[i]) == item) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Put a new item into a section, keeping it in name order;
+    // an item with the same name is replaced but still takes up capacity
+    void addItem(Slot slot, int kind, Handle handle) {
+        Handle* items = section(slot, kind);
+        int count = held[slot * 3 + kind];
+        NameId id = itemName(kind, handle);
+        std::string_view name = names.name(id);
+        int i = 0;
+        while (i < count && names.name(itemName(kind, items[i])) < name) {
+            i++;
+        }
+        if (i < count && itemName(kind, items[i]) == id) {
+            if (kind == WEAPON) {
+                weapons.remove(items[i]);
+            }
+            else if (kind == POTION) {
+                potions.remove(items[i]);
+            }
+            else {
+                spells.remove(items[i]);
+            }
+            items[i] = handle;
+        }
+        else {
+            std::copy_backward(items + i, items + count, items + count + 1);
+            items[i] = handle;
+            held[slot * 3 + kind]++;
+        }
+        used[slot * 3 + kind]++;
+        if (journal != nullptr) {
+            int value = kind == WEAPON ? weapons.value[handle] : kind == POTION ? potions.value[handle]
+                                                                                : spells.victimCount[handle];
+            journal->addItem(nameOf[slot], kind, id, value);
+        }
+    }
+
+    // Capacity used up by a section, as restored from a snapshot
+    void setUsed(Slot slot, int kind, int count) {
+        used[slot * 3 + kind] = static_cast<std::uint8_t>(count);
+    }
+
+    // Take the item at a position out of a section
+    void removeItem(Slot slot, int kind, int position) {
+        Handle* items = section(slot, kind);
+        int count = held[slot * 3 + kind];
+        if (journal != nullptr) {
+            journal->removeItem(nameOf[slot], kind, itemName(kind, items[position]));
+        }
+        std::copy(items + position + 1, items + count, items + position);
+        held[slot * 3 + kind]--;
+        used[slot * 3 + kind]--;
+    }
+
+    ValuePool& getWeapons() {
+        return weapons;
+    }
+    ValuePool& getPotions() {
+        return potions;
+    }
+    SpellPool& getSpells() {
+        return spells;
+    }
+    const ValuePool& getWeapons() const {
+        return weapons;
+    }
+    const ValuePool& getPotions() const {
+        return potions;
+    }
+    const SpellPool& getSpells() const {
+        return spells;
+    }
+};
+
+
+// Create character <type> <name> <hp>
+inline void createCharacter(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    std::string_view characterType = command.kind;
+    std::string_view characterName = world.names.name(command.actorId);
+    int characterHp = numberOf(command);
+
+    // HP check
+    if (!(1 <= characterHp && characterHp <= 200)) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    int typeIndex = CharacterClasses::indexOf(characterType);
+    if (typeIndex >= 0) {
+        world.add(command.actorId, typeIndex, characterHp);
+    }
+    INSTRUMENT_STAGE(Phase::Format);
+    narrateArrival(outputFile, characterType, characterName);
+}
+
+// Create item <weapon|potion|spell> <owner> <name> <value|len> [victims...]
+inline void createItem(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    std::string_view itemType = command.kind;
+    std::string_view itemName = world.names.name(command.objectId);
+
+    // Check owner of the item:
+    INSTRUMENT_STAGE(Phase::Lookup);
+    SoaWorld::Slot owner = world.find(command.actorId);
+    if (owner == SoaWorld::NO_SLOT) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+
+    switch (itemType.empty() ? '\0' : itemType[0]) {
+        case 'w':
+        case 'p': {
+            int kind = itemType[0] == 'w' ? SoaWorld::WEAPON : SoaWorld::POTION;
+            // Check availability:
+            if (world.getRemainingSize(owner, kind) == 0) {
+                outputFile << "Error caught\n";
+                return;
+            }
+            int value = numberOf(command);
+            // Check damage or heal:
+            if (!(1 <= value && value <= 50)) {
+                outputFile << "Error caught\n";
+                return;
+            }
+            SoaWorld::ValuePool& pool = kind == SoaWorld::WEAPON ? world.getWeapons() : world.getPotions();
+            world.addItem(owner, kind, pool.add(command.objectId, value));
+            break;
+        }
+        case 's': {
+            // Check availability:
+            if (world.getRemainingSize(owner, SoaWorld::SPELL) == 0) {
+                outputFile << "Error caught\n";
+                return;
+            }
+            int len = numberOf(command);
+            // Check len:
+            if (!(0 <= len && len <= 50)) {
+                outputFile << "Error caught\n";
+                return;
+            }
+            std::vector<NameId> victims;
+            for (int i = 0; i < len; i++) {
+                NameId victim = world.names.find(command.rest[i]);
+                if (world.find(victim) == SoaWorld::NO_SLOT) {
+                    outputFile << "Error caught\n";
+                    return;
+                }
+                victims.push_back(victim);
+            }
+            // A victim named twice counts once
+            std::sort(victims.begin(), victims.end());
+            victims.erase(std::unique(victims.begin(), victims.end()), victims.end());
+            world.addItem(owner, SoaWorld::SPELL, world.getSpells().add(command.objectId, victims));
+            break;
+        }
+        default:
+            outputFile << "oshibka\n";
+            break;
+    }
+    INSTRUMENT_STAGE(Phase::Format);
+    narrateNewItem(outputFile, command.actor, itemType, itemName);
+}
+
+// Show <characters|weapons|potions|spells> [name]
+inline void showSomething(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    std::string_view type = command.kind;
+    int kind;
+    if (isRankingShow(type)) {
+        INSTRUMENT_STAGE(Phase::Format);
+        world.getHitPointIndex().show(command, outputFile);
+        return;
+    }
+    switch (type.empty() ? '\0' : type[0]) {
+        case 'c': {
+            INSTRUMENT_STAGE(Phase::Format);
+            outputFile << world.getRosterLine();
+            return;
+        }
+        case 'w':
+            kind = SoaWorld::WEAPON;
+            break;
+        case 'p':
+            kind = SoaWorld::POTION;
+            break;
+        case 's':
+            kind = SoaWorld::SPELL;
+            break;
+        default:
+            return;
+    }
+    INSTRUMENT_STAGE(Phase::Lookup);
+    SoaWorld::Slot slot = world.find(command.actorId);
+    if (slot == SoaWorld::NO_SLOT || world.getMaxSize(slot, kind) == 0) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Format);
+    const SoaWorld::Handle* items = world.getItems(slot, kind);
+    for (int i = 0; i < world.getHeld(slot, kind); i++) {
+        if (kind == SoaWorld::SPELL) {
+            narrateListed(outputFile, world.names.name(world.getSpells().name[items[i]]),
+                          static_cast<unsigned long>(world.getSpells().victimCount[items[i]]));
+        }
+        else {
+            const SoaWorld::ValuePool& pool = kind == SoaWorld::WEAPON ? world.getWeapons() : world.getPotions();
+            narrateListed(outputFile, world.names.name(pool.name[items[i]]), pool.value[items[i]]);
+        }
+    }
+    outputFile << "\n";
+}
+
+// Attack, Cast and Drink
+inline void doAction(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    // Names check:
+    INSTRUMENT_STAGE(Phase::Lookup);
+    SoaWorld::Slot user = world.find(command.actorId);
+    SoaWorld::Slot target = world.find(command.targetId);
+    if (user == SoaWorld::NO_SLOT || target == SoaWorld::NO_SLOT) {
+        outputFile << "Error caught\n";
+        return;
+    }
+
+    switch (command.op) {
+        case Opcode::Attack: {
+            // Weapon name check:
+            int position = world.findItem(user, SoaWorld::WEAPON, command.objectId);
+            if (position < 0) {
+                outputFile << "Error caught\n";
+                return;
+            }
+            INSTRUMENT_STAGE(Phase::Mutate);
+            world.changeHP(target, -world.getWeapons().value[world.getItems(user, SoaWorld::WEAPON)[position]]);
+            INSTRUMENT_STAGE(Phase::Format);
+            narrateAttack(outputFile, command.actor, command.target, command.object);
+            // Check for death
+            if (world.getHP(target) <= 0) {
+                narrateDeath(outputFile, world.getName(target));
+                INSTRUMENT_STAGE(Phase::Mutate);
+                world.remove(target);
+            }
+            break;
+        }
+        case Opcode::Cast: {
+            // Spell name and victim check:
+            int position = world.findItem(user, SoaWorld::SPELL, command.objectId);
+            if (position < 0 || !world.getSpells().hasVictim(world.getItems(user, SoaWorld::SPELL)[position], command.targetId)) {
+                outputFile << "Error caught\n";
+                return;
+            }
+            INSTRUMENT_STAGE(Phase::Mutate);
+            world.getSpells().remove(world.getItems(user, SoaWorld::SPELL)[position]);
+            world.removeItem(user, SoaWorld::SPELL, position);
+            INSTRUMENT_STAGE(Phase::Format);
+            narrateCast(outputFile, command.actor, command.object, command.target);
+            narrateDeath(outputFile, command.target);
+            INSTRUMENT_STAGE(Phase::Mutate);
+            world.remove(target);
+            break;
+        }
+        case Opcode::Drink: {
+            // Potion name check:
+            int position = world.findItem(user, SoaWorld::POTION, command.objectId);
+            if (position < 0) {
+                outputFile << "Error caught\n";
+                return;
+            }
+            INSTRUMENT_STAGE(Phase::Mutate);
+            SoaWorld::Handle potion = world.getItems(user, SoaWorld::POTION)[position];
+            world.changeHP(target, world.getPotions().value[potion]);
+            world.getPotions().remove(potion);
+            world.removeItem(user, SoaWorld::POTION, position);
+            INSTRUMENT_STAGE(Phase::Format);
+            narrateDrink(outputFile, command.target, command.object, command.actor);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Volley <attacker> <weapon> <count> <targets...>: the same as count Attack
+// lines, one per target. When the targets are distinct and the attacker is
+// not one of them no hit depends on another, so they all land in one pass.
+inline void doVolley(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    std::size_t count;
+    if (!bulkCount(command, count)) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Lookup);
+    BulkScratch<SoaWorld::Slot>& scratch = world.scratch;
+    SoaWorld::Slot user = world.find(command.actorId);
+    int position = user == SoaWorld::NO_SLOT ? -1 : world.findItem(user, SoaWorld::WEAPON, command.objectId);
+    scratch.named.resize(count);
+    scratch.found.clear();
+    for (std::size_t i = 0; i < count; i++) {
+        scratch.named[i] = world.find(world.names.find(command.rest[i]));
+        if (scratch.named[i] != SoaWorld::NO_SLOT) {
+            scratch.found.push_back(scratch.named[i]);
+        }
+    }
+    scratch.found.push_back(user);
+    bool distinct = position >= 0 && allDistinct(scratch.found, scratch.keys);
+    scratch.found.pop_back();
+    if (!distinct) {
+        // No weapon to hit with, or hits on the same character: one Attack at a time
+        Command single = command;
+        single.op = Opcode::Attack;
+        single.rest = TokenSpan();
+        for (std::size_t i = 0; i < count; i++) {
+            single.target = command.rest[i];
+            single.targetId = world.names.find(single.target);
+            doAction(single, world, outputFile);
+        }
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    int damage = world.getWeapons().value[world.getItems(user, SoaWorld::WEAPON)[position]];
+    scratch.died.resize(scratch.found.size());
+    world.changeHP(scratch.found.data(), scratch.found.size(), -damage, scratch.died.data());
+    INSTRUMENT_STAGE(Phase::Format);
+    scratch.dead.clear();
+    for (std::size_t i = 0, k = 0; i < count; i++) {
+        if (scratch.named[i] == SoaWorld::NO_SLOT) {
+            outputFile << "Error caught\n";
+            continue;
+        }
+        narrateAttack(outputFile, command.actor, command.rest[i], command.object);
+        if (scratch.died[k++]) {
+            narrateDeath(outputFile, world.getName(scratch.named[i]));
+            scratch.dead.push_back(scratch.named[i]);
+        }
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    world.removeAll(scratch.dead.data(), scratch.dead.size());
+}
+
+// Unleash <caster> <spell>: the spell is cast on every one of its victims
+// still in town, and is used up once. The victims are in name id order: the
+// order their names first appeared in the scenario.
+inline void doUnleash(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    INSTRUMENT_STAGE(Phase::Lookup);
+    SoaWorld::Slot user = world.find(command.actorId);
+    int position = user == SoaWorld::NO_SLOT ? -1 : world.findItem(user, SoaWorld::SPELL, command.objectId);
+    if (position < 0) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    const SoaWorld::SpellPool& spells = world.getSpells();
+    SoaWorld::Handle spell = world.getItems(user, SoaWorld::SPELL)[position];
+    std::vector<SoaWorld::Slot>& victims = world.scratch.dead;
+    victims.clear();
+    for (int i = 0; i < spells.victimCount[spell]; i++) {
+        SoaWorld::Slot victim = world.find(spells.victims[spells.victimStart[spell] + i]);
+        if (victim != SoaWorld::NO_SLOT) {
+            victims.push_back(victim);
+        }
+    }
+    if (victims.empty()) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    world.getSpells().remove(spell);
+    world.removeItem(user, SoaWorld::SPELL, position);
+    INSTRUMENT_STAGE(Phase::Format);
+    for (SoaWorld::Slot victim : victims) {
+        narrateCast(outputFile, command.actor, command.object, world.getName(victim));
+        narrateDeath(outputFile, world.getName(victim));
+    }
+    INSTRUMENT_STAGE(Phase::Mutate);
+    world.removeAll(victims.data(), victims.size());
+}
+
+// Share <supplier> <potion> <count> <drinkers...>: every drinker drinks the
+// potion, which is used up once. A drinker who is not in town gets "Error
+// caught" in their place; one named twice drinks twice.
+inline void doShare(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    std::size_t count;
+    if (!bulkCount(command, count)) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Lookup);
+    BulkScratch<SoaWorld::Slot>& scratch = world.scratch;
+    SoaWorld::Slot user = world.find(command.actorId);
+    int position = user == SoaWorld::NO_SLOT ? -1 : world.findItem(user, SoaWorld::POTION, command.objectId);
+    if (position < 0) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    scratch.named.resize(count);
+    scratch.found.clear();
+    for (std::size_t i = 0; i < count; i++) {
+        scratch.named[i] = world.find(world.names.find(command.rest[i]));
+        if (scratch.named[i] != SoaWorld::NO_SLOT) {
+            scratch.found.push_back(scratch.named[i]);
+        }
+    }
+    if (!scratch.found.empty()) {
+        INSTRUMENT_STAGE(Phase::Mutate);
+        SoaWorld::Handle potion = world.getItems(user, SoaWorld::POTION)[position];
+        int heal = world.getPotions().value[potion];
+        if (allDistinct(scratch.found, scratch.keys)) {
+            scratch.died.resize(scratch.found.size());     // Nobody dies of a potion
+            world.changeHP(scratch.found.data(), scratch.found.size(), heal, scratch.died.data());
+        }
+        else {
+            for (SoaWorld::Slot drinker : scratch.found) {
+                world.changeHP(drinker, heal);
+            }
+        }
+        world.getPotions().remove(potion);
+        world.removeItem(user, SoaWorld::POTION, position);
+    }
+    INSTRUMENT_STAGE(Phase::Format);
+    for (std::size_t i = 0; i < count; i++) {
+        if (scratch.named[i] == SoaWorld::NO_SLOT) {
+            outputFile << "Error caught\n";
+        }
+        else {
+            narrateDrink(outputFile, command.rest[i], command.object, command.actor);
+        }
+    }
+}
+
+// Dialogue <speaker> <len> <words...>
+inline void doChat(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    int len = numberOf(command);
+    if (!(len <= 10 && len >= 1) || command.rest.size() < static_cast<std::size_t>(len)) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Lookup);
+    if (command.actor != "Narrator" && world.find(command.actorId) == SoaWorld::NO_SLOT) {
+        outputFile << "Error caught\n";
+        return;
+    }
+    INSTRUMENT_STAGE(Phase::Format);
+    narrateSpeech(outputFile, command.actor, command.rest, len);
+}
+
+// Write the state of the world into a snapshot, in the layout shared with the object engine
+inline void saveState(const SoaWorld &world, SnapshotWriter &snapshot) {
+    const SoaWorld::SpellPool& spells = world.getSpells();
+    for (SoaWorld::Slot slot : world.getOrder()) {
+        snapshot.put(world.getNameId(slot));
+        snapshot.put(static_cast<std::uint32_t>(world.getClass(slot)));
+        snapshot.putInt(world.getHP(slot));
+        for (int kind = SoaWorld::WEAPON; kind <= SoaWorld::SPELL; kind++) {
+            const SoaWorld::Handle* items = world.getItems(slot, kind);
+            snapshot.putInt(world.getMaxSize(slot, kind) - world.getRemainingSize(slot, kind));
+            snapshot.put(static_cast<std::uint32_t>(world.getHeld(slot, kind)));
+            for (int i = 0; i < world.getHeld(slot, kind); i++) {
+                if (kind == SoaWorld::SPELL) {
+                    snapshot.put(spells.name[items[i]]);
+                    snapshot.put(spells.victimCount[items[i]]);
+                    for (int v = 0; v < spells.victimCount[items[i]]; v++) {
+                        snapshot.put(spells.victims[spells.victimStart[items[i]] + v]);
+                    }
+                }
+                else {
+                    const SoaWorld::ValuePool& pool = kind == SoaWorld::WEAPON ? world.getWeapons() : world.getPotions();
+                    snapshot.put(pool.name[items[i]]);
+                    snapshot.putInt(pool.value[items[i]]);
+                }
+            }
+        }
+    }
+}
+
+// Replace the world with the state stored in a snapshot, false if the snapshot is damaged
+inline bool loadState(SoaWorld &world, SnapshotReader &snapshot) {
+    world.clear();
+    snapshot.loadNames(world.names);
+    auto nameOk = [&](std::uint32_t id) {
+        return id < world.names.size();
+    };
+    while (!snapshot.atEnd()) {
+        std::uint32_t id, classIndex;
+        int hp;
+        if (!snapshot.get(id) || !snapshot.get(classIndex) || !snapshot.getInt(hp) || !nameOk(id)
+                || classIndex >= static_cast<std::uint32_t>(CharacterClasses::COUNT)
+                || !world.add(id, static_cast<int>(classIndex), hp)) {
+            return false;
+        }
+        SoaWorld::Slot slot = world.find(id);
+        for (int kind = SoaWorld::WEAPON; kind <= SoaWorld::SPELL; kind++) {
+            int used;
+            std::uint32_t held;
+            if (!snapshot.getInt(used) || !snapshot.get(held)
+                    || held > static_cast<std::uint32_t>(world.getMaxSize(slot, kind))) {
+                return false;
+            }
+            for (std::uint32_t i = 0; i < held; i++) {
+                std::uint32_t itemId;
+                if (!snapshot.get(itemId) || !nameOk(itemId)) {
+                    return false;
+                }
+                SoaWorld::Handle handle;
+                if (kind == SoaWorld::SPELL) {
+                    std::uint32_t count;
+                    if (!snapshot.get(count) || count > 50) {
+                        return false;
+                    }
+                    std::vector<NameId> victims(count);
+                    for (NameId& victim : victims) {
+                        if (!snapshot.get(victim) || !nameOk(victim)) {
+                            return false;
+                        }
+                    }
+                    handle = world.getSpells().add(itemId, victims);
+                }
+                else {
+                    int value;
+                    if (!snapshot.getInt(value)) {
+                        return false;
+                    }
+                    SoaWorld::ValuePool& pool = kind == SoaWorld::WEAPON ? world.getWeapons() : world.getPotions();
+                    handle = pool.add(itemId, value);
+                }
+                world.addItem(slot, kind, handle);
+            }
+            world.setUsed(slot, kind, used);
+        }
+    }
+    return true;
+}
+
+// Execute a parsed command against the structure-of-arrays world
+inline void execute(const Command &command, SoaWorld &world, OutputSink &outputFile) {
+    INSTRUMENT_COMMAND(commandTypeOf(command));
+    if (world.journal != nullptr) {
+        world.journal->beginCommand();
+    }
+    if (!command.complete) {
+        outputFile << "Error caught\n";
+        outputFile.endCommand();
+        return;
+    }
+    switch (command.op) {
+        case Opcode::CreateCharacter:
+            createCharacter(command, world, outputFile);
+            break;
+        case Opcode::CreateItem:
+            createItem(command, world, outputFile);
+            break;
+        case Opcode::Attack:
+        case Opcode::Cast:
+        case Opcode::Drink:
+            doAction(command, world, outputFile);
+            break;
+        case Opcode::Volley:
+            doVolley(command, world, outputFile);
+            break;
+        case Opcode::Unleash:
+            doUnleash(command, world, outputFile);
+            break;
+        case Opcode::Share:
+            doShare(command, world, outputFile);
+            break;
+        case Opcode::Dialogue:
+            doChat(command, world, outputFile);
+            break;
+        case Opcode::Show:
+            showSomething(command, world, outputFile);
+            break;
+        case Opcode::Unknown:
+            outputFile << "wrong command\n";
+            break;
+        default:
+            break;
+    }
+    outputFile.endCommand();
+}
+
+#endif //FANTASY_SOA_WORLD_H
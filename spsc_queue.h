@@ -0,0 +1,139 @@
+//
+// Overview: bounded single-producer single-consumer queue.
+//
+// A ring of slots with one atomic index per side. The producer only writes
+// the tail and the consumer only writes the head, so neither side ever takes
+// a lock; each side keeps a cached copy of the other's index and only reads
+// the shared one when the cached copy says the ring is full (or empty).
+//
+// A side that has to wait spins briefly, then yields, and after that parks on
+// a condition variable, so an idle stage (say the writer behind a slow disk)
+// does not keep a core busy. The other side only touches the mutex when
+// someone is parked.
+//
+
+#ifndef FANTASY_SPSC_QUEUE_H
+#define FANTASY_SPSC_QUEUE_H
+
+#include "atomic"
+#include "condition_variable"
+#include "cstddef"
+#include "mutex"
+#include "thread"
+#include "utility"
+#include "vector"
+
+
+template<typename T>
+class SpscQueue {
+private:
+    std::vector<T> slots;       // Ring storage, the size is a power of two
+    std::size_t mask;           // slots.size() - 1
+
+    alignas(64) std::atomic<std::size_t> head{0};   // Next slot to pop, written by the consumer
+    std::size_t cachedTail = 0;                     // Consumer's last look at tail
+    alignas(64) std::atomic<std::size_t> tail{0};   // Next slot to push, written by the producer
+    std::size_t cachedHead = 0;                     // Producer's last look at head
+
+    static constexpr unsigned SPINS = 64;       // Tries before yielding...
+    static constexpr unsigned YIELDS = 256;     // ...and yields before parking
+
+    std::mutex parkLock;                        // Held to park, and to wake a parked side
+    std::condition_variable parked;
+    std::atomic<unsigned> sleepers{0};          // Sides parked or about to park
+
+    // Wake the other side if it is parked; after every push and pop
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);    // Pairs with the one in backOff
+        if (sleepers.load(std::memory_order_relaxed) != 0) {
+            std::lock_guard<std::mutex> guard(parkLock);
+            parked.notify_all();
+        }
+    }
+
+    // Wait politely for the other side, until ready() may hold; the stages may
+    // share a core
+    template<typename Ready>
+    void backOff(unsigned& spins, Ready ready) {
+        if (++spins < SPINS) {
+            return;
+        }
+        if (spins < SPINS + YIELDS) {
+            std::this_thread::yield();
+            return;
+        }
+        std::unique_lock<std::mutex> lock(parkLock);
+        sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);    // ready() sees the item, or wake() sees us
+        parked.wait(lock, ready);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        spins = 0;
+    }
+
+public:
+    // Room for at least capacity items
+    explicit SpscQueue(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side: false if the queue is full
+    bool tryPush(T item) {
+        std::size_t at = tail.load(std::memory_order_relaxed);
+        if (at - cachedHead == slots.size()) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (at - cachedHead == slots.size()) {
+                return false;
+            }
+        }
+        slots[at & mask] = std::move(item);
+        tail.store(at + 1, std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    // Consumer side: false if the queue is empty
+    bool tryPop(T& item) {
+        std::size_t at = head.load(std::memory_order_relaxed);
+        if (at == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (at == cachedTail) {
+                return false;
+            }
+        }
+        item = std::move(slots[at & mask]);
+        head.store(at + 1, std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    // Producer side: wait for room
+    void push(T item) {
+        unsigned spins = 0;
+        while (!tryPush(item)) {
+            backOff(spins, [this] {
+                return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) != slots.size();
+            });
+        }
+    }
+
+    // Consumer side: wait for an item
+    T pop() {
+        T item;
+        unsigned spins = 0;
+        while (!tryPop(item)) {
+            backOff(spins, [this] {
+                return tail.load(std::memory_order_acquire) != head.load(std::memory_order_relaxed);
+            });
+        }
+        return item;
+    }
+};
+
+#endif //FANTASY_SPSC_QUEUE_H
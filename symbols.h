@@ -0,0 +1,141 @@
+//
+// Overview: symbol table for character and item names.
+//
+// Every distinct name is interned once and gets a dense integer id,
+// so the rest of the program compares and indexes names as integers.
+// Name text lives in a chunked arena and never moves, so the views
+// handed out by name() stay valid for the lifetime of the table.
+// Names are never freed, not even when the last character or item with that
+// name is gone: memory grows with the number of distinct names in a scenario.
+//
+
+#ifndef FANTASY_SYMBOLS_H
+#define FANTASY_SYMBOLS_H
+
+#include "algorithm"
+#include "cstdint"
+#include "cstring"
+#include "memory"
+#include "string_view"
+#include "vector"
+
+
+using NameId = std::uint32_t;
+const NameId NO_NAME = UINT32_MAX;  // Id of a name that was never interned
+
+class SymbolTable {
+private:
+    // Open addressing slot: the id of a name plus its hash, 0 hash marks an empty slot
+    struct Slot {
+        std::uint32_t hash;
+        NameId id;
+    };
+
+    static constexpr std::size_t CHUNK_SIZE = 64 << 10;
+
+    std::vector<Slot> slots;                        // Hash table, size is a power of two
+    std::vector<std::string_view> names;            // Name text by id
+    std::vector<std::unique_ptr<char[]>> chunks;    // Arena holding the text
+    std::size_t chunkUsed = CHUNK_SIZE;             // Bytes used in the last chunk
+
+    static std::uint32_t hashOf(std::string_view text) {
+        std::uint64_t hash = 14695981039346656037ull;   // FNV-1a
+        for (unsigned char c : text) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        auto folded = static_cast<std::uint32_t>(hash ^ (hash >> 32));
+        return folded == 0 ? 1 : folded;
+    }
+
+    // Slot holding the name, or the empty slot where it would go
+    std::size_t probe(std::string_view text, std::uint32_t hash) const {
+        std::size_t mask = slots.size() - 1;
+        std::size_t i = hash & mask;
+        while (slots[i].hash != 0) {
+            if (slots[i].hash == hash && names[slots[i].id] == text) {
+                return i;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2, Slot{0, 0});
+        old.swap(slots);
+        std::size_t mask = slots.size() - 1;
+        for (const Slot& slot : old) {
+            if (slot.hash != 0) {
+                std::size_t i = slot.hash & mask;
+                while (slots[i].hash != 0) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = slot;
+            }
+        }
+    }
+
+    // Copy the text into the arena
+    std::string_view store(std::string_view text) {
+        if (chunks.empty() || text.size() > CHUNK_SIZE - chunkUsed) {
+            chunks.emplace_back(new char[std::max(CHUNK_SIZE, text.size())]);
+            chunkUsed = 0;
+        }
+        char* place = chunks.back().get() + chunkUsed;
+        if (!text.empty()) {
+            std::memcpy(place, text.data(), text.size());
+        }
+        chunkUsed += text.size();
+        return std::string_view(place, text.size());
+    }
+
+public:
+    SymbolTable() : slots(1024, Slot{0, 0}) {}
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    // Id of the name, adding it if it is new
+    NameId intern(std::string_view text) {
+        std::uint32_t hash = hashOf(text);
+        std::size_t i = probe(text, hash);
+        if (slots[i].hash != 0) {
+            return slots[i].id;
+        }
+        auto id = static_cast<NameId>(names.size());
+        names.push_back(store(text));
+        slots[i] = Slot{hash, id};
+        if (names.size() * 2 > slots.size()) {  // Keep the load factor under 1/2
+            grow();
+        }
+        return id;
+    }
+
+    // Id of the name, NO_NAME if it was never interned
+    NameId find(std::string_view text) const {
+        std::uint32_t hash = hashOf(text);
+        const Slot& slot = slots[probe(text, hash)];
+        return slot.hash != 0 ? slot.id : NO_NAME;
+    }
+
+    // Text of an interned name
+    std::string_view name(NameId id) const {
+        return names[id];
+    }
+
+    // Forget every name, keeping the memory for reuse
+    void clear() {
+        std::fill(slots.begin(), slots.end(), Slot{0, 0});
+        names.clear();
+        if (chunks.size() > 1) {
+            chunks.resize(1);
+        }
+        chunkUsed = chunks.empty() ? CHUNK_SIZE : 0;
+    }
+
+    // Number of interned names; ids are 0 .. size() - 1
+    std::size_t size() const {
+        return names.size();
+    }
+};
+
+#endif //FANTASY_SYMBOLS_H
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Round trip of compressed scenarios and narration: a run from a .gz (and,
+# where zstd.h and libzstd are found, a .zst) scenario must narrate exactly
+# what the run from the plain file does, and the compressed narration must
+# decompress to it. Extra compiler and linker flags (e.g. -I and -L for
+# zstd) come from CXXFLAGS and LDFLAGS.
+#
+#     tests/compress_roundtrip.sh
+set -eu
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+CXXFLAGS=${CXXFLAGS:-}
+LDFLAGS=${LDFLAGS:-}
+
+codecs="gz"
+defines="-DFANTASY_ZLIB"
+libs="-lz"
+if echo '#include <zstd.h>' | g++ $CXXFLAGS -E -x c++ - > /dev/null 2>&1; then
+    codecs="gz zst"
+    defines="$defines -DFANTASY_ZSTD"
+    libs="$libs -lzstd"
+else
+    echo "zstd.h not found: zstd not tested"
+fi
+g++ -std=c++17 -O2 -Wall -pthread $CXXFLAGS $defines -o "$work/fantasy" "$root/main.cpp" $LDFLAGS $libs
+
+cd "$work"
+./fantasy --generate plain.txt --commands 200000 --seed 11
+failed=0
+for codec in $codecs; do
+    ./fantasy --generate "scenario.$codec" --commands 200000 --seed 11
+    for mode in serial pipeline; do
+        ./fantasy --input plain.txt --output "expected.$mode" --mode "$mode"
+        ./fantasy --input "scenario.$codec" --output "narration.$mode.$codec" --mode "$mode"
+        case $codec in
+            gz) decompress="gzip -dc" ;;
+            zst) decompress="zstd -dcq" ;;
+        esac
+        if ! command -v "${decompress%% *}" > /dev/null; then
+            echo "$codec $mode: no ${decompress%% *} to check the narration with"
+        elif ! $decompress "narration.$mode.$codec" | cmp -s - "expected.$mode"; then
+            echo "$codec $mode: narration differs"
+            failed=1
+        fi
+    done
+    head -c 100000 "scenario.$codec" > "cut.$codec"
+    if ./fantasy --input "cut.$codec" --output cut.out 2> /dev/null; then
+        echo "$codec: a cut-off scenario was not reported"
+        failed=1
+    fi
+done
+
+[ $failed = 0 ] && echo "compress round trip OK ($codecs)"
+exit $failed
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Resident memory must stay flat over a long create/kill loop read from a
+# memory-mapped file many times larger than InputReader::RELEASE_WINDOW:
+# dead characters and their items are not kept, and pages of the input that
+# have been read are let go. The peak RSS of the end-to-end --bench phase on
+# 500,000 rounds (about 110 MB of input) may exceed that on 20,000 rounds by
+# at most three release windows.
+# The rounds reuse the same names on purpose: SymbolTable never frees an
+# interned name, so a run that keeps inventing new names grows with their
+# number, and that is not what this test is about.
+#
+#     tests/flat_rss.sh
+set -eu
+
+. "$(dirname "$0")/rounds.sh"
+build_fantasy
+
+release_window_kib=$((8 << 10))     # InputReader::RELEASE_WINDOW
+cd "$work"
+rounds 20000 > short.txt
+rounds 500000 > long.txt
+
+failed=0
+for engine in objects soa; do
+    # Peak KiB of the end-to-end phase, the last column of its row
+    peak() {
+        ./fantasy --bench "$1" --engine "$engine" | awk '$1 == "end-to-end" { print $NF }'
+    }
+    short=$(peak short.txt)
+    long=$(peak long.txt)
+    if [ -z "$short" ] || [ -z "$long" ] || [ "$long" -gt $((short + 3 * release_window_kib)) ]; then
+        echo "$engine: peak RSS grew from ${short:-?} KiB to ${long:-?} KiB"
+        failed=1
+    fi
+done
+
+[ $failed = 0 ] && echo "flat RSS OK"
+exit $failed
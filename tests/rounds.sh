@@ -0,0 +1,30 @@
+#!/bin/bash
+# Shared by the tests that play the same town over and over: sourced, not run.
+# Sets root (the repository) and work (a scratch directory removed on exit),
+# and provides
+#     build_fantasy [FLAGS...]   build main.cpp into $work/fantasy with extra compiler flags
+#     rounds N                   print a scenario of N rounds in which a town of three
+#                                characters is created, armed and killed off
+#                                (a Hunter finishes the wizard)
+
+root=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+build_fantasy() {
+    g++ -std=c++17 -O2 -Wall -pthread "$@" -o "$work/fantasy" "$root/main.cpp"
+}
+
+# Ten commands a round, after the two that set up the Hunter
+rounds() {
+    echo $((2 + 10 * $1))
+    echo "Create character fighter Hunter 200"
+    echo "Create item weapon Hunter Axe 50"
+    awk -v n="$1" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            print "Create character fighter F 10\nCreate character archer A 10\nCreate character wizard W 10"
+            print "Create item potion W P 5\nDrink W F P\nCreate item weapon F S 15\nAttack F A S"
+            print "Create item spell W B 1 F\nCast W F B\nAttack Hunter W Axe"
+        }
+    }'
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Attack, Cast and Drink must not allocate once the world is warmed up. A
+# town of three characters is created, armed, and killed off the same way
+# round after round (a Hunter finishes the wizard); the instrumented build
+# reports its counters after the warm-up rounds and again at the end, and
+# the allocations of the three commands must not have moved in between.
+#
+#     tests/steady_allocations.sh
+set -eu
+
+. "$(dirname "$0")/rounds.sh"
+build_fantasy -DFANTASY_INSTRUMENT
+
+warmup=1000
+rounds=50000
+cd "$work"
+rounds $((warmup + rounds)) > rounds.txt
+
+failed=0
+for engine in objects soa; do
+    rm -f stats.jsonl
+    ./fantasy --input rounds.txt --output narration.txt --engine "$engine" \
+        --stats stats.jsonl --stats-every $((2 + 10 * warmup))
+    if [ "$(grep -c 'has died' narration.txt)" != $((3 * (warmup + rounds))) ]; then
+        echo "$engine: the rounds did not play out as planned"
+        failed=1
+        continue
+    fi
+    # Allocations of Attack, Cast and Drink after the warm-up and at the end
+    counts() {
+        sed -n "$1p" stats.jsonl | grep -o '"\(Attack\|Cast\|Drink\)":{[^}]*"allocations":[0-9]*' \
+            | sed 's/"\([A-Za-z]*\)".*"allocations":/\1=/' | tr '\n' ' '
+    }
+    warm=$(counts 1)
+    end=$(counts '$')
+    if [ "$warm" != "$end" ]; then
+        echo "$engine: steady-state commands allocated: after warm-up $warm, at the end $end"
+        failed=1
+    fi
+done
+
+[ $failed = 0 ] && echo "steady-state allocations OK"
+exit $failed
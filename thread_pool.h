@@ -0,0 +1,139 @@
+//
+// Overview: work-stealing thread pool.
+//
+// Every worker has its own task deque. Workers take their newest task first
+// and, when they run dry, steal the oldest task of another worker, so long and
+// short tasks even out across the cores without a single shared queue.
+//
+
+#ifndef FANTASY_THREAD_POOL_H
+#define FANTASY_THREAD_POOL_H
+
+#include "atomic"
+#include "condition_variable"
+#include "deque"
+#include "functional"
+#include "memory"
+#include "mutex"
+#include "thread"
+#include "vector"
+
+
+class WorkStealingPool {
+public:
+    // A task is told which worker runs it, so it can use per-worker state
+    using Task = std::function<void(unsigned worker)>;
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;     // One deque per worker
+    std::vector<std::thread> workers;
+    std::mutex sleepLock;                   // Guards sleeping and waking up
+    std::condition_variable wake;           // Signalled when work arrives or the pool stops
+    std::condition_variable idle;           // Signalled when the last pending task finishes
+    std::atomic<std::size_t> queued{0};     // Tasks sitting in the deques
+    std::atomic<std::size_t> pending{0};    // Tasks submitted but not finished
+    std::atomic<unsigned> nextQueue{0};     // Round robin position for submit()
+    bool stopping = false;
+
+    // Take a task: our own newest first, then the oldest of the others
+    bool tryPop(unsigned self, Task& task) {
+        {
+            Queue& own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i < queues.size(); i++) {
+            Queue& other = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(other.lock);
+            if (!other.tasks.empty()) {
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned self) {
+        while (true) {
+            Task task;
+            if (tryPop(self, task)) {
+                task(self);
+                if (--pending == 0) {
+                    std::lock_guard<std::mutex> guard(sleepLock);
+                    idle.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleepLock);
+            wake.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    // Start the workers; 0 means one per core
+    explicit WorkStealingPool(unsigned threads = 0) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Finish the queued tasks and stop the workers
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    unsigned size() const {
+        return static_cast<unsigned>(workers.size());
+    }
+
+    // Queue a task on the next worker in turn
+    void submit(Task task) {
+        pending++;
+        Queue& queue = *queues[nextQueue++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.tasks.push_back(std::move(task));
+        }
+        queued++;
+        std::lock_guard<std::mutex> guard(sleepLock);
+        wake.notify_one();
+    }
+
+    // Block until every submitted task has finished
+    void wait() {
+        std::unique_lock<std::mutex> guard(sleepLock);
+        idle.wait(guard, [this] { return pending == 0; });
+    }
+};
+
+#endif //FANTASY_THREAD_POOL_H